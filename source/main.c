@@ -1,6 +1,9 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
@@ -8,18 +11,32 @@
 #include <limits.h>
 #include <unistd.h>
 #include <locale.h>
+#include <wchar.h>
+#include <time.h>
 #include <ctype.h>
+#include <stdarg.h>
 #include <pthread.h>
 #include <signal.h>
 #include <pty.h>
+#include <spawn.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <poll.h>
 #include <termios.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <pwd.h>
+#include <regex.h>
 
 #include <ncurses.h>
 
+#include "width_table.h"
+#include "screen_export.h"
+
 #define LOGFILE_NAME "cursed.log"
 #define DEFAULT_SHELL "/bin/bash"
 //NOTE: used for testing
@@ -28,10 +45,90 @@
 #define UTF8_SIZE 4
 #define ESCAPE_BUFFER_SIZE (128 * UTF8_SIZE)
 #define ESCAPE_ARGUMENT_SIZE 16
+// NOTE: string sequence payloads are streamed, only these parts are ever buffered
+#define STR_HEADER_SIZE 16
+#define STR_ARENA_LIMIT (1 << 20)
+#define CLIPBOARD_LIMIT (16 << 20)
+#define TITLE_SIZE 256
+#define HYPERLINK_TABLE_SIZE (1 << 17)
+// NOTE: ids are 16 bits, and this many keeps the table at most half full
+#define HYPERLINK_MAX (HYPERLINK_TABLE_SIZE / 2 - 1)
+#define HYPERLINK_COLLECT_MIN 256
+// NOTE: longer uris are dropped, and live uris together are kept under the byte limit
+#define HYPERLINK_URI_SIZE 2048
+#define HYPERLINK_BYTES_LIMIT (4 << 20)
+#define PALETTE_SIZE 256
+#define VIEW_RUN_SIZE 4096
+// NOTE: panning left or right moves the view this many columns at a time
+#define VIEW_PAN_COLUMNS 8
+// NOTE: blinking glyphs are shown and hidden for this long each
+#define BLINK_PERIOD_NS 500000000ULL
+#define BLINK_SPAN_EMPTY ((BlinkSpan_t){INT32_MAX, -1})
+// NOTE: the direct output backend writes a frame of at most this many bytes, and erases runs of blanks at least this long
+#define VT_FRAME_LIMIT (16 << 20)
+#define VT_ERASE_MIN 8
+#define VT_RUNE_UNKNOWN 0xFFFFFFFFu
+#define VT_COLOR_UNKNOWN -2
+// NOTE: sixel images are sampled twice per cell, assuming cells of this many pixels
+#define SIXEL_CELL_WIDTH 10
+#define SIXEL_CELL_HEIGHT 20
+#define SIXEL_MAX_ROWS 128
+#define SIXEL_PALETTE_SIZE 256
+#define SIXEL_PARAMETER_SIZE 5
+#define SIXEL_CACHE_SIZE 8
 // NOTE: 60 fps limit
 #define DRAW_USEC_LIMIT 16666
+#define PIPELINE_RING_SIZE (1 << 20)
+#define SESSION_LOG_PIPE_SIZE (1 << 20)
+#define SESSION_LOG_ROTATE_SIZE (256 << 20)
+// NOTE: once the child has exited, how long output still in flight may take to reach the screen
+#define CHILD_DRAIN_NS 100000000ULL
+// NOTE: how long the start of a key sequence waits for the rest before it is sent as typed, a lone escape most likely
+#define KEY_SEQUENCE_TIMEOUT_NS 25000000ULL
+#define KEY_TRIE_SIZE 64
+// NOTE: shift page up opens the search prompt, and looks further back while it is open
+#define KEY_SEARCH "\033[5;2~"
+#define SEARCH_PATTERN_SIZE 256
+#define VIEW_STATUS_SIZE 512
+#define KEY_WAIT_EVENTS 3
+// NOTE: keys the child has not read yet are held up to this much, a paste into a program that is not reading say
+#define KEY_QUEUE_LIMIT (1 << 20)
 #define VT_IDENTIFIER "\033[?6c"
 #define TAB_SPACES 5
+#define FILL_CHUNK 32
+#define LOG_RING_SIZE 1024
+#define LOG_MESSAGE_SIZE 256
+#define LOG_SITE_BURST 10
+#define LOG_SITE_WINDOW_NS 1000000000ULL
+#define LOG_ROTATE_SIZE (8 << 20)
+#define STATS_FILE_NAME "cursed.stats"
+#define STATS_MAX_THREADS 8
+#define STATS_HISTOGRAM_BUCKETS 32
+#define STATS_OVERLAY_NS 1000000000ULL
+#define TRACE_FILE_NAME "cursed.trace.json"
+#define TRACE_RING_SIZE (1 << 16)
+#define TRACE_MAX_THREADS 8
+#define LATENCY_SAMPLES 8192
+#define LATENCY_TIMEOUT_NS 1000000000ULL
+#define LATENCY_ECHO_CHILD "/bin/cat"
+// NOTE: the startup benchmark's shell prompt, which nothing else cursed draws looks like
+#define STARTUP_PROMPT "ready>"
+#define STARTUP_TIMEOUT_MS 5000
+#define BENCH_PTY_BYTES (1ULL << 30)
+// NOTE: scrollback is a ring of this many lines, indexed in pages for search
+#define HISTORY_SIZE (1 << 20)
+#define HISTORY_PAGE_LINES 256
+#define HISTORY_TEXT_SIZE 4096
+// NOTE: history lines are handles into a pool of distinct lines, handle 0 is the empty line
+#define LINE_POOL_EMPTY 0
+// NOTE: recently stored lines are found by hash in an index this many slots big, in buckets of a cache line
+#define LINE_POOL_INDEX_SIZE (1 << 16)
+#define LINE_POOL_BUCKET 8
+#define TRIGRAM_BUCKETS (1 << 16)
+// NOTE: a rune with this bit set is the id of a cluster of a base and combining marks
+#define RUNE_CLUSTER_BIT 0x80000000u
+#define CLUSTER_MAX_RUNES 8
+#define CLUSTER_COLLECT_MIN 1024
 
 #define COLOR_BACKGROUND -1
 #define COLOR_FOREGROUND -1
@@ -44,7 +141,35 @@
 #define COLOR_BRIGHT_CYAN 14
 #define COLOR_BRIGHT_WHITE 15
 
-#define LOG(...) fprintf(g_log, __VA_ARGS__);
+// NOTE: messages above LOG_COMPILED_LEVEL are compiled out, the rest are filtered by g_log_level at runtime
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL LOG_LEVEL_DEBUG
+#endif
+#define LOG(level, ...) do{                                                 \
+          if((level) <= LOG_COMPILED_LEVEL && (level) <= g_log_level){    \
+               static LogSite_t log_site;                                  \
+               log_write(&log_site, (level), __VA_ARGS__);                 \
+          }                                                                \
+     }while(0)
+// NOTE: building with STATS_ENABLED=0 compiles the counters out to measure what they cost
+#ifndef STATS_ENABLED
+#define STATS_ENABLED 1
+#endif
+#define STATS_ADD(counter, n) __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define STAT_ADD(stat, n) do{                                               \
+          if(STATS_ENABLED) STATS_ADD(t_stats->counters[stat], (n));      \
+     }while(0)
+#define STAT_RECORD(histogram, value) do{                                   \
+          if(STATS_ENABLED) STATS_ADD(t_stats->histograms[histogram][stats_bucket(value)], 1); \
+     }while(0)
+// NOTE: spans are only recorded in builds with -DTRACE, otherwise TRACE_SCOPE() is nothing at all
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#ifdef TRACE
+#define TRACE_SCOPE(name) TraceSpan_t TRACE_CONCAT(trace_span_, __LINE__) __attribute__((cleanup(trace_end))) = trace_begin(name)
+#else
+#define TRACE_SCOPE(name)
+#endif
 #define ELEM_COUNT(static_array) (sizeof(static_array) / sizeof(static_array[0]))
 #define CLAMP(a, min, max) (a = (a < min) ? min : (a > max) ? max : a);
 #define BETWEEN(n, min, max) ((min <= n) && (n <= max))
@@ -53,6 +178,107 @@
 
 typedef uint_least32_t Rune_t;
 
+enum{
+     LOG_LEVEL_ERROR,
+     LOG_LEVEL_WARN,
+     LOG_LEVEL_INFO,
+     LOG_LEVEL_DEBUG,
+};
+
+typedef struct{
+     uint64_t window_start;
+     uint32_t count;
+     uint32_t suppressed;
+}LogSite_t;
+
+typedef struct{
+     uint64_t sequence; // which lap of the ring the slot is ready for
+     int      level;
+     uint32_t suppressed;
+     uint64_t time;
+     char     message[LOG_MESSAGE_SIZE];
+}LogRecord_t;
+
+typedef struct{
+     LogRecord_t records[LOG_RING_SIZE];
+     uint64_t    tail;    // next slot a producer claims
+     uint64_t    head;    // next slot the log thread writes out
+     uint64_t    dropped;
+     uint64_t    start_time;
+     uint64_t    file_size;
+     char        path[PATH_MAX];
+     pthread_t   thread;
+     int         wake;     // eventfd producers signal when they find the log thread asleep
+     bool        sleeping;
+     bool        running;
+     bool        stop;
+}Logger_t;
+
+typedef enum{
+     STAT_BYTES_PARSED,
+     STAT_DROPPED_BYTES,
+     STAT_READS,
+     STAT_BYTES_READ,
+     STAT_RING_FULL,
+     STAT_RUNES,
+     STAT_CONTROL_CODES,
+     STAT_ESC,
+     STAT_CSI,
+     STAT_STR,
+     STAT_UNHANDLED,
+     STAT_SCROLLS,
+     STAT_FRAMES,
+     STAT_FRAME_NS,
+     STAT_DIRTY_ROWS,
+     STAT_OUTPUT_BYTES,
+     STAT_COUNT
+}Stat_t;
+
+typedef enum{
+     HISTOGRAM_READ_BYTES,
+     HISTOGRAM_DIRTY_ROWS,
+     HISTOGRAM_FRAME_NS,
+     HISTOGRAM_COUNT
+}Histogram_t;
+
+// only the owning thread writes to its shard, so counting is a plain add that other threads may read at any time
+typedef struct{
+     const char* name;
+     uint64_t    counters[STAT_COUNT];
+     uint64_t    csi_finals[64]; // csi sequences by final byte, 0x40 - 0x7F
+     uint64_t    histograms[HISTOGRAM_COUNT][STATS_HISTOGRAM_BUCKETS]; // bucket b holds values below 2^b
+}__attribute__((aligned(64))) StatsShard_t;
+
+typedef struct{
+     const char* name;
+     uint64_t    start;
+}TraceSpan_t;
+
+typedef struct{
+     const char* name;
+     uint64_t    start;
+     uint64_t    duration;
+}TraceEvent_t;
+
+// written only by its thread, which publishes each event by advancing head
+typedef struct{
+     const char*  name;
+     uint64_t     head; // events recorded so far, the ring keeps the last TRACE_RING_SIZE
+     TraceEvent_t events[TRACE_RING_SIZE];
+}TraceRing_t;
+
+// one key at a time is followed from the write to the pty, to the parser putting its echo in a cell, to the
+// wrefresh() that shows it
+typedef struct{
+     bool     enabled;
+     Rune_t   rune;   // key waiting for its echo, 0 when none is in flight
+     uint64_t sent;
+     uint64_t echoed; // when the parser wrote the key to a cell, 0 until it has
+     uint64_t echo_ns[LATENCY_SAMPLES];
+     uint64_t display_ns[LATENCY_SAMPLES];
+     uint64_t count;
+}LatencyProbe_t;
+
 typedef enum{
      GLYPH_ATTRIBUTE_NONE       = 0,
      GLYPH_ATTRIBUTE_BOLD       = 1 << 0,
@@ -121,10 +347,32 @@ typedef enum{
 typedef struct{
      Rune_t   rune;
      uint16_t attributes;
+     uint16_t link; // hyperlink id, 0 for none
      int32_t foreground;
      int32_t background;
 }Glyph_t;
 
+// an erase to the end of a row is recorded here instead of being written to every cell, the cells are only
+// filled in when something needs to write to the row
+typedef struct{
+     int32_t from; // cells from here to the end of the row read as blank, columns when the row has no fill
+     Glyph_t blank;
+}RowFill_t;
+
+// the columns of a row that may hold blinking glyphs, which every glyph that blinks is inside of, empty when from > to
+typedef struct{
+     int32_t from;
+     int32_t to;
+}BlinkSpan_t;
+
+// rows of a region moving up or down since the last snapshot, so the renderer can move what it already drew rather
+// than draw them again
+typedef struct{
+     int32_t top;
+     int32_t bottom;
+     int32_t count; // rows moved up, negative for down, 0 when nothing moved
+}Scroll_t;
+
 typedef struct{
      Glyph_t attributes;
      int32_t x;
@@ -141,21 +389,184 @@ typedef struct{
      char mode[2];
 }CSIEscape_t;
 
+struct STRHandler_t;
+
+typedef enum{
+     CLIPBOARD_STATE_SELECTION, // before the ';' that starts the data
+     CLIPBOARD_STATE_DATA,
+     CLIPBOARD_STATE_QUERY,     // '?' asks for the selection, which is never answered
+}ClipboardState_t;
+
 typedef struct{
      char type;
-     char buffer[ESCAPE_BUFFER_SIZE];
-     uint32_t buffer_length;
-     char* arguments[ESCAPE_ARGUMENT_SIZE];
-     uint32_t argument_count;
+     char header[STR_HEADER_SIZE]; // selector buffered until we know which handler gets the payload
+     uint32_t header_length;
+     const struct STRHandler_t* handler;
+     int32_t field;  // which ';' separated field of the payload the handler is in
+     uint32_t base64_bits;
+     int32_t base64_count;
+     ClipboardState_t clipboard;
 }STREscape_t;
 
+typedef struct{
+     char*  data;
+     size_t length;
+     size_t capacity;
+     size_t limit;
+     size_t dropped;
+}Arena_t;
+
+typedef enum{
+     SIXEL_STATE_DATA,
+     SIXEL_STATE_REPEAT,
+     SIXEL_STATE_COLOR,
+     SIXEL_STATE_RASTER,
+}SixelState_t;
+
+typedef struct{
+     uint64_t hash;
+     uint64_t last_used;
+     int32_t  columns;
+     int32_t  rows;
+     Glyph_t* cells;
+}SixelImage_t;
+
+typedef struct{
+     SixelState_t state;
+     int          params[SIXEL_PARAMETER_SIZE];
+     int          param_count;
+     int32_t      palette[SIXEL_PALETTE_SIZE];
+     int          color;
+     int          x;           // in pixels
+     int          band;        // bands are 6 pixels tall
+     int          width;       // extent of the image in pixels
+     int          height;
+     int          sample_row;  // row of samples whose centers fall in the current band, or -1
+     int          sample_bit;
+     int32_t*     samples;     // rgb of the pixel at the center of each half cell, -1 where unset
+     int          sample_columns;
+     int          sample_rows;
+     uint64_t     hash;        // of the payload, decoded images are cached by it
+     SixelImage_t cache[SIXEL_CACHE_SIZE];
+     uint64_t     cache_clock;
+}Sixel_t;
+
+typedef struct{
+     char*    uri; // NULL when the slot is free
+     uint32_t hash;
+     bool     marked;
+}Hyperlink_t;
+
+typedef struct{
+     Hyperlink_t* links; // links[id - 1]
+     uint32_t     count;
+     uint32_t     capacity;
+     uint16_t*    free;
+     uint32_t     free_count;
+     uint16_t*    table; // open addressed ids, 0 is empty
+     uint32_t     live;
+     size_t       bytes; // of the live uris
+     uint32_t     interned; // new uris asked for since the last collection
+     uint32_t     collect_at; // number of them that triggers the next collection
+}Hyperlinks_t;
+
+typedef struct{
+     Rune_t   runes[CLUSTER_MAX_RUNES];
+     uint32_t count; // 0 when the slot is free
+     uint32_t hash;
+     bool     marked;
+}Cluster_t;
+
+typedef struct{
+     Cluster_t* clusters;
+     uint32_t   count;
+     uint32_t   capacity;
+     uint32_t*  free;
+     uint32_t   free_count;
+     uint32_t*  table; // open addressed, id + 1, 0 is empty
+     uint32_t   table_size;
+     uint32_t   live;
+     uint32_t   collect_at; // number of live clusters that triggers the next collection
+}Clusters_t;
+
+typedef struct{
+     Glyph_t* glyphs;
+     int32_t  length;
+     uint32_t references; // history lines with its handle, 0 when the slot is free
+     uint32_t page;       // last history page its trigrams went into
+     bool     clusters;   // whether any glyph refers to a cluster
+     bool     links;      // whether any glyph has a hyperlink
+}HistoryLine_t;
+
+typedef struct{
+     HistoryLine_t* lines; // indexed by handle
+     uint32_t       count;
+     uint32_t       capacity;
+     uint32_t*      free;
+     uint32_t       free_count;
+     uint64_t*      index; // hash << 32 | handle + 1, 0 is empty, entries may outlive their line
+     uint32_t       victim; // next slot of a full bucket to replace
+     uint32_t       live;
+}LinePool_t;
+
+typedef struct{
+     uint32_t* pages;
+     uint32_t  count;
+     uint32_t  capacity;
+}TrigramPostings_t;
+
+typedef struct{
+     uint32_t*          lines;    // ring buffer of pool handles indexed by absolute line number
+     LinePool_t         pool;
+     int64_t            start;    // absolute line number of the oldest line kept
+     int64_t            end;      // absolute line number one past the newest line
+     TrigramPostings_t* trigrams; // for each trigram bucket, ascending pages containing it
+     uint64_t*          page_trigrams; // buckets seen in the page being filled, flushed when it completes
+     Clusters_t*        clusters;
+     bool               indexed;  // lines go into the trigram index, only turned off to measure what it costs
+}History_t;
+
+// what the shell says with OSC 133 about where its prompts, commands and their output are
+typedef enum{
+     MARK_PROMPT   = 'A',
+     MARK_COMMAND  = 'B', // the prompt ends, what is typed from here is the command
+     MARK_OUTPUT   = 'C',
+     MARK_FINISHED = 'D',
+}MarkKind_t;
+
+typedef struct{
+     int64_t  line;    // absolute, as history numbers its lines, the screen's rows follow on from history.end
+     uint64_t command; // counted by prompts, what the marks after a prompt belong to
+     int32_t  status;  // the exit status a MARK_FINISHED gave, -1 without one
+     uint16_t column;
+     uint8_t  kind;
+}Mark_t;
+
+// sorted by position, from first on, so lookups by line or command are binary searches. marks for lines history has
+// dropped are dropped too, and a mark placed before others means what they marked was drawn over
+typedef struct{
+     Mark_t*  marks;
+     uint32_t first;
+     uint32_t count;
+     uint32_t capacity;
+     uint64_t commands; // prompts seen
+}Marks_t;
+
 typedef struct{
      int            file_descriptor;
      int32_t        rows;
      int32_t        columns;
      Glyph_t**      lines;
      Glyph_t**      alternate_lines;
-     bool*          dirty_lines;
+     RowFill_t*     fills; // one per row of lines, swapped along with them
+     RowFill_t*     alternate_fills;
+     BlinkSpan_t*   blinks; // one per row of lines, swapped along with them
+     BlinkSpan_t*   alternate_blinks;
+     uint64_t*      line_generations; // when each row last changed, moved along with the row when it scrolls
+     uint64_t       generation;       // what rows changing now are stamped with, one past what was last handed out
+     Scroll_t       scroll;           // how rows moved since scroll_base, the last of it in scroll_generation
+     uint64_t       scroll_base;
+     uint64_t       scroll_generation;
      Cursor_t       cursor;
      int32_t        top;
      int32_t        bottom;
@@ -168,11 +579,110 @@ typedef struct{
      int32_t*       tabs;
      CSIEscape_t    csi_escape;
      STREscape_t    str_escape;
+     Arena_t        str_arena;
+     Arena_t        clipboard;
+     bool           clipboard_ready; // a selection was set since the view last took it
+     char           title[TITLE_SIZE];
+     bool           title_dirty;
+     Hyperlinks_t   hyperlinks;
+     int32_t        palette[PALETTE_SIZE]; // 0xRRGGBB set by OSC 4, -1 for the default
+     bool           palette_dirty;
+     Sixel_t        sixel;
+     Clusters_t     clusters;
+     History_t      history;
+     Marks_t        marks;
+     pthread_mutex_t lock; // held by the parser while it applies a chunk and by the renderer while it takes a snapshot
 }Terminal_t;
 
+typedef struct STRHandler_t{
+     void (*data)(Terminal_t* terminal, const char* data, size_t length);
+     void (*end)(Terminal_t* terminal);
+}STRHandler_t;
+
+// what a key does to the view instead of going to the child, while the screen does not fit on the host
+typedef enum{
+     KEY_ACTION_NONE,
+     KEY_ACTION_PAN_UP,
+     KEY_ACTION_PAN_DOWN,
+     KEY_ACTION_PAN_RIGHT,
+     KEY_ACTION_PAN_LEFT,
+     KEY_ACTION_FOLLOW,
+     KEY_ACTION_SEARCH,      // look for the pattern further back in the history
+     KEY_ACTION_SEARCH_EDIT, // the pattern changed or the prompt closed, look again from the newest line
+     KEY_ACTION_COUNT,
+}KeyAction_t;
+
+// a key the host sends that the child expects differently depending on a mode it set
+typedef struct{
+     const char*    sequence;
+     const char*    normal;      // sent while the mode is off, never longer than the sequence
+     const char*    application; // and while it is on
+     TerminalMode_t mode;
+     KeyAction_t    action;      // taken instead when actions are, the key goes to the child as normal otherwise
+}KeySequence_t;
+
+typedef struct{
+     uint8_t  byte;
+     uint8_t  sequence; // 1 + index into g_key_sequences when a sequence ends here
+     uint16_t child;    // first node a byte further in, 0 for none since the root is nobody's child
+     uint16_t sibling;
+}KeyTrieNode_t;
+
+// keys read from the host on the main loop and written on to the child
+typedef struct{
+     Terminal_t* terminal;
+     int         file_descriptor; // -1 once the host has gone away
+     char        buffer[BUFSIZ];  // starts with the part of a sequence held back from the last read
+     int         pending;
+     uint64_t    pending_deadline;
+     uint32_t    take_actions; // a bit per action whose key is kept from the child
+     int32_t     actions[KEY_ACTION_COUNT]; // taken since the view last applied them
+     bool        searching; // keys edit the search pattern instead of going to the child
+     char        search[SEARCH_PATTERN_SIZE];
+     int         search_length;
+     Arena_t     queued; // keys the pty had no room for yet, written as it makes room
+}KeyInput_t;
+
+// single producer single consumer, each side only writes its own index
+typedef struct{
+     char*    data;
+     uint64_t size; // a power of two
+     uint64_t head __attribute__((aligned(64))); // bytes ever written, advanced by the producer
+     uint64_t tail __attribute__((aligned(64))); // bytes ever read, advanced by the consumer
+     int      data_ready;  // eventfd the producer signals when the consumer may have found the ring empty
+     int      space_ready; // eventfd the consumer signals when the producer may have found the ring full
+}ByteRing_t;
+
+// a transcript of everything the child writes. the pty is spliced into a pipe whose pages are tee()d into another,
+// which a thread of its own splices into the file, so the bytes never pass through user space on their way there
+typedef struct{
+     int       output[2]; // pty output, read out into the ring by the reader
+     int       log[2];    // the same pages, written out by the log thread. the write end is closed once the log fails
+     int       file;
+     uint64_t  file_size;
+     int       rotations;
+     char      path[PATH_MAX];
+     pthread_t thread;
+     bool      failed;    // set by the log thread when it can no longer write the file
+}SessionLog_t;
+
+// the reader moves pty output into the ring, the parser applies it to the terminal and tells the renderer a frame is
+// ready, so a slow parse or draw never keeps the pty from being drained
 typedef struct{
      Terminal_t* terminal;
-}TTYThreadData_t;
+     ByteRing_t  ring;
+     int         frame_ready; // eventfd the parser signals when there is something new to draw
+     bool        frame_pending;
+     bool        eof;         // set by the reader once the child's side of the pty has closed
+     bool        drained;     // set by the parser once it has parsed everything the reader read before that
+     pthread_t   reader;
+     pthread_t   parser;
+     SessionLog_t* session_log; // NULL unless the output is being kept
+     pid_t       child;
+     int         child_signal; // signalfd of SIGCHLD, -1 when nobody watches the child
+     int         child_status; // from waitpid(), once the child has exited
+     uint64_t    child_exited; // when the child was reaped, 0 until then
+}Pipeline_t;
 
 typedef struct{
      int32_t foreground;
@@ -184,1517 +694,7331 @@ typedef struct{
      ColorPair_t pairs[256]; // NOTE: this is what COLOR_PAIRS was for me (which is for some reason not const?)
 }ColorDefs_t;
 
+typedef struct{
+     WINDOW*       window;
+     ColorDefs_t   color_defs;
+     int32_t       color_pair;
+     int32_t       last_color_foreground;
+     int32_t       last_color_background;
+     int32_t       applied_palette[PALETTE_SIZE];
+     short         default_palette[PALETTE_SIZE][3];
+     wchar_t       run[VIEW_RUN_SIZE]; // glyphs waiting to be drawn together
+     int           run_length;
+     Glyph_t**     lines;  // the terminal's rows as of the last snapshot
+     bool*         dirty;
+     bool*         copied; // rows that refer to copied clusters or links, which are copied again every snapshot
+     Scroll_t      scroll; // how the rows moved since the last snapshot, already applied to lines
+     uint64_t      generation; // of the terminal, as of the last snapshot
+     int32_t       viewport_x; // the cell drawn at the window's top left, when the screen does not fit the window
+     int32_t       viewport_y;
+     int32_t       viewport_rows; // cells of the screen the window shows
+     int32_t       viewport_columns;
+     int32_t       drawn_x;    // where the viewport was as of the last frame, panning only moves viewport_x and y
+     int32_t       drawn_y;
+     bool          follow;     // move the viewport to keep the cursor in it, until panned away by hand
+     Scroll_t      viewport_scroll; // the part of scroll the window shows, in rows of the viewport
+     BlinkSpan_t*  blinks;     // the terminal's, as of the last snapshot
+     int32_t       blink_rows; // how many of them are not empty
+     bool          blink_off;  // blinking glyphs are drawn blank
+     bool          blink_flip; // they were flipped this frame, their spans are drawn again
+     uint64_t      blink_deadline; // of the next flip, while blink_rows
+     bool          searching;  // the search prompt is open
+     int64_t       search_match; // absolute history line the search prompt found last, -1 for none
+     bool          scrolled_back; // the rows show the history around search_match rather than the screen
+     char          search_status[VIEW_STATUS_SIZE]; // the prompt and what it found, drawn over the bottom border
+     int32_t       rows;
+     int32_t       columns;
+     int32_t       cursor_x;
+     int32_t       cursor_y;
+     int32_t       palette[PALETTE_SIZE];
+     bool          palette_dirty;
+     Cluster_t*    clusters; // copies of the clusters used by the dirty rows, glyphs refer to them by index
+     uint32_t      cluster_count;
+     uint32_t      cluster_capacity;
+     Arena_t       link_uris; // copies of the uris of the links used by the dirty rows, each nul terminated
+     uint32_t*     links;     // where each starts in link_uris, glyphs refer to them by index + 1
+     uint32_t      link_count;
+     uint32_t      link_capacity;
+     char          title[TITLE_SIZE];
+     bool          title_dirty;
+     Arena_t       clipboard; // a selection the child set, handed to the host while clipboard_ready
+     bool          clipboard_ready;
+}View_t;
+
+// draws the view with escape sequences of its own rather than through curses, which is still used for input
+typedef struct{
+     int        file_descriptor;
+     Arena_t    frame;      // escape sequences of the frame being built, written out with a single write()
+     Glyph_t**  screen;     // what the window should show, border included
+     Glyph_t**  shadow;     // what the host is showing in the window
+     bool*      dirty;      // rows of screen that may differ from shadow
+     Cluster_t* clusters;   // the view's, which the rows copied this frame refer to
+     Arena_t*   link_uris;  // the view's, as are the links the rows copied this frame refer to
+     uint32_t*  links;
+     uint16_t   link;       // the link the host has open, 0 for none
+     int32_t    rows;       // of the window, the view's plus the border
+     int32_t    columns;
+     int32_t    x;          // host position of the window's top left corner
+     int32_t    y;
+     int32_t    cursor_x;   // host cursor in window coordinates, -1 when unknown
+     int32_t    cursor_y;
+     int32_t    foreground; // host colors, VT_COLOR_UNKNOWN when unknown
+     int32_t    background;
+     Scroll_t   scroll;     // of the view's rows, for the host to do at the start of the next flush
+}VTOutput_t;
+
+// the view published in shared memory for other processes to read, see screen_export.h
+typedef struct{
+     ScreenExport_t* shared;
+     size_t          size;
+     uint32_t        rows;    // what was published last, a screen of another size is published whole
+     uint32_t        columns;
+     char            name[NAME_MAX];
+}ScreenExporter_t;
+
 FILE* g_log = NULL;
+Logger_t g_logger;
+int g_log_level = LOG_LEVEL_INFO;
+StatsShard_t g_stats[STATS_MAX_THREADS] = {{.name = "main"}};
+int g_stats_thread_count = 1;
+__thread StatsShard_t* t_stats = g_stats; // threads that never register count into the main shard
+volatile sig_atomic_t g_stats_requested = 0;
+TraceRing_t* g_trace_rings[TRACE_MAX_THREADS];
+int g_trace_thread_count = 0;
+__thread TraceRing_t* t_trace = NULL;
+LatencyProbe_t g_latency;
+bool g_stats_overlay = false;
+bool g_vt_output = false; // draw with escape sequences of our own instead of curses
+bool g_hold = false; // keep showing the final screen after the child exits, until a key is pressed
+const char* g_session_log_path = NULL; // where to keep a transcript of the child's output, if anywhere
+const char* g_screen_export_name = NULL; // shared memory object to publish the screen in, if any
+int g_screen_columns = 80;
+int g_screen_rows = 24;
 bool g_quit = false;
+int g_color_count = 8;
 
 Cursor_t g_cursor[2];
 
 bool tty_write(int file_descriptor, const char* string, size_t len);
+void log_write(LogSite_t* site, int level, const char* format, ...) __attribute__((format(printf, 3, 4)));
 void str_handle(Terminal_t* terminal);
+void latency_report(FILE* file);
 void str_sequence(Terminal_t* terminal, Rune_t rune);
 bool utf8_decode(const char* buffer, size_t buffer_len, size_t* len, Rune_t* u);
 bool utf8_encode(Rune_t u, char* buffer, size_t buffer_len, int* len);
 
-bool is_controller_c0(Rune_t rune)
+// columns the rune takes up: 0 for combining marks, 2 for east asian wide and fullwidth
+int rune_width(Rune_t rune)
 {
-     if(BETWEEN(rune, 0, 0x1f) || rune == '\177'){
-          return true;
-     }
+     if(rune >= 0x110000) return 1;
 
-     return false;
+     const uint8_t* block = g_width_table[g_width_blocks[rune >> WIDTH_BLOCK_BITS]];
+     uint32_t offset = rune & ((1 << WIDTH_BLOCK_BITS) - 1);
+     return (block[offset >> 2] >> ((offset & 3) * 2)) & 3;
 }
 
-bool is_controller_c1(Rune_t rune)
+uint64_t time_nanoseconds()
 {
-     if(BETWEEN(rune, 0x80, 0x9f)){
-          return true;
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     return (uint64_t)(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+}
+
+const char* g_log_level_names[] = {"error", "warn", "info", "debug"};
+
+uint64_t log_clock()
+{
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+     return (uint64_t)(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+}
+
+// lets a call site through LOG_SITE_BURST times per window, counting what it holds back
+bool log_site_allow(LogSite_t* site, uint64_t now, uint32_t* suppressed)
+{
+     uint64_t window_start = __atomic_load_n(&site->window_start, __ATOMIC_RELAXED);
+
+     *suppressed = 0;
+     if(now - window_start >= LOG_SITE_WINDOW_NS){
+          if(__atomic_compare_exchange_n(&site->window_start, &window_start, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+               *suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+               __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+          }
      }
 
+     if(__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) < LOG_SITE_BURST) return true;
+
+     __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
      return false;
 }
 
-bool is_controller(Rune_t rune)
+// formats the message into the next free slot of the ring, never blocks: when the ring is full
+// the message is dropped and counted
+void log_write(LogSite_t* site, int level, const char* format, ...)
 {
-     if(is_controller_c0(rune)) return true;
-     if(is_controller_c1(rune)) return true;
+     Logger_t* logger = &g_logger;
+     uint64_t now = log_clock();
+     uint32_t suppressed = 0;
 
-     return false;
+     if(!log_site_allow(site, now, &suppressed)) return;
+
+     uint64_t position = __atomic_load_n(&logger->tail, __ATOMIC_RELAXED);
+     LogRecord_t* record = NULL;
+
+     while(true){
+          record = logger->records + (position & (LOG_RING_SIZE - 1));
+          uint64_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+          int64_t difference = (int64_t)(sequence) - (int64_t)(position);
+
+          if(difference == 0){
+               if(__atomic_compare_exchange_n(&logger->tail, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                    break;
+               }
+          }else if(difference < 0){
+               __atomic_fetch_add(&logger->dropped, 1, __ATOMIC_RELAXED);
+               return;
+          }else{
+               position = __atomic_load_n(&logger->tail, __ATOMIC_RELAXED);
+          }
+     }
+
+     record->level = level;
+     record->time = now;
+     record->suppressed = suppressed;
+
+     va_list args;
+     va_start(args, format);
+     vsnprintf(record->message, LOG_MESSAGE_SIZE, format, args);
+     va_end(args);
+
+     __atomic_store_n(&record->sequence, position + 1, __ATOMIC_SEQ_CST);
+     if(__atomic_load_n(&logger->sleeping, __ATOMIC_SEQ_CST)) eventfd_write(logger->wake, 1);
 }
 
-void csi_reset(CSIEscape_t* csi)
+void log_rotate(Logger_t* logger)
 {
-     memset(csi, 0, sizeof(*csi));
+     char rotated[PATH_MAX + 3];
+
+     fclose(g_log);
+     snprintf(rotated, sizeof(rotated), "%s.1", logger->path);
+     rename(logger->path, rotated);
+
+     g_log = fopen(logger->path, "w");
+     logger->file_size = 0;
 }
 
-void csi_parse(CSIEscape_t* csi)
+// writes out everything in the ring, returns whether there was anything
+bool log_drain(Logger_t* logger)
 {
-     char* str = csi->buffer;
-     char* end = NULL;
-     long int value = 0;
+     bool drained = false;
 
-     csi->argument_count = 0;
+     while(true){
+          LogRecord_t* record = logger->records + (logger->head & (LOG_RING_SIZE - 1));
+          if(__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != logger->head + 1) break;
+
+          if(g_log){
+               double seconds = (double)(record->time - logger->start_time) / 1000000000.0;
+               if(record->suppressed){
+                    logger->file_size += fprintf(g_log, "[%10.3f] %-5s (suppressed %u similar messages)\n", seconds,
+                                                 g_log_level_names[record->level], record->suppressed);
+               }
+               logger->file_size += fprintf(g_log, "[%10.3f] %-5s %s", seconds, g_log_level_names[record->level], record->message);
+          }
 
-     if(*str == '?'){
-          csi->private = 1;
-          str++;
+          __atomic_store_n(&record->sequence, logger->head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+          logger->head++;
+          drained = true;
      }
 
-     csi->buffer[csi->buffer_length] = 0;
-     while(str < csi->buffer + csi->buffer_length){
-          end = NULL;
-          value = strtol(str, &end, 10);
+     uint64_t dropped = __atomic_exchange_n(&logger->dropped, 0, __ATOMIC_RELAXED);
+     if(dropped && g_log){
+          logger->file_size += fprintf(g_log, "(log ring full, dropped %lu messages)\n", (unsigned long)(dropped));
+          drained = true;
+     }
 
-          if(end == str) value = 0;
-          else if(value == LONG_MAX || value == LONG_MIN) value = -1;
+     if(drained && g_log){
+          fflush(g_log);
+          if(logger->file_size >= LOG_ROTATE_SIZE) log_rotate(logger);
+     }
 
-          csi->arguments[csi->argument_count] = value;
-          csi->argument_count++;
+     return drained;
+}
 
-          str = end;
+void* log_thread(void* data)
+{
+     Logger_t* logger = data;
 
-          if(*str != ';' || csi->argument_count == ESCAPE_ARGUMENT_SIZE) break;
+     while(!__atomic_load_n(&logger->stop, __ATOMIC_ACQUIRE)){
+          if(log_drain(logger)) continue;
 
-          str++;
+          // sleeps until a message comes, looking at the ring once more after saying so in case one just did
+          __atomic_store_n(&logger->sleeping, true, __ATOMIC_SEQ_CST);
+          __atomic_thread_fence(__ATOMIC_SEQ_CST);
+          if(!log_drain(logger) && !__atomic_load_n(&logger->stop, __ATOMIC_ACQUIRE)){
+               eventfd_t count;
+               eventfd_read(logger->wake, &count);
+          }
+          __atomic_store_n(&logger->sleeping, false, __ATOMIC_RELAXED);
      }
 
-     csi->mode[0] = *str++;
-     csi->mode[1] = (str < (csi->buffer + csi->buffer_length)) ? *str : 0;
+     log_drain(logger);
+     return NULL;
 }
 
-void terminal_move_cursor_to(Terminal_t* terminal, int x, int y)
+bool log_start(const char* path)
 {
-     int min_y;
-     int max_y;
+     Logger_t* logger = &g_logger;
 
-     if(terminal->cursor.state & CURSOR_STATE_ORIGIN){
-          min_y = terminal->top;
-          max_y = terminal->bottom;
-     }else{
-          min_y = 0;
-          max_y = terminal->rows - 1;
+     for(uint64_t i = 0; i < LOG_RING_SIZE; ++i) logger->records[i].sequence = i;
+     logger->head = 0;
+     logger->tail = 0;
+     logger->start_time = log_clock();
+     snprintf(logger->path, sizeof(logger->path), "%s", path);
+
+     logger->wake = eventfd(0, EFD_CLOEXEC);
+     if(logger->wake < 0) return false;
+
+     g_log = fopen(path, "w");
+     if(!g_log) return false;
+
+     if(pthread_create(&logger->thread, NULL, log_thread, logger) != 0){
+          fclose(g_log);
+          g_log = NULL;
+          return false;
      }
 
-     terminal->cursor.state &= ~CURSOR_STATE_WRAPNEXT;
-     terminal->cursor.x = CLAMP(x, 0, terminal->columns - 1);
-     terminal->cursor.y = CLAMP(y, min_y, max_y);
+     logger->running = true;
+     return true;
 }
 
-void terminal_move_cursor_to_absolute(Terminal_t* terminal, int x, int y)
+void log_stop()
 {
-	terminal_move_cursor_to(terminal, x, y + ((terminal->cursor.state & CURSOR_STATE_ORIGIN) ? terminal->top : 0));
+     Logger_t* logger = &g_logger;
+
+     if(logger->running){
+          __atomic_store_n(&logger->stop, true, __ATOMIC_SEQ_CST);
+          eventfd_write(logger->wake, 1);
+          pthread_join(logger->thread, NULL);
+          logger->running = false;
+     }
 
+     if(g_log) fclose(g_log);
+     g_log = NULL;
 }
 
-void terminal_set_glyph(Terminal_t* terminal, Rune_t rune, Glyph_t* attributes, int x, int y)
+const char* g_stat_names[STAT_COUNT] = {
+     "bytes_parsed", "dropped_bytes", "reads", "bytes_read", "ring_full", "runes", "control_codes", "esc", "csi", "str", "unhandled",
+     "scrolled_lines", "frames", "frame_ns", "dirty_rows",
+     "output_bytes",
+};
+
+const char* g_histogram_names[HISTOGRAM_COUNT] = {"read_bytes", "dirty_rows", "frame_ns"};
+
+int stats_bucket(uint64_t value)
 {
-     terminal->dirty_lines[y] = true;
-     terminal->lines[y][x] = *attributes;
-     terminal->lines[y][x].rune = rune;
+     int bucket = value ? 64 - __builtin_clzll(value) : 0;
+     return (bucket < STATS_HISTOGRAM_BUCKETS) ? bucket : STATS_HISTOGRAM_BUCKETS - 1;
 }
 
-void terminal_clear_region(Terminal_t* terminal, int left, int top, int right, int bottom)
+// gives the calling thread a shard of its own, falls back to the shared main shard when they run out
+void stats_thread(const char* name)
 {
-     // probably going to assert since we are going to trust external data
-     if(left > right){
-          int tmp = left;
-          left = right;
-          right = tmp;
-     }
-
-     if(top > bottom){
-          int tmp = top;
-          top = bottom;
-          bottom = tmp;
-     }
-
-     CLAMP(left, 0, terminal->columns - 1);
-     CLAMP(right, 0, terminal->columns - 1);
-     CLAMP(top, 0, terminal->rows - 1);
-     CLAMP(bottom, 0, terminal->rows - 1);
+     int index = __atomic_fetch_add(&g_stats_thread_count, 1, __ATOMIC_RELAXED);
+     if(index >= STATS_MAX_THREADS) return;
 
-     for(int y = top; y <= bottom; ++y){
-          terminal->dirty_lines[y] = true;
+     __atomic_store_n(&g_stats[index].name, name, __ATOMIC_RELEASE);
+     t_stats = g_stats + index;
+}
 
-          for(int x = left; x <= right; ++x){
-               Glyph_t* glyph = terminal->lines[y] + x;
-               glyph->foreground = terminal->cursor.attributes.foreground;
-               glyph->background = terminal->cursor.attributes.background;
-               glyph->attributes = 0;
-               glyph->rune = ' ';
+void stats_merge(StatsShard_t* total, StatsShard_t* shard)
+{
+     for(int i = 0; i < STAT_COUNT; ++i) total->counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+     for(int i = 0; i < ELEM_COUNT(shard->csi_finals); ++i) total->csi_finals[i] += __atomic_load_n(&shard->csi_finals[i], __ATOMIC_RELAXED);
+     for(int h = 0; h < HISTOGRAM_COUNT; ++h){
+          for(int b = 0; b < STATS_HISTOGRAM_BUCKETS; ++b){
+               total->histograms[h][b] += __atomic_load_n(&shard->histograms[h][b], __ATOMIC_RELAXED);
           }
      }
 }
 
-void terminal_set_dirt(Terminal_t* terminal, int top, int bottom)
+void stats_total(StatsShard_t* total)
 {
-     assert(top <= bottom);
-
-     CLAMP(top, 0, terminal->rows - 1);
-     CLAMP(bottom, 0, terminal->rows - 1);
+     int thread_count = __atomic_load_n(&g_stats_thread_count, __ATOMIC_RELAXED);
+     if(thread_count > STATS_MAX_THREADS) thread_count = STATS_MAX_THREADS;
 
-     for(int i = top; i <= bottom; ++i){
-          terminal->dirty_lines[i] = true;
-     }
+     memset(total, 0, sizeof(*total));
+     total->name = "total";
+     for(int i = 0; i < thread_count; ++i) stats_merge(total, g_stats + i);
 }
 
-void terminal_all_dirty(Terminal_t* terminal)
+// upper bound of the bucket the percentile falls in
+uint64_t stats_percentile(const uint64_t* buckets, uint64_t count, double percentile)
 {
-     terminal_set_dirt(terminal, 0, terminal->rows - 1);
+     uint64_t seen = 0;
+     for(int b = 0; b < STATS_HISTOGRAM_BUCKETS; ++b){
+          seen += buckets[b];
+          if(seen && seen >= percentile * count) return 1ULL << b;
+     }
+     return 1ULL << (STATS_HISTOGRAM_BUCKETS - 1);
 }
 
-void terminal_scroll_down(Terminal_t* terminal, int original, int n)
+void stats_print(FILE* file, StatsShard_t* shard, const char* name)
 {
-	Glyph_t* temp_line;
+     fprintf(file, "[%s]\n", name ? name : "?");
 
-	CLAMP(n, 0, terminal->bottom - original + 1);
+     for(int i = 0; i < STAT_COUNT; ++i) fprintf(file, "%s %" PRIu64 "\n", g_stat_names[i], shard->counters[i]);
 
-	terminal_set_dirt(terminal, original, terminal->bottom - n);
-	terminal_clear_region(terminal, 0, terminal->bottom - n + 1, terminal->columns - 1, terminal->bottom);
+     for(int i = 0; i < ELEM_COUNT(shard->csi_finals); ++i){
+          if(shard->csi_finals[i]) fprintf(file, "csi_%c %" PRIu64 "\n", 0x40 + i, shard->csi_finals[i]);
+     }
 
-	for (int i = terminal->bottom; i >= original + n; i--) {
-		temp_line = terminal->lines[i];
-		terminal->lines[i] = terminal->lines[i - n];
-          terminal->lines[i - n] = temp_line;
-	}
+     for(int h = 0; h < HISTOGRAM_COUNT; ++h){
+          uint64_t count = 0;
+          for(int b = 0; b < STATS_HISTOGRAM_BUCKETS; ++b) count += shard->histograms[h][b];
+          if(count == 0) continue;
+
+          fprintf(file, "%s count %" PRIu64 " p50 <%" PRIu64 " p99 <%" PRIu64 " max <%" PRIu64 "\n", g_histogram_names[h], count,
+                  stats_percentile(shard->histograms[h], count, 0.5),
+                  stats_percentile(shard->histograms[h], count, 0.99),
+                  stats_percentile(shard->histograms[h], count, 1.0));
+     }
+
+     fprintf(file, "\n");
 }
 
-void terminal_scroll_up(Terminal_t* terminal, int original, int n)
+// writes every thread's shard and their total, replacing the previous file
+bool stats_write(const char* path)
 {
-     Glyph_t* temp_line = NULL;
+     char temporary[PATH_MAX];
+     snprintf(temporary, sizeof(temporary), "%s.tmp", path);
 
-     CLAMP(n, 0, terminal->bottom - original + 1);
+     FILE* file = fopen(temporary, "w");
+     if(!file) return false;
 
-     // clear the original line plus the scroll
-     terminal_clear_region(terminal, 0, original, terminal->columns - 1, original + n - 1);
-     terminal_set_dirt(terminal, original + n, terminal->bottom);
+     int thread_count = __atomic_load_n(&g_stats_thread_count, __ATOMIC_RELAXED);
+     if(thread_count > STATS_MAX_THREADS) thread_count = STATS_MAX_THREADS;
 
-     // swap lines to move them all up
-     // the cleared lines will end up at the bottom
-     for(int i = original; i <= terminal->bottom - n; ++i){
-          temp_line = terminal->lines[i];
-          terminal->lines[i] = terminal->lines[i + n];
-          terminal->lines[i + n] = temp_line;
+     for(int i = 0; i < thread_count; ++i){
+          StatsShard_t shard = {};
+          stats_merge(&shard, g_stats + i);
+          stats_print(file, &shard, __atomic_load_n(&g_stats[i].name, __ATOMIC_ACQUIRE));
      }
-}
 
-void terminal_set_scroll(Terminal_t* terminal, int top, int bottom)
-{
-     CLAMP(top, 0, terminal->rows - 1);
-     CLAMP(bottom, 0, terminal->rows - 1);
+     StatsShard_t total;
+     stats_total(&total);
+     stats_print(file, &total, total.name);
 
-     if(top > bottom){
-          int temp = top;
-          top = bottom;
-          bottom = temp;
-     }
+     latency_report(file);
 
-     terminal->top = top;
-     terminal->bottom = bottom;
+     fclose(file);
+     return rename(temporary, path) == 0;
 }
 
-void terminal_insert_blank_line(Terminal_t* terminal, int n)
+// one line summary of the rates between two snapshots
+void stats_overlay(char* buffer, size_t size, StatsShard_t* previous, StatsShard_t* current, uint64_t elapsed)
 {
-     if(BETWEEN(terminal->cursor.y, terminal->top, terminal->bottom)){
-          terminal_scroll_down(terminal, terminal->cursor.y, n);
-     }
+     uint64_t delta[STAT_COUNT];
+     for(int i = 0; i < STAT_COUNT; ++i) delta[i] = current->counters[i] - previous->counters[i];
+
+     double seconds = elapsed / 1e9;
+     uint64_t frames = delta[STAT_FRAMES] ? delta[STAT_FRAMES] : 1;
+     snprintf(buffer, size, " %.2f MB/s %.0f seq/s %.0f unhandled/s %.0f fps %.0f us/frame %.1f rows/frame ",
+              delta[STAT_BYTES_PARSED] / seconds / 1e6,
+              (delta[STAT_ESC] + delta[STAT_CSI] + delta[STAT_STR]) / seconds,
+              delta[STAT_UNHANDLED] / seconds,
+              delta[STAT_FRAMES] / seconds,
+              delta[STAT_FRAME_NS] / 1e3 / frames,
+              (double)(delta[STAT_DIRTY_ROWS]) / frames);
 }
 
-void terminal_delete_line(Terminal_t* terminal, int n)
+void handle_signal_stats(int signal)
 {
-     if(BETWEEN(terminal->cursor.y, terminal->top, terminal->bottom)){
-          terminal_scroll_up(terminal, terminal->cursor.y, n);
-     }
+     g_stats_requested = 1;
 }
 
-void terminal_delete_char(Terminal_t* terminal, int n)
+// gives the calling thread a ring to record spans into, threads without one record nothing
+void trace_thread(const char* name)
 {
-	int dst, src, size;
-	Glyph_t* line;
+#ifdef TRACE
+     int index = __atomic_fetch_add(&g_trace_thread_count, 1, __ATOMIC_RELAXED);
+     if(index >= TRACE_MAX_THREADS) return;
 
-	CLAMP(n, 0, terminal->columns - terminal->cursor.x);
+     TraceRing_t* ring = calloc(1, sizeof(*ring));
+     if(!ring) return;
 
-	dst = terminal->cursor.x;
-	src = terminal->cursor.x + n;
-	size = terminal->columns - src;
-	line = terminal->lines[terminal->cursor.y];
+     ring->name = name;
+     t_trace = ring;
+     __atomic_store_n(&g_trace_rings[index], ring, __ATOMIC_RELEASE);
+#endif
+}
 
-	memmove(&line[dst], &line[src], size * sizeof(Glyph_t));
-	terminal_clear_region(terminal, terminal->columns - n, terminal->cursor.y, terminal->columns - 1, terminal->cursor.y);
+TraceSpan_t trace_begin(const char* name)
+{
+     TraceSpan_t span = {name, time_nanoseconds()};
+     return span;
 }
 
-void terminal_insert_blank(Terminal_t* terminal, int n)
+void trace_end(TraceSpan_t* span)
 {
-	int dst, src, size;
-	Glyph_t* line;
+     TraceRing_t* ring = t_trace;
+     if(!ring) return;
+
+     uint64_t head = ring->head;
+     TraceEvent_t* event = ring->events + (head % TRACE_RING_SIZE);
+     event->name = span->name;
+     event->start = span->start;
+     event->duration = time_nanoseconds() - span->start;
+     __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
 
-	CLAMP(n, 0, terminal->columns - terminal->cursor.x);
+// starts following the key unless another one is still in flight
+bool latency_sent(Rune_t rune)
+{
+     LatencyProbe_t* probe = &g_latency;
+     if(!probe->enabled) return false;
 
-	dst = terminal->cursor.x + n;
-	src = terminal->cursor.x;
-	size = terminal->columns - dst;
-	line = terminal->lines[terminal->cursor.y];
+     uint64_t now = time_nanoseconds();
+     if(__atomic_load_n(&probe->rune, __ATOMIC_ACQUIRE)){
+          // keys that never echo, like a password, are given up on eventually
+          if(now - probe->sent < LATENCY_TIMEOUT_NS) return false;
+     }
 
-	memmove(&line[dst], &line[src], size * sizeof(Glyph_t));
-	terminal_clear_region(terminal, src, terminal->cursor.y, dst - 1, terminal->cursor.y);
+     probe->sent = now;
+     __atomic_store_n(&probe->echoed, 0, __ATOMIC_RELAXED);
+     __atomic_store_n(&probe->rune, rune, __ATOMIC_RELEASE);
+     return true;
 }
 
-void terminal_put_newline(Terminal_t* terminal, bool first_column)
+// called by the parser for every cell it writes, the first write of the key in flight is taken as its echo
+void latency_echo(Rune_t rune)
 {
-     int y = terminal->cursor.y;
+     LatencyProbe_t* probe = &g_latency;
+     if(rune != __atomic_load_n(&probe->rune, __ATOMIC_ACQUIRE)) return;
 
-     if(y == terminal->bottom){
-          terminal_scroll_up(terminal, terminal->top, 1);
-     }else{
-          y++;
-     }
+     uint64_t expected = 0;
+     __atomic_compare_exchange_n(&probe->echoed, &expected, time_nanoseconds(), false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
 
-     terminal_move_cursor_to(terminal, first_column ? 0 : terminal->cursor.x, y);
-     terminal->dirty_lines[y] = true;
+// called after each wrefresh(), completes the sample once the echo has been drawn
+void latency_displayed()
+{
+     LatencyProbe_t* probe = &g_latency;
+     uint64_t echoed = __atomic_load_n(&probe->echoed, __ATOMIC_ACQUIRE);
+     if(!echoed) return;
+
+     uint64_t now = time_nanoseconds();
+     uint64_t index = probe->count % LATENCY_SAMPLES;
+     probe->echo_ns[index] = echoed - probe->sent;
+     probe->display_ns[index] = now - probe->sent;
+     __atomic_store_n(&probe->count, probe->count + 1, __ATOMIC_RELEASE);
+
+     __atomic_store_n(&probe->echoed, 0, __ATOMIC_RELAXED);
+     __atomic_store_n(&probe->rune, 0, __ATOMIC_RELEASE);
 }
 
-void terminal_put_tab(Terminal_t* terminal, int n)
+int latency_compare(const void* a, const void* b)
 {
-     unsigned int new_x = terminal->cursor.x;
+     uint64_t left = *(const uint64_t*)(a);
+     uint64_t right = *(const uint64_t*)(b);
+     return (left > right) - (left < right);
+}
 
-     if(n > 0){
-          while(new_x < terminal->columns && n--){
-               new_x++;
-               while(new_x < terminal->columns && !terminal->tabs[new_x]){
-                    new_x++;
-               }
-          }
-     }else if(n < 0){
-          while(new_x > 0 && n++){
-               new_x--;
-               while(new_x > 0 && !terminal->tabs[new_x]){
-                    new_x--;
-               }
+void latency_print(FILE* file, const char* name, const uint64_t* samples, uint64_t count)
+{
+     uint64_t* sorted = malloc(count * sizeof(*sorted));
+     if(!sorted) return;
+
+     memcpy(sorted, samples, count * sizeof(*sorted));
+     qsort(sorted, count, sizeof(*sorted), latency_compare);
+
+     fprintf(file, "%s p50 %.1f us p99 %.1f us p999 %.1f us max %.1f us\n", name,
+             sorted[count / 2] / 1e3, sorted[count * 99 / 100] / 1e3, sorted[count * 999 / 1000] / 1e3, sorted[count - 1] / 1e3);
+     free(sorted);
+}
+
+// echo is key to cell write, display is key to the refresh that showed it
+void latency_report(FILE* file)
+{
+     LatencyProbe_t* probe = &g_latency;
+     uint64_t count = __atomic_load_n(&probe->count, __ATOMIC_ACQUIRE);
+     if(count == 0) return;
+     if(count > LATENCY_SAMPLES) count = LATENCY_SAMPLES;
+
+     fprintf(file, "[latency]\nsamples %" PRIu64 "\n", count);
+     latency_print(file, "echo", probe->echo_ns, count);
+     latency_print(file, "display", probe->display_ns, count);
+     fprintf(file, "\n");
+}
+
+// dumps every ring as chrome trace event json, which perfetto and chrome://tracing open directly
+bool trace_write(const char* path)
+{
+     char temporary[PATH_MAX];
+     snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+
+     FILE* file = fopen(temporary, "w");
+     if(!file) return false;
+
+     int thread_count = __atomic_load_n(&g_trace_thread_count, __ATOMIC_RELAXED);
+     if(thread_count > TRACE_MAX_THREADS) thread_count = TRACE_MAX_THREADS;
+
+     const char* separator = "";
+     fprintf(file, "{\"traceEvents\":[\n");
+
+     for(int t = 0; t < thread_count; ++t){
+          TraceRing_t* ring = __atomic_load_n(&g_trace_rings[t], __ATOMIC_ACQUIRE);
+          if(!ring) continue;
+
+          fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", separator, getpid(), t, ring->name);
+          separator = ",\n";
+
+          uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+          uint64_t first = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+          for(uint64_t i = first; i < head; ++i){
+               TraceEvent_t event = ring->events[i % TRACE_RING_SIZE];
+
+               // the thread keeps recording while we read, skip anything it has lapped us on
+               if(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - i > TRACE_RING_SIZE) continue;
+
+               fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", separator,
+                       event.name, getpid(), t, event.start / 1e3, event.duration / 1e3);
           }
      }
 
-     terminal->cursor.x = CLAMP(new_x, 0, terminal->columns - 1);
+     fprintf(file, "\n]}\n");
+     fclose(file);
+     return rename(temporary, path) == 0;
 }
 
-void terminal_cursor_save(Terminal_t* terminal)
+bool is_controller_c0(Rune_t rune)
 {
-	int alt = terminal->mode & TERMINAL_MODE_ALTSCREEN;
-     g_cursor[alt] = terminal->cursor;
+     if(BETWEEN(rune, 0, 0x1f) || rune == '\177'){
+          return true;
+     }
+
+     return false;
 }
 
-void terminal_cursor_load(Terminal_t* terminal)
+bool is_controller_c1(Rune_t rune)
 {
-	int alt = terminal->mode & TERMINAL_MODE_ALTSCREEN;
-     terminal->cursor = g_cursor[alt];
-     terminal_move_cursor_to(terminal, g_cursor[alt].x, g_cursor[alt].y);
+     if(BETWEEN(rune, 0x80, 0x9f)){
+          return true;
+     }
+
+     return false;
 }
 
-void terminal_swap_screen(Terminal_t* terminal)
+bool is_controller(Rune_t rune)
 {
-     Glyph_t** tmp_lines = terminal->lines;
+     if(is_controller_c0(rune)) return true;
+     if(is_controller_c1(rune)) return true;
 
-     terminal->lines = terminal->alternate_lines;
-     terminal->alternate_lines = tmp_lines;
-     terminal->mode ^= TERMINAL_MODE_ALTSCREEN;
-     terminal_all_dirty(terminal);
+     return false;
 }
 
-void terminal_reset(Terminal_t* terminal)
+void csi_reset(CSIEscape_t* csi)
 {
-     terminal->cursor.attributes.attributes = GLYPH_ATTRIBUTE_NONE;
-     terminal->cursor.attributes.foreground = COLOR_FOREGROUND;
-     terminal->cursor.attributes.background = COLOR_BACKGROUND;
-     terminal->cursor.x = 0;
-     terminal->cursor.y = 0;
-     terminal->cursor.state = CURSOR_STATE_DEFAULT;
+     memset(csi, 0, sizeof(*csi));
+}
 
-     memset(terminal->tabs, 0, terminal->columns * sizeof(*terminal->tabs));
-     for(int i = TAB_SPACES; i < terminal->columns; ++i) terminal->tabs[i] = 1;
-     terminal->top = 0;
-     terminal->bottom = terminal->rows - 1;
-     terminal->mode = TERMINAL_MODE_WRAP | TERMINAL_MODE_UTF8;
+void csi_parse(CSIEscape_t* csi)
+{
+     char* str = csi->buffer;
+     char* end = NULL;
+     long int value = 0;
 
-     //TODO: clear character translation table
-     terminal->charset = 0;
-     terminal->escape_state = 0;
+     csi->argument_count = 0;
 
-     terminal_move_cursor_to(terminal, 0, 0);
-     terminal_cursor_save(terminal);
-     terminal_clear_region(terminal, 0, 0, terminal->columns - 1, terminal->rows - 1);
-     terminal_swap_screen(terminal);
+     if(*str == '?'){
+          csi->private = 1;
+          str++;
+     }
 
-     terminal_move_cursor_to(terminal, 0, 0);
-     terminal_cursor_save(terminal);
-     terminal_clear_region(terminal, 0, 0, terminal->columns - 1, terminal->rows - 1);
-     terminal_swap_screen(terminal);
+     csi->buffer[csi->buffer_length] = 0;
+     while(str < csi->buffer + csi->buffer_length){
+          end = NULL;
+          value = strtol(str, &end, 10);
+
+          if(end == str) value = 0;
+          else if(value == LONG_MAX || value == LONG_MIN) value = -1;
+
+          csi->arguments[csi->argument_count] = value;
+          csi->argument_count++;
+
+          str = end;
+
+          if(*str != ';' || csi->argument_count == ESCAPE_ARGUMENT_SIZE) break;
+
+          str++;
+     }
+
+     csi->mode[0] = *str++;
+     csi->mode[1] = (str < (csi->buffer + csi->buffer_length)) ? *str : 0;
 }
 
-void terminal_control_code(Terminal_t* terminal, Rune_t rune)
+bool rune_is_cluster(Rune_t rune)
 {
-     assert(is_controller(rune));
+     return rune & RUNE_CLUSTER_BIT;
+}
 
-     switch(rune){
-     default:
-          LOG("unhandled control code: '%c'\n", rune);
-          break;
-     case '\t': // HT
-          terminal_put_tab(terminal, 1);
-          return;
-     case '\b': // BS
-          terminal_move_cursor_to(terminal, terminal->cursor.x - 1, terminal->cursor.y);
-          return;
-     case '\r': // CR
-          terminal_move_cursor_to(terminal, 0, terminal->cursor.y);
-          return;
-     case '\f': // LF
-     case '\v': // VT
-     case '\n': // LF
-          terminal_put_newline(terminal, terminal->mode & TERMINAL_MODE_CRLF);
-          return;
-     case '\a': // BEL
-          if(terminal->escape_state & ESCAPE_STATE_STR_END){
-               str_handle(terminal);
+uint32_t cluster_hash(const Rune_t* runes, uint32_t count)
+{
+     uint32_t hash = 2166136261u;
+     for(uint32_t i = 0; i < count; ++i){
+          hash ^= runes[i];
+          hash *= 16777619u;
+     }
+     return hash;
+}
+
+void clusters_insert_table(Clusters_t* clusters, uint32_t id)
+{
+     uint32_t slot = clusters->clusters[id].hash & (clusters->table_size - 1);
+     while(clusters->table[slot]) slot = (slot + 1) & (clusters->table_size - 1);
+     clusters->table[slot] = id + 1;
+}
+
+bool clusters_grow_table(Clusters_t* clusters)
+{
+     uint32_t table_size = clusters->table_size ? clusters->table_size * 2 : 1024;
+     uint32_t* table = calloc(table_size, sizeof(*table));
+     if(!table) return false;
+
+     free(clusters->table);
+     clusters->table = table;
+     clusters->table_size = table_size;
+
+     for(uint32_t id = 0; id < clusters->count; ++id){
+          if(clusters->clusters[id].count) clusters_insert_table(clusters, id);
+     }
+
+     return true;
+}
+
+// returns the tagged rune for the sequence of runes, sharing an existing cluster if there is one
+Rune_t cluster_intern(Clusters_t* clusters, const Rune_t* runes, uint32_t count)
+{
+     uint32_t hash = cluster_hash(runes, count);
+
+     if(clusters->table_size){
+          uint32_t slot = hash & (clusters->table_size - 1);
+          while(clusters->table[slot]){
+               Cluster_t* cluster = clusters->clusters + clusters->table[slot] - 1;
+               if(cluster->hash == hash && cluster->count == count &&
+                  memcmp(cluster->runes, runes, count * sizeof(*runes)) == 0){
+                    return (clusters->table[slot] - 1) | RUNE_CLUSTER_BIT;
+               }
+               slot = (slot + 1) & (clusters->table_size - 1);
           }
-          break;
-     case '\033': // ESC
-          csi_reset(&terminal->csi_escape);
-          terminal->escape_state &= ~(ESCAPE_STATE_CSI | ESCAPE_STATE_ALTCHARSET | ESCAPE_STATE_TEST);
-          terminal->escape_state |= ESCAPE_STATE_START;
-          return;
-     case '\016': // SO
-     case '\017': // SI
-          // TODO
-          break;
-     case '\032': // SUB
-          terminal_set_glyph(terminal, '?', &terminal->cursor.attributes, terminal->cursor.x, terminal->cursor.y);
-     case '\030':
-          csi_reset(&terminal->csi_escape);
-          break;
-     case '\005': // ENQ
-     case '\000': // NULL
-     case '\021': // XON
-     case '\023': // XOFF
-     case 0177:   // DEL
-          // ignored
-          return;
-     case 0x80: // PAD
-     case 0x81: // HOP
-     case 0x82: // BPH
-     case 0x83: // NBH
-     case 0x84: // IND
-          break;
-     case 0x85: // NEL
-          terminal_put_newline(terminal, true);
-          break;
-	case 0x86: // SSA
-	case 0x87: // ESA
-		break;
-	case 0x88: // HTS
-          terminal->tabs[terminal->cursor.x] = 1;
-          break;
-	case 0x89: // HTJ
-	case 0x8a: // VTS
-	case 0x8b: // PLD
-	case 0x8c: // PLU
-	case 0x8d: // RI
-	case 0x8e: // SS2
-	case 0x8f: // SS3
-	case 0x91: // PU1
-	case 0x92: // PU2
-	case 0x93: // STS
-	case 0x94: // CCH
-	case 0x95: // MW
-	case 0x96: // SPA
-	case 0x97: // EPA
-	case 0x98: // SOS
-	case 0x99: // SGCI
-		break;
-	case 0x9a: // DECID
-		tty_write(terminal->file_descriptor, VT_IDENTIFIER, sizeof(VT_IDENTIFIER) - 1);
-		break;
-	case 0x9b: // CSI
-	case 0x9c: // ST
-		break;
-	case 0x90: // DCS
-	case 0x9d: // OSC
-	case 0x9e: // PM
-	case 0x9f: // APC
-          str_sequence(terminal, rune);
-		return;
      }
 
-     terminal->escape_state &= ~(ESCAPE_STATE_STR_END | ESCAPE_STATE_STR);
+     // keep the table at most half full
+     if((clusters->live + 1) * 2 > clusters->table_size && !clusters_grow_table(clusters)) return runes[0];
+
+     uint32_t id;
+     if(clusters->free_count){
+          id = clusters->free[--clusters->free_count];
+     }else{
+          if(clusters->count == clusters->capacity){
+               uint32_t capacity = clusters->capacity ? clusters->capacity * 2 : 256;
+               Cluster_t* new_clusters = realloc(clusters->clusters, capacity * sizeof(*new_clusters));
+               if(!new_clusters) return runes[0];
+               clusters->clusters = new_clusters;
+               clusters->capacity = capacity;
+          }
+          id = clusters->count++;
+     }
+
+     Cluster_t* cluster = clusters->clusters + id;
+     memcpy(cluster->runes, runes, count * sizeof(*runes));
+     cluster->count = count;
+     cluster->hash = hash;
+     cluster->marked = false;
+     clusters->live++;
+     clusters_insert_table(clusters, id);
+
+     return id | RUNE_CLUSTER_BIT;
 }
 
-void terminal_set_mode(Terminal_t* terminal, bool set)
+// the runes making up a cell, a single one unless it holds a cluster
+uint32_t cluster_runes(Clusters_t* clusters, Rune_t rune, Rune_t* runes)
 {
-     CSIEscape_t* csi = &terminal->csi_escape;
-     int* arg;
-     int* last_arg = csi->arguments + csi->argument_count;
-     //int mode;
-     int alt;
+     if(rune_is_cluster(rune)){
+          uint32_t id = rune & ~RUNE_CLUSTER_BIT;
+          if(id < clusters->count && clusters->clusters[id].count){
+               Cluster_t* cluster = clusters->clusters + id;
+               memcpy(runes, cluster->runes, cluster->count * sizeof(*runes));
+               return cluster->count;
+          }
+          runes[0] = ' ';
+          return 1;
+     }
 
-     for(arg = csi->arguments; arg <= last_arg; ++arg){
-          if(csi->private){
-               switch(*arg){
-               default:
-                    break;
-               case 1:
-                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_APPCURSOR);
-                    break;
-               case 5:
-                    //mode = terminal->mode;
-                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_REVERSE);
-                    // TODO if(mode != terminal->mode) redraw();
-                    break;
-               case 6:
-                    CHANGE_BIT(terminal->cursor.state, set, CURSOR_STATE_ORIGIN);
-                    terminal_move_cursor_to_absolute(terminal, 0, 0);
-                    break;
-               case 7:
-                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_WRAP);
-                    break;
-               case 0:
-               case 2:
-               case 3:
-               case 4:
-               case 8:
-               case 18:
-               case 19:
-               case 42:
-               case 12:
-                    // ignored
-                    break;
-               case 25:
-                    CHANGE_BIT(terminal->mode, !set, TERMINAL_MODE_HIDE);
-                    break;
-               case 9:
-                    // TODO: xsetpointermotion(0); ?
-                    CHANGE_BIT(terminal->mode, 0, TERMINAL_MODE_MOUSE);
-                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_MOUSEEX10);
-                    break;
-               case 1000:
-                    // TODO: xsetpointermotion(0); ?
-                    CHANGE_BIT(terminal->mode, 0, TERMINAL_MODE_MOUSE);
-                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_MOUSEBTN);
-                    break;
-               case 1002:
-                    // TODO: xsetpointermotion(0); ?
-                    CHANGE_BIT(terminal->mode, 0, TERMINAL_MODE_MOUSE);
-                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_MOUSEMOTION);
-                    break;
-               case 1003:
-                    // TODO: xsetpointermotion(0); ?
-                    CHANGE_BIT(terminal->mode, 0, TERMINAL_MODE_MOUSE);
-                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_MOUSEEMANY);
-                    break;
-               case 1004:
-                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_FOCUS);
-                    break;
-               case 1006:
-                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_MOUSEGR);
+     runes[0] = rune;
+     return 1;
+}
+
+Rune_t cluster_append(Clusters_t* clusters, Rune_t rune, Rune_t mark)
+{
+     Rune_t runes[CLUSTER_MAX_RUNES];
+     uint32_t count = cluster_runes(clusters, rune, runes);
+
+     if(count == CLUSTER_MAX_RUNES) return rune;
+
+     runes[count++] = mark;
+     return cluster_intern(clusters, runes, count);
+}
+
+// writes the utf8 of a cell's rune or cluster and returns its length
+int rune_encode(Clusters_t* clusters, Rune_t rune, char* buffer)
+{
+     Rune_t runes[CLUSTER_MAX_RUNES];
+     uint32_t count = cluster_runes(clusters, rune, runes);
+     int length = 0;
+
+     for(uint32_t i = 0; i < count; ++i){
+          int len = 0;
+          utf8_encode(runes[i], buffer + length, UTF8_SIZE, &len);
+          length += len;
+     }
+
+     return length;
+}
+
+void clusters_mark_glyphs(Clusters_t* clusters, Glyph_t* glyphs, int count)
+{
+     for(int i = 0; i < count; ++i){
+          if(rune_is_cluster(glyphs[i].rune)){
+               uint32_t id = glyphs[i].rune & ~RUNE_CLUSTER_BIT;
+               if(id < clusters->count) clusters->clusters[id].marked = true;
+          }
+     }
+}
+
+// frees every cluster no cell refers to any more
+void clusters_sweep(Clusters_t* clusters)
+{
+     uint32_t* free_ids = realloc(clusters->free, clusters->count * sizeof(*free_ids));
+     if(!free_ids) return;
+     clusters->free = free_ids;
+     clusters->free_count = 0;
+     clusters->live = 0;
+
+     for(uint32_t id = 0; id < clusters->count; ++id){
+          Cluster_t* cluster = clusters->clusters + id;
+          if(cluster->marked){
+               cluster->marked = false;
+               clusters->live++;
+          }else{
+               cluster->count = 0;
+               clusters->free[clusters->free_count++] = id;
+          }
+     }
+
+     memset(clusters->table, 0, clusters->table_size * sizeof(*clusters->table));
+     for(uint32_t id = 0; id < clusters->count; ++id){
+          if(clusters->clusters[id].count) clusters_insert_table(clusters, id);
+     }
+
+     clusters->collect_at = clusters->live * 2;
+     if(clusters->collect_at < CLUSTER_COLLECT_MIN) clusters->collect_at = CLUSTER_COLLECT_MIN;
+}
+
+uint32_t line_hash(const Glyph_t* glyphs, int length)
+{
+     // a glyph is two words with no padding, so mix it in a word at a time
+     uint64_t hash = length;
+     for(int i = 0; i < length; ++i){
+          uint64_t words[2];
+          memcpy(words, glyphs + i, sizeof(words));
+          hash = (hash ^ words[0]) * 0x9e3779b97f4a7c15ull;
+          hash = (hash ^ words[1]) * 0x9e3779b97f4a7c15ull;
+     }
+     return (uint32_t)(hash >> 32) ^ (uint32_t)(hash);
+}
+
+bool line_pool_init(LinePool_t* pool)
+{
+     memset(pool, 0, sizeof(*pool));
+     pool->capacity = 1024;
+     pool->lines = calloc(pool->capacity, sizeof(*pool->lines));
+     pool->free = malloc(pool->capacity * sizeof(*pool->free));
+     pool->index = aligned_alloc(64, LINE_POOL_INDEX_SIZE * sizeof(*pool->index));
+     if(!pool->lines || !pool->free || !pool->index) return false;
+     memset(pool->index, 0, LINE_POOL_INDEX_SIZE * sizeof(*pool->index));
+
+     // the empty line holds a reference of its own so it is never released, and stands in for lines that could not
+     // be stored
+     pool->lines[LINE_POOL_EMPTY].references = 1;
+     pool->lines[LINE_POOL_EMPTY].page = UINT32_MAX;
+     pool->count = 1;
+     pool->live = 1;
+     return true;
+}
+
+uint32_t line_pool_empty(LinePool_t* pool)
+{
+     pool->lines[LINE_POOL_EMPTY].references++;
+     return LINE_POOL_EMPTY;
+}
+
+// returns a handle to a line with these glyphs, sharing an existing one if there is one
+uint32_t line_pool_intern(LinePool_t* pool, const Glyph_t* glyphs, int length)
+{
+     if(length == 0) return line_pool_empty(pool);
+
+     // the index only covers lines stored recently, which is where repeats come from: blank lines, separators,
+     // progress bars redrawn a line at a time. it stays in cache where a table of every line would not, and a line
+     // need not be found in it to be released
+     uint32_t hash = line_hash(glyphs, length);
+     uint64_t* bucket = pool->index + (hash & (LINE_POOL_INDEX_SIZE / LINE_POOL_BUCKET - 1)) * LINE_POOL_BUCKET;
+     for(int i = 0; i < LINE_POOL_BUCKET; ++i){
+          if(bucket[i] >> 32 != hash) continue;
+
+          uint32_t handle = (uint32_t)(bucket[i]) - 1;
+          HistoryLine_t* line = pool->lines + handle;
+          if(line->references && line->length == length && memcmp(line->glyphs, glyphs, length * sizeof(*glyphs)) == 0){
+               line->references++;
+               return handle;
+          }
+     }
+
+     if(!pool->free_count && pool->count == pool->capacity){
+          uint32_t capacity = pool->capacity * 2;
+          HistoryLine_t* lines = realloc(pool->lines, capacity * sizeof(*lines));
+          if(!lines) return line_pool_empty(pool);
+          pool->lines = lines;
+
+          uint32_t* free_handles = realloc(pool->free, capacity * sizeof(*free_handles));
+          if(!free_handles) return line_pool_empty(pool);
+          pool->free = free_handles;
+          pool->capacity = capacity;
+     }
+
+     uint32_t handle = pool->free_count ? pool->free[pool->free_count - 1] : pool->count;
+     HistoryLine_t* line = pool->lines + handle;
+     line->glyphs = malloc(length * sizeof(*glyphs));
+     if(!line->glyphs) return line_pool_empty(pool);
+
+     if(pool->free_count){
+          pool->free_count--;
+     }else{
+          pool->count++;
+     }
+
+     memcpy(line->glyphs, glyphs, length * sizeof(*glyphs));
+     line->length = length;
+     line->references = 1;
+     line->page = UINT32_MAX;
+     line->clusters = false;
+     line->links = false;
+     for(int i = 0; i < length; ++i){
+          line->clusters |= rune_is_cluster(glyphs[i].rune);
+          line->links |= glyphs[i].link != 0;
+     }
+
+     pool->live++;
+
+     int slot = 0;
+     while(slot < LINE_POOL_BUCKET && bucket[slot]) slot++;
+     if(slot == LINE_POOL_BUCKET) slot = pool->victim++ % LINE_POOL_BUCKET;
+     bucket[slot] = (uint64_t)(hash) << 32 | (handle + 1);
+     return handle;
+}
+
+void line_pool_release(LinePool_t* pool, uint32_t handle)
+{
+     HistoryLine_t* line = pool->lines + handle;
+     if(--line->references || handle == LINE_POOL_EMPTY) return;
+
+     free(line->glyphs);
+     line->glyphs = NULL;
+     line->length = 0;
+     pool->free[pool->free_count++] = handle;
+     pool->live--;
+}
+
+bool history_init(History_t* history, Clusters_t* clusters)
+{
+     history->lines = calloc(HISTORY_SIZE, sizeof(*history->lines));
+     history->trigrams = calloc(TRIGRAM_BUCKETS, sizeof(*history->trigrams));
+     history->page_trigrams = calloc(TRIGRAM_BUCKETS / 64, sizeof(*history->page_trigrams));
+     history->start = 0;
+     history->end = 0;
+     history->clusters = clusters;
+     history->indexed = true;
+
+     return history->lines && history->trigrams && history->page_trigrams && line_pool_init(&history->pool);
+}
+
+HistoryLine_t* history_get(History_t* history, int64_t line)
+{
+     if(line < history->start || line >= history->end) return NULL;
+     return history->pool.lines + history->lines[line % HISTORY_SIZE];
+}
+
+int history_line_text(History_t* history, HistoryLine_t* line, char* buffer, int buffer_size)
+{
+     int length = 0;
+
+     for(int i = 0; i < line->length; ++i){
+          Rune_t rune = line->glyphs[i].rune;
+          if(line->glyphs[i].attributes & GLYPH_ATTRIBUTE_WDUMMY) continue;
+          if(rune == 0) rune = ' ';
+          if(length + UTF8_SIZE * CLUSTER_MAX_RUNES >= buffer_size) break;
+          length += rune_encode(history->clusters, rune, buffer + length);
+     }
+
+     buffer[length] = 0;
+     return length;
+}
+
+uint32_t trigram_bucket(const char* text)
+{
+     uint32_t key = ((uint32_t)(unsigned char)text[0] << 16) |
+                    ((uint32_t)(unsigned char)text[1] << 8) |
+                    (uint32_t)(unsigned char)text[2];
+
+     return (key * 2654435761u) >> 16;
+}
+
+void trigram_postings_add(TrigramPostings_t* postings, uint32_t page, uint32_t first_page)
+{
+     // pages are added in ascending order, so a repeat can only be the last entry
+     if(postings->count && postings->pages[postings->count - 1] == page) return;
+
+     if(postings->count == postings->capacity){
+          // drop pages that have already fallen out of the history before growing
+          uint32_t stale = 0;
+          while(stale < postings->count && postings->pages[stale] < first_page) stale++;
+
+          if(stale){
+               postings->count -= stale;
+               memmove(postings->pages, postings->pages + stale, postings->count * sizeof(*postings->pages));
+          }
+
+          if(postings->count == postings->capacity){
+               uint32_t capacity = postings->capacity ? postings->capacity * 2 : 4;
+               uint32_t* pages = realloc(postings->pages, capacity * sizeof(*pages));
+               if(!pages) return;
+
+               postings->pages = pages;
+               postings->capacity = capacity;
+          }
+     }
+
+     postings->pages[postings->count] = page;
+     postings->count++;
+}
+
+bool trigram_postings_contains(TrigramPostings_t* postings, uint32_t page)
+{
+     uint32_t low = 0;
+     uint32_t high = postings->count;
+
+     while(low < high){
+          uint32_t middle = low + (high - low) / 2;
+          if(postings->pages[middle] < page){
+               low = middle + 1;
+          }else{
+               high = middle;
+          }
+     }
+
+     return low < postings->count && postings->pages[low] == page;
+}
+
+void history_push(History_t* history, Glyph_t* glyphs, int columns)
+{
+     // drop trailing blanks in the default style, they make up most of a typical line
+     int length = columns;
+     while(length > 0){
+          Glyph_t* glyph = glyphs + length - 1;
+          if((glyph->rune != ' ' && glyph->rune != 0) || glyph->attributes ||
+             glyph->foreground != COLOR_FOREGROUND || glyph->background != COLOR_BACKGROUND){
+               break;
+          }
+          length--;
+     }
+
+     if(history->end - history->start == HISTORY_SIZE){
+          // the lines being dropped were stored long ago and are not in cache, so fetch them a few pushes early
+          HistoryLine_t* soon = history->pool.lines + history->lines[(history->start + 16) % HISTORY_SIZE];
+          __builtin_prefetch(soon, 1);
+          __builtin_prefetch(soon->glyphs);
+          line_pool_release(&history->pool, history->lines[history->start % HISTORY_SIZE]);
+          history->start++;
+     }
+
+     uint32_t handle = line_pool_intern(&history->pool, glyphs, length);
+     history->lines[history->end % HISTORY_SIZE] = handle;
+
+     // collect the line's trigrams in the page bitmap, which stays in cache, rather than
+     // touching a posting list per trigram. a line repeated within the page is already in it
+     HistoryLine_t* line = history->pool.lines + handle;
+     uint32_t page = history->end / HISTORY_PAGE_LINES;
+     if(history->indexed && line->page != page){
+          line->page = page;
+
+          char text[HISTORY_TEXT_SIZE];
+          int text_length = history_line_text(history, line, text, HISTORY_TEXT_SIZE);
+
+          for(int i = 0; i + 2 < text_length; ++i){
+               uint32_t bucket = trigram_bucket(text + i);
+               history->page_trigrams[bucket / 64] |= (uint64_t)(1) << (bucket % 64);
+          }
+     }
+
+     history->end++;
+
+     // once the page is complete, add it to the posting list of every trigram it contains
+     if(history->indexed && history->end % HISTORY_PAGE_LINES == 0){
+          uint32_t first_page = history->start / HISTORY_PAGE_LINES;
+
+          for(uint32_t w = 0; w < TRIGRAM_BUCKETS / 64; ++w){
+               uint64_t bits = history->page_trigrams[w];
+               while(bits){
+                    int bit = __builtin_ctzll(bits);
+                    bits &= bits - 1;
+                    trigram_postings_add(history->trigrams + w * 64 + bit, page, first_page);
+               }
+               history->page_trigrams[w] = 0;
+          }
+     }
+}
+
+// finds the longest run of characters every match of the extended regex must contain
+int regex_required_literal(const char* pattern, char* literal, int literal_size)
+{
+     int best = 0;
+     int run = 0;
+     const char* run_start = pattern;
+     const char* best_start = pattern;
+     int depth = 0;
+
+     for(const char* p = pattern; *p; ++p){
+          char c = *p;
+
+          if(c == '|' && depth == 0) return 0; // alternation means nothing is required
+
+          if(strchr("*?{", c)){
+               // the previous character is optional
+               if(run > 0) run--;
+               if(run > best){
+                    best = run;
+                    best_start = run_start;
+               }
+               run = 0;
+               if(c == '{') while(p[1] && *p != '}') ++p;
+               continue;
+          }
+
+          if(c == '(') depth++;
+          if(c == ')') depth--;
+
+          if(strchr(".[]()+^$\\|", c) || depth > 0){
+               if(run > best){
+                    best = run;
+                    best_start = run_start;
+               }
+               run = 0;
+
+               // skip bracket expressions and escaped characters entirely
+               if(c == '[') while(p[1] && *p != ']') ++p;
+               if(c == '\\' && p[1]) ++p;
+               continue;
+          }
+
+          if(run == 0) run_start = p;
+          run++;
+     }
+
+     if(run > best){
+          best = run;
+          best_start = run_start;
+     }
+
+     if(best >= literal_size) best = literal_size - 1;
+     memcpy(literal, best_start, best);
+     literal[best] = 0;
+     return best;
+}
+
+// the nearest page from page on, in the direction of the search, that holds every trigram of the literal, or -1. the
+// page still being filled is not in the index yet, so it is always a candidate
+int64_t history_candidate_page(History_t* history, TrigramPostings_t* driver, const char* literal, int literal_length,
+                               int64_t page, bool backward)
+{
+     int64_t first_page = history->start / HISTORY_PAGE_LINES;
+     int64_t last_page = (history->end - 1) / HISTORY_PAGE_LINES;
+     int64_t open_page = history->end / HISTORY_PAGE_LINES;
+
+     while(page >= first_page && page <= last_page){
+          if(!driver || page >= open_page) return page;
+
+          // the rarest trigram's pages are the only ones worth looking at
+          uint32_t low = 0;
+          uint32_t high = driver->count;
+          while(low < high){
+               uint32_t middle = low + (high - low) / 2;
+               if(driver->pages[middle] < page){
+                    low = middle + 1;
+               }else{
+                    high = middle;
+               }
+          }
+
+          if(backward){
+               if(low == driver->count || driver->pages[low] != page){
+                    if(low == 0) return -1;
+                    page = driver->pages[low - 1];
+               }
+               if(page < first_page) return -1;
+          }else{
+               page = (low < driver->count) ? driver->pages[low] : open_page;
+               if(page >= open_page) continue;
+          }
+
+          bool candidate = true;
+          for(int i = 0; i + 2 < literal_length && candidate; ++i){
+               candidate = trigram_postings_contains(history->trigrams + trigram_bucket(literal + i), page);
+          }
+          if(candidate) return page;
+          page += backward ? -1 : 1;
+     }
+
+     return -1;
+}
+
+// searches lines at or after absolute line 'from', or at or before it going backward, for a substring or extended
+// regex, using the trigram index to narrow the pages that have to be checked
+bool history_search(History_t* history, const char* pattern, bool is_regex, int64_t from, bool backward, int64_t* match)
+{
+     char literal[HISTORY_TEXT_SIZE];
+     int literal_length = 0;
+     regex_t regex;
+
+     if(history->end == history->start) return false;
+     if(from < history->start){
+          if(backward) return false;
+          from = history->start;
+     }
+     if(from >= history->end){
+          if(!backward) return false;
+          from = history->end - 1;
+     }
+
+     if(is_regex){
+          if(regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB) != 0) return false;
+          literal_length = regex_required_literal(pattern, literal, HISTORY_TEXT_SIZE);
+     }else{
+          literal_length = snprintf(literal, HISTORY_TEXT_SIZE, "%s", pattern);
+          if(literal_length >= HISTORY_TEXT_SIZE) literal_length = HISTORY_TEXT_SIZE - 1;
+     }
+
+     // without an index every page is a candidate
+     TrigramPostings_t* driver = NULL;
+     if(history->indexed && literal_length >= 3){
+          for(int i = 0; i + 2 < literal_length; ++i){
+               TrigramPostings_t* postings = history->trigrams + trigram_bucket(literal + i);
+               if(!driver || postings->count < driver->count) driver = postings;
+          }
+     }
+
+     bool found = false;
+     char text[HISTORY_TEXT_SIZE];
+     int step = backward ? -1 : 1;
+     int64_t page = from / HISTORY_PAGE_LINES;
+
+     while(!found && (page = history_candidate_page(history, driver, literal, literal_length, page, backward)) >= 0){
+          int64_t first = page * HISTORY_PAGE_LINES;
+          int64_t last = first + HISTORY_PAGE_LINES - 1;
+          if(first < history->start) first = history->start;
+          if(last >= history->end) last = history->end - 1;
+          if(backward && last > from) last = from;
+          if(!backward && first < from) first = from;
+
+          for(int64_t line = backward ? last : first; line >= first && line <= last; line += step){
+               history_line_text(history, history_get(history, line), text, HISTORY_TEXT_SIZE);
+
+               if(is_regex ? regexec(&regex, text, 0, NULL, 0) == 0 : strstr(text, literal) != NULL){
+                    *match = line;
+                    found = true;
                     break;
-               case 1034:
-                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_8BIT);
+               }
+          }
+          page += step;
+     }
+
+     if(is_regex) regfree(&regex);
+     return found;
+}
+
+// the index of the first mark at or after line and column
+uint32_t marks_lower_bound(Marks_t* marks, int64_t line, int column)
+{
+     uint32_t low = marks->first;
+     uint32_t high = marks->count;
+     while(low < high){
+          uint32_t middle = low + (high - low) / 2;
+          Mark_t* mark = marks->marks + middle;
+          if(mark->line < line || (mark->line == line && mark->column < column)){
+               low = middle + 1;
+          }else{
+               high = middle;
+          }
+     }
+     return low;
+}
+
+// marks where the cursor is on the main screen, what the alternate screen shows is gone once it is left
+void marks_add(Terminal_t* terminal, uint8_t kind, int32_t status)
+{
+     Marks_t* marks = &terminal->marks;
+     History_t* history = &terminal->history;
+     if(terminal->mode & TERMINAL_MODE_ALTSCREEN) return;
+
+     // marks after this one were drawn over, the prompt and command of an empty prompt share a place though
+     int64_t line = history->end + terminal->cursor.y;
+     marks->count = marks_lower_bound(marks, line, terminal->cursor.x + 1);
+     while(marks->first < marks->count && marks->marks[marks->first].line < history->start) marks->first++;
+
+     if(marks->count == marks->capacity){
+          if(marks->first && marks->first >= marks->capacity / 2){
+               memmove(marks->marks, marks->marks + marks->first, (marks->count - marks->first) * sizeof(*marks->marks));
+               marks->count -= marks->first;
+               marks->first = 0;
+          }else{
+               uint32_t capacity = marks->capacity ? marks->capacity * 2 : 256;
+               Mark_t* grown = realloc(marks->marks, capacity * sizeof(*grown));
+               if(!grown) return;
+               marks->marks = grown;
+               marks->capacity = capacity;
+          }
+     }
+
+     if(kind == MARK_PROMPT) marks->commands++;
+     marks->marks[marks->count++] = (Mark_t){line, marks->commands, status, terminal->cursor.x, kind};
+}
+
+// the nearest prompt before or after line, NULL when there is none
+Mark_t* marks_prompt(Terminal_t* terminal, int64_t line, bool after)
+{
+     Marks_t* marks = &terminal->marks;
+     uint32_t i = marks_lower_bound(marks, after ? line + 1 : line, 0);
+
+     // a command has a handful of marks at most, so the nearest prompt is only a few away
+     if(after){
+          for(; i < marks->count; ++i){
+               if(marks->marks[i].kind == MARK_PROMPT) return marks->marks + i;
+          }
+     }else{
+          // marks are only dropped with history as more are added, so some may still be left of lines that are gone
+          while(i-- > marks->first && marks->marks[i].line >= terminal->history.start){
+               if(marks->marks[i].kind == MARK_PROMPT) return marks->marks + i;
+          }
+     }
+     return NULL;
+}
+
+// the mark of a kind that belongs to a command, NULL when the command has none or history no longer has it
+Mark_t* marks_find(Terminal_t* terminal, uint64_t command, uint8_t kind)
+{
+     Marks_t* marks = &terminal->marks;
+     uint32_t low = marks->first;
+     uint32_t high = marks->count;
+     while(low < high){
+          uint32_t middle = low + (high - low) / 2;
+          if(marks->marks[middle].command < command){
+               low = middle + 1;
+          }else{
+               high = middle;
+          }
+     }
+
+     for(uint32_t i = low; i < marks->count && marks->marks[i].command == command; ++i){
+          if(marks->marks[i].kind == kind) return marks->marks + i;
+     }
+     return NULL;
+}
+
+// the text of columns from up to but not including to of an absolute line, from history or the screen. returns the
+// length written, *wrapped says whether the line goes on into the next
+int marks_line_text(Terminal_t* terminal, int64_t line, int from, int to, char* buffer, int buffer_size, bool* wrapped)
+{
+     History_t* history = &terminal->history;
+     Glyph_t* glyphs;
+     int length;
+     if(line < history->end){
+          HistoryLine_t* history_line = history_get(history, line);
+          if(!history_line) return 0;
+          glyphs = history_line->glyphs;
+          length = history_line->length;
+     }else{
+          int row = line - history->end;
+          if(row >= terminal->rows) return 0;
+          glyphs = terminal->lines[row];
+          length = terminal->fills[row].from;
+     }
+
+     *wrapped = length == terminal->columns && glyphs[length - 1].attributes & GLYPH_ATTRIBUTE_WRAP;
+     if(to > length) to = length;
+
+     // trailing blanks are left out, as history leaves them out of its lines
+     while(to > from && (glyphs[to - 1].rune == ' ' || glyphs[to - 1].rune == 0)) to--;
+
+     int written = 0;
+     for(int i = from; i < to; ++i){
+          if(glyphs[i].attributes & GLYPH_ATTRIBUTE_WDUMMY) continue;
+          if(written + UTF8_SIZE * CLUSTER_MAX_RUNES >= buffer_size) break;
+          written += rune_encode(&terminal->clusters, glyphs[i].rune ? glyphs[i].rune : ' ', buffer + written);
+     }
+     return written;
+}
+
+// what a command wrote, from where its output started up to where it finished, or up to the cursor while it runs.
+// returns the length written to buffer, or -1 when the command has no output marked or it is no longer kept
+int marks_command_output(Terminal_t* terminal, uint64_t command, char* buffer, int buffer_size)
+{
+     Mark_t* start = marks_find(terminal, command, MARK_OUTPUT);
+     if(!start || start->line < terminal->history.start) return -1;
+
+     Mark_t* end = marks_find(terminal, command, MARK_FINISHED);
+     if(!end) end = marks_find(terminal, command + 1, MARK_PROMPT);
+     int64_t end_line = end ? end->line : terminal->history.end + terminal->cursor.y;
+     int end_column = end ? end->column : terminal->cursor.x;
+
+     int written = 0;
+     for(int64_t line = start->line; line <= end_line; ++line){
+          int from = (line == start->line) ? start->column : 0;
+          int to = (line == end_line) ? end_column : terminal->columns;
+          if(line == end_line && to == 0) break;
+
+          bool wrapped = false;
+          written += marks_line_text(terminal, line, from, to, buffer + written, buffer_size - written, &wrapped);
+          if(!wrapped && line != end_line && written < buffer_size - 1) buffer[written++] = '\n';
+     }
+
+     buffer[written] = 0;
+     return written;
+}
+
+void terminal_move_cursor_to(Terminal_t* terminal, int x, int y)
+{
+     int min_y;
+     int max_y;
+
+     if(terminal->cursor.state & CURSOR_STATE_ORIGIN){
+          min_y = terminal->top;
+          max_y = terminal->bottom;
+     }else{
+          min_y = 0;
+          max_y = terminal->rows - 1;
+     }
+
+     terminal->cursor.state &= ~CURSOR_STATE_WRAPNEXT;
+     terminal->cursor.x = CLAMP(x, 0, terminal->columns - 1);
+     terminal->cursor.y = CLAMP(y, min_y, max_y);
+}
+
+void terminal_move_cursor_to_absolute(Terminal_t* terminal, int x, int y)
+{
+	terminal_move_cursor_to(terminal, x, y + ((terminal->cursor.state & CURSOR_STATE_ORIGIN) ? terminal->top : 0));
+
+}
+
+void terminal_collect_clusters(Terminal_t* terminal)
+{
+     Clusters_t* clusters = &terminal->clusters;
+     History_t* history = &terminal->history;
+
+     for(int y = 0; y < terminal->rows; ++y){
+          clusters_mark_glyphs(clusters, terminal->lines[y], terminal->columns);
+          clusters_mark_glyphs(clusters, terminal->alternate_lines[y], terminal->columns);
+     }
+
+     // each distinct line once, however many times it appears in the history
+     if(history->lines){
+          for(uint32_t handle = 0; handle < history->pool.count; ++handle){
+               HistoryLine_t* line = history->pool.lines + handle;
+               if(line->references && line->clusters) clusters_mark_glyphs(clusters, line->glyphs, line->length);
+          }
+     }
+
+     clusters_sweep(clusters);
+}
+
+// fills in the row's cells from where its fill starts through column x, a chunk at a time so text written left to
+// right into an erased row is not filling in one cell per rune
+void terminal_materialize(Terminal_t* terminal, int y, int x)
+{
+     RowFill_t* fill = terminal->fills + y;
+     Glyph_t* line = terminal->lines[y];
+
+     if(x < fill->from + FILL_CHUNK - 1) x = fill->from + FILL_CHUNK - 1;
+     if(x >= terminal->columns) x = terminal->columns - 1;
+     for(int c = fill->from; c <= x; ++c) line[c] = fill->blank;
+     if(x >= fill->from) fill->from = x + 1;
+}
+
+// the row's cells, real at least through column x, for anything that reads or writes them individually
+Glyph_t* terminal_line(Terminal_t* terminal, int y, int x)
+{
+     if(x >= terminal->fills[y].from) terminal_materialize(terminal, y, x);
+     return terminal->lines[y];
+}
+
+void terminal_swap_lines(Terminal_t* terminal, int a, int b)
+{
+     Glyph_t* line = terminal->lines[a];
+     terminal->lines[a] = terminal->lines[b];
+     terminal->lines[b] = line;
+
+     RowFill_t fill = terminal->fills[a];
+     terminal->fills[a] = terminal->fills[b];
+     terminal->fills[b] = fill;
+
+     BlinkSpan_t blink = terminal->blinks[a];
+     terminal->blinks[a] = terminal->blinks[b];
+     terminal->blinks[b] = blink;
+}
+
+void terminal_blink_mark(Terminal_t* terminal, int y, int from, int to)
+{
+     BlinkSpan_t* span = terminal->blinks + y;
+     if(from < span->from) span->from = from;
+     if(to > span->to) span->to = to;
+}
+
+// an erase only shrinks the span from either end, a hole in the middle stays part of it
+void terminal_blink_erase(Terminal_t* terminal, int y, int left, int right)
+{
+     BlinkSpan_t* span = terminal->blinks + y;
+     if(right < span->from || left > span->to) return;
+
+     if(left <= span->from && right >= span->to){
+          *span = BLINK_SPAN_EMPTY;
+     }else if(left <= span->from){
+          span->from = right + 1;
+     }else if(right >= span->to){
+          span->to = left - 1;
+     }
+}
+
+// glyphs from x on moved sideways, any of them may blink now
+void terminal_blink_shift(Terminal_t* terminal, int y, int x)
+{
+     BlinkSpan_t* span = terminal->blinks + y;
+     if(span->to < x) return;
+     if(x < span->from) span->from = x;
+     span->to = terminal->columns - 1;
+}
+
+// adds a zero width rune to the cell before the cursor
+void terminal_combine(Terminal_t* terminal, Rune_t rune)
+{
+     int x = terminal->cursor.x;
+     int y = terminal->cursor.y;
+
+     // the cursor only stays on the cell it just wrote when that was the last column
+     if(!(terminal->cursor.state & CURSOR_STATE_WRAPNEXT)) x--;
+     if(x >= 0 && terminal_line(terminal, y, x)[x].attributes & GLYPH_ATTRIBUTE_WDUMMY) x--;
+     if(x < 0) return;
+
+     if(terminal->clusters.live >= terminal->clusters.collect_at) terminal_collect_clusters(terminal);
+
+     Glyph_t* glyph = terminal_line(terminal, y, x) + x;
+     glyph->rune = cluster_append(&terminal->clusters, glyph->rune, rune);
+     terminal->line_generations[y] = terminal->generation;
+}
+
+// blanks half of a wide character left behind where column x - 1 and x meet
+void terminal_fix_wide_edge(Terminal_t* terminal, int x, int y)
+{
+     Glyph_t* line = terminal_line(terminal, y, x);
+
+     if(x > 0 && x <= terminal->columns && line[x - 1].attributes & GLYPH_ATTRIBUTE_WIDE &&
+        (x == terminal->columns || !(line[x].attributes & GLYPH_ATTRIBUTE_WDUMMY))){
+          line[x - 1].rune = ' ';
+          line[x - 1].attributes &= ~GLYPH_ATTRIBUTE_WIDE;
+     }
+
+     if(x >= 0 && x < terminal->columns && line[x].attributes & GLYPH_ATTRIBUTE_WDUMMY &&
+        (x == 0 || !(line[x - 1].attributes & GLYPH_ATTRIBUTE_WIDE))){
+          line[x].rune = ' ';
+          line[x].attributes &= ~GLYPH_ATTRIBUTE_WDUMMY;
+     }
+}
+
+void terminal_set_glyph(Terminal_t* terminal, Rune_t rune, Glyph_t* attributes, int x, int y)
+{
+     Glyph_t* line = terminal_line(terminal, y, x);
+
+     terminal->line_generations[y] = terminal->generation;
+     line[x] = *attributes;
+     line[x].rune = rune;
+     line[x].attributes &= ~(GLYPH_ATTRIBUTE_WIDE | GLYPH_ATTRIBUTE_WDUMMY);
+     if(attributes->attributes & GLYPH_ATTRIBUTE_BLINK) terminal_blink_mark(terminal, y, x, x);
+
+     // only a wide character on either side can have been cut in half, and filled cells are never part of one
+     if(x > 0 && line[x - 1].attributes & GLYPH_ATTRIBUTE_WIDE) terminal_fix_wide_edge(terminal, x, y);
+     if(x + 1 < terminal->fills[y].from && line[x + 1].attributes & GLYPH_ATTRIBUTE_WDUMMY) terminal_fix_wide_edge(terminal, x + 1, y);
+}
+
+void terminal_set_wide_glyph(Terminal_t* terminal, Rune_t rune, Glyph_t* attributes, int x, int y)
+{
+     // both halves have to fit, which they never do in a single column
+     if(x < 0 || x + 2 > terminal->columns) return;
+
+     Glyph_t* line = terminal_line(terminal, y, x + 2);
+
+     terminal->line_generations[y] = terminal->generation;
+     line[x] = *attributes;
+     line[x].rune = rune;
+     line[x].attributes |= GLYPH_ATTRIBUTE_WIDE;
+     line[x].attributes &= ~GLYPH_ATTRIBUTE_WDUMMY;
+     line[x + 1] = line[x];
+     line[x + 1].rune = 0;
+     line[x + 1].attributes ^= GLYPH_ATTRIBUTE_WIDE | GLYPH_ATTRIBUTE_WDUMMY;
+     if(attributes->attributes & GLYPH_ATTRIBUTE_BLINK) terminal_blink_mark(terminal, y, x, x + 1);
+
+     terminal_fix_wide_edge(terminal, x, y);
+     terminal_fix_wide_edge(terminal, x + 2, y);
+}
+
+void terminal_clear_region(Terminal_t* terminal, int left, int top, int right, int bottom)
+{
+     // probably going to assert since we are going to trust external data
+     if(left > right){
+          int tmp = left;
+          left = right;
+          right = tmp;
+     }
+
+     if(top > bottom){
+          int tmp = top;
+          top = bottom;
+          bottom = tmp;
+     }
+
+     CLAMP(left, 0, terminal->columns - 1);
+     CLAMP(right, 0, terminal->columns - 1);
+     CLAMP(top, 0, terminal->rows - 1);
+     CLAMP(bottom, 0, terminal->rows - 1);
+
+     Glyph_t blank = {' ', 0, 0, terminal->cursor.attributes.foreground, terminal->cursor.attributes.background};
+
+     for(int y = top; y <= bottom; ++y){
+          terminal->line_generations[y] = terminal->generation;
+          terminal_blink_erase(terminal, y, left, right);
+
+          // erasing through the end of the row only moves where its fill starts
+          if(right == terminal->columns - 1){
+               RowFill_t* fill = terminal->fills + y;
+               if(fill->from < left) terminal_materialize(terminal, y, left - 1);
+
+               // a wide character whose right half was erased loses its left half too
+               Glyph_t* line = terminal->lines[y];
+               if(left > 0 && line[left - 1].attributes & GLYPH_ATTRIBUTE_WIDE){
+                    line[left - 1].rune = ' ';
+                    line[left - 1].attributes &= ~GLYPH_ATTRIBUTE_WIDE;
+               }
+
+               fill->from = left;
+               fill->blank = blank;
+               continue;
+          }
+
+          Glyph_t* line = terminal_line(terminal, y, right + 1);
+          for(int x = left; x <= right; ++x) line[x] = blank;
+
+          terminal_fix_wide_edge(terminal, left, y);
+          terminal_fix_wide_edge(terminal, right + 1, y);
+     }
+}
+
+void terminal_set_dirt(Terminal_t* terminal, int top, int bottom)
+{
+     assert(top <= bottom);
+
+     CLAMP(top, 0, terminal->rows - 1);
+     CLAMP(bottom, 0, terminal->rows - 1);
+
+     for(int i = top; i <= bottom; ++i){
+          terminal->line_generations[i] = terminal->generation;
+     }
+}
+
+void terminal_all_dirty(Terminal_t* terminal)
+{
+     terminal_set_dirt(terminal, 0, terminal->rows - 1);
+}
+
+// moves the first count rows to the end of the range, or the last -count rows to the start
+void rows_rotate(Glyph_t** rows, int top, int bottom, int count)
+{
+     int height = bottom - top + 1;
+     count = ((count % height) + height) % height;
+     if(count == 0) return;
+
+     // reversing both parts and then the whole range rotates it in place
+     int ranges[3][2] = {{top, top + count - 1}, {top + count, bottom}, {top, bottom}};
+     for(int i = 0; i < 3; ++i){
+          for(int a = ranges[i][0], b = ranges[i][1]; a < b; ++a, --b){
+               Glyph_t* row = rows[a];
+               rows[a] = rows[b];
+               rows[b] = row;
+          }
+     }
+}
+
+// the same for a flag kept along with each row
+void flags_rotate(bool* flags, int top, int bottom, int count)
+{
+     int height = bottom - top + 1;
+     count = ((count % height) + height) % height;
+     if(count == 0) return;
+
+     int ranges[3][2] = {{top, top + count - 1}, {top + count, bottom}, {top, bottom}};
+     for(int i = 0; i < 3; ++i){
+          for(int a = ranges[i][0], b = ranges[i][1]; a < b; ++a, --b){
+               bool flag = flags[a];
+               flags[a] = flags[b];
+               flags[b] = flag;
+          }
+     }
+}
+
+// the rows that moved keep their generations and the rows scrolled in are changed. only one region's scroll is kept,
+// for consumers that had everything as of scroll_base, scrolling another region or scrolling again after somebody
+// caught up starts over and marks what moved before as changed for everyone further behind
+void terminal_record_scroll(Terminal_t* terminal, int top, int bottom, int count)
+{
+     Scroll_t* scroll = &terminal->scroll;
+     int height = bottom - top + 1;
+     uint64_t handed_out = terminal->generation - 1;
+
+     if(scroll->count && (scroll->top != top || scroll->bottom != bottom || terminal->scroll_base != handed_out)){
+          for(int i = scroll->top; i <= scroll->bottom; ++i){
+               if(terminal->line_generations[i] < handed_out) terminal->line_generations[i] = handed_out;
+          }
+
+          if(scroll->top != top || scroll->bottom != bottom){
+               terminal_set_dirt(terminal, scroll->top, scroll->bottom);
+               terminal_set_dirt(terminal, top, bottom);
+               scroll->count = 0;
+               return;
+          }
+          scroll->count = 0;
+     }
+
+     uint64_t* generations = terminal->line_generations;
+     if(count > 0){
+          memmove(generations + top, generations + top + count, (height - count) * sizeof(*generations));
+          terminal_set_dirt(terminal, bottom - count + 1, bottom);
+     }else{
+          memmove(generations + top - count, generations + top, (height + count) * sizeof(*generations));
+          terminal_set_dirt(terminal, top, top - count - 1);
+     }
+
+     if(!scroll->count) terminal->scroll_base = handed_out;
+     terminal->scroll_generation = terminal->generation;
+     scroll->top = top;
+     scroll->bottom = bottom;
+     scroll->count += count;
+     CLAMP(scroll->count, -height, height);
+}
+
+// marks the rows that changed since the generation a consumer last had, with the terminal locked, and returns the
+// generation to ask about next time. rows a scroll moved are changed as well, unless the consumer is in step with
+// the scroll and takes it to move them itself, in which case only the rows it has to redraw are marked
+uint64_t terminal_changes(Terminal_t* terminal, uint64_t since, bool* changed, Scroll_t* scroll)
+{
+     bool in_step = terminal->scroll.count && since < terminal->scroll_generation;
+     bool apply = in_step && scroll && since == terminal->scroll_base;
+     if(scroll){
+          *scroll = terminal->scroll;
+          if(!apply) scroll->count = 0;
+     }
+
+     for(int r = 0; r < terminal->rows; ++r){
+          bool moved = in_step && !apply && r >= terminal->scroll.top && r <= terminal->scroll.bottom;
+          changed[r] = moved || terminal->line_generations[r] > since;
+     }
+
+     return terminal->generation++;
+}
+
+void terminal_scroll_down(Terminal_t* terminal, int original, int n)
+{
+	CLAMP(n, 0, terminal->bottom - original + 1);
+     STAT_ADD(STAT_SCROLLS, n);
+     if(n == 0) return;
+
+	terminal_clear_region(terminal, 0, terminal->bottom - n + 1, terminal->columns - 1, terminal->bottom);
+
+	for (int i = terminal->bottom; i >= original + n; i--) {
+          terminal_swap_lines(terminal, i, i - n);
+	}
+
+     terminal_record_scroll(terminal, original, terminal->bottom, -n);
+}
+
+void terminal_scroll_up(Terminal_t* terminal, int original, int n)
+{
+     CLAMP(n, 0, terminal->bottom - original + 1);
+     STAT_ADD(STAT_SCROLLS, n);
+     if(n == 0) return;
+
+     // lines scrolling off the top of the main screen go into the history
+     if(original == 0 && !(terminal->mode & TERMINAL_MODE_ALTSCREEN) && terminal->history.lines){
+          for(int i = 0; i < n; ++i){
+               // history drops trailing default blanks anyway, so a fill of them need not be filled in
+               RowFill_t* fill = terminal->fills + i;
+               Glyph_t* blank = &fill->blank;
+               bool default_blank = !blank->attributes && blank->foreground == COLOR_FOREGROUND && blank->background == COLOR_BACKGROUND;
+               if(default_blank){
+                    history_push(&terminal->history, terminal->lines[i], fill->from);
+               }else{
+                    history_push(&terminal->history, terminal_line(terminal, i, terminal->columns - 1), terminal->columns);
+               }
+          }
+     }
+
+     // clear the original line plus the scroll
+     terminal_clear_region(terminal, 0, original, terminal->columns - 1, original + n - 1);
+
+     // swap lines to move them all up
+     // the cleared lines will end up at the bottom
+     for(int i = original; i <= terminal->bottom - n; ++i){
+          terminal_swap_lines(terminal, i, i + n);
+     }
+
+     terminal_record_scroll(terminal, original, terminal->bottom, n);
+}
+
+void terminal_set_scroll(Terminal_t* terminal, int top, int bottom)
+{
+     CLAMP(top, 0, terminal->rows - 1);
+     CLAMP(bottom, 0, terminal->rows - 1);
+
+     if(top > bottom){
+          int temp = top;
+          top = bottom;
+          bottom = temp;
+     }
+
+     terminal->top = top;
+     terminal->bottom = bottom;
+}
+
+void terminal_insert_blank_line(Terminal_t* terminal, int n)
+{
+     if(BETWEEN(terminal->cursor.y, terminal->top, terminal->bottom)){
+          terminal_scroll_down(terminal, terminal->cursor.y, n);
+     }
+}
+
+void terminal_delete_line(Terminal_t* terminal, int n)
+{
+     if(BETWEEN(terminal->cursor.y, terminal->top, terminal->bottom)){
+          terminal_scroll_up(terminal, terminal->cursor.y, n);
+     }
+}
+
+void terminal_delete_char(Terminal_t* terminal, int n)
+{
+	int dst, src, size;
+	Glyph_t* line;
+
+	CLAMP(n, 0, terminal->columns - terminal->cursor.x);
+
+	dst = terminal->cursor.x;
+	src = terminal->cursor.x + n;
+	size = terminal->columns - src;
+	line = terminal_line(terminal, terminal->cursor.y, terminal->columns - 1);
+
+	memmove(&line[dst], &line[src], size * sizeof(Glyph_t));
+	terminal_blink_shift(terminal, terminal->cursor.y, dst);
+	terminal_fix_wide_edge(terminal, dst, terminal->cursor.y);
+	terminal_clear_region(terminal, terminal->columns - n, terminal->cursor.y, terminal->columns - 1, terminal->cursor.y);
+}
+
+void terminal_insert_blank(Terminal_t* terminal, int n)
+{
+	int dst, src, size;
+	Glyph_t* line;
+
+	CLAMP(n, 0, terminal->columns - terminal->cursor.x);
+
+	dst = terminal->cursor.x + n;
+	src = terminal->cursor.x;
+	size = terminal->columns - dst;
+	line = terminal_line(terminal, terminal->cursor.y, terminal->columns - 1);
+
+	memmove(&line[dst], &line[src], size * sizeof(Glyph_t));
+	terminal_blink_shift(terminal, terminal->cursor.y, src);
+	terminal_fix_wide_edge(terminal, terminal->columns, terminal->cursor.y);
+	terminal_clear_region(terminal, src, terminal->cursor.y, dst - 1, terminal->cursor.y);
+}
+
+void terminal_put_newline(Terminal_t* terminal, bool first_column)
+{
+     int y = terminal->cursor.y;
+
+     if(y == terminal->bottom){
+          terminal_scroll_up(terminal, terminal->top, 1);
+     }else{
+          y++;
+     }
+
+     terminal_move_cursor_to(terminal, first_column ? 0 : terminal->cursor.x, y);
+     terminal->line_generations[y] = terminal->generation;
+}
+
+void terminal_put_tab(Terminal_t* terminal, int n)
+{
+     unsigned int new_x = terminal->cursor.x;
+
+     if(n > 0){
+          while(new_x < terminal->columns && n--){
+               new_x++;
+               while(new_x < terminal->columns && !terminal->tabs[new_x]){
+                    new_x++;
+               }
+          }
+     }else if(n < 0){
+          while(new_x > 0 && n++){
+               new_x--;
+               while(new_x > 0 && !terminal->tabs[new_x]){
+                    new_x--;
+               }
+          }
+     }
+
+     terminal->cursor.x = CLAMP(new_x, 0, terminal->columns - 1);
+}
+
+void terminal_cursor_save(Terminal_t* terminal)
+{
+	int alt = (terminal->mode & TERMINAL_MODE_ALTSCREEN) != 0;
+     g_cursor[alt] = terminal->cursor;
+}
+
+void terminal_cursor_load(Terminal_t* terminal)
+{
+	int alt = (terminal->mode & TERMINAL_MODE_ALTSCREEN) != 0;
+     terminal->cursor = g_cursor[alt];
+     terminal_move_cursor_to(terminal, g_cursor[alt].x, g_cursor[alt].y);
+}
+
+void terminal_swap_screen(Terminal_t* terminal)
+{
+     Glyph_t** tmp_lines = terminal->lines;
+     RowFill_t* tmp_fills = terminal->fills;
+     BlinkSpan_t* tmp_blinks = terminal->blinks;
+
+     terminal->lines = terminal->alternate_lines;
+     terminal->alternate_lines = tmp_lines;
+     terminal->fills = terminal->alternate_fills;
+     terminal->alternate_fills = tmp_fills;
+     terminal->blinks = terminal->alternate_blinks;
+     terminal->alternate_blinks = tmp_blinks;
+     terminal->mode ^= TERMINAL_MODE_ALTSCREEN;
+     terminal_all_dirty(terminal);
+}
+
+void terminal_reset(Terminal_t* terminal)
+{
+     terminal->cursor.attributes.attributes = GLYPH_ATTRIBUTE_NONE;
+     terminal->cursor.attributes.foreground = COLOR_FOREGROUND;
+     terminal->cursor.attributes.background = COLOR_BACKGROUND;
+     terminal->cursor.x = 0;
+     terminal->cursor.y = 0;
+     terminal->cursor.state = CURSOR_STATE_DEFAULT;
+
+     memset(terminal->tabs, 0, terminal->columns * sizeof(*terminal->tabs));
+     for(int i = TAB_SPACES; i < terminal->columns; ++i) terminal->tabs[i] = 1;
+     terminal->top = 0;
+     terminal->bottom = terminal->rows - 1;
+     terminal->mode = TERMINAL_MODE_WRAP | TERMINAL_MODE_UTF8;
+
+     //TODO: clear character translation table
+     terminal->charset = 0;
+     terminal->escape_state = 0;
+
+     terminal_move_cursor_to(terminal, 0, 0);
+     terminal_cursor_save(terminal);
+     terminal_clear_region(terminal, 0, 0, terminal->columns - 1, terminal->rows - 1);
+     terminal_swap_screen(terminal);
+
+     terminal_move_cursor_to(terminal, 0, 0);
+     terminal_cursor_save(terminal);
+     terminal_clear_region(terminal, 0, 0, terminal->columns - 1, terminal->rows - 1);
+     terminal_swap_screen(terminal);
+}
+
+bool terminal_init(Terminal_t* terminal, int rows, int columns)
+{
+     terminal->columns = columns;
+     terminal->rows = rows;
+     terminal->bottom = terminal->rows - 1;
+
+     // allocate lines
+     terminal->lines = calloc(terminal->rows, sizeof(*terminal->lines));
+     terminal->alternate_lines = calloc(terminal->rows, sizeof(*terminal->alternate_lines));
+     if(!terminal->lines || !terminal->alternate_lines) return false;
+
+     for(int r = 0; r < terminal->rows; ++r){
+          terminal->lines[r] = calloc(terminal->columns, sizeof(*terminal->lines[r]));
+          terminal->alternate_lines[r] = calloc(terminal->columns, sizeof(*terminal->alternate_lines[r]));
+          if(!terminal->lines[r] || !terminal->alternate_lines[r]) return false;
+
+          // default fg and bg
+          for(int g = 0; g < terminal->columns; ++g){
+               terminal->lines[r][g].foreground = -1;
+               terminal->lines[r][g].background = -1;
+          }
+     }
+
+     terminal->tabs = calloc(terminal->columns, sizeof(*terminal->tabs));
+     terminal->line_generations = calloc(terminal->rows, sizeof(*terminal->line_generations));
+     terminal->fills = calloc(terminal->rows, sizeof(*terminal->fills));
+     terminal->alternate_fills = calloc(terminal->rows, sizeof(*terminal->alternate_fills));
+     terminal->blinks = calloc(terminal->rows, sizeof(*terminal->blinks));
+     terminal->alternate_blinks = calloc(terminal->rows, sizeof(*terminal->alternate_blinks));
+     if(!terminal->tabs || !terminal->line_generations || !terminal->fills || !terminal->alternate_fills ||
+        !terminal->blinks || !terminal->alternate_blinks){
+          return false;
+     }
+
+     // a consumer starts out asking for what changed since 0, which is every row
+     terminal->generation = 1;
+     for(int r = 0; r < terminal->rows; ++r){
+          terminal->fills[r].from = terminal->columns;
+          terminal->alternate_fills[r].from = terminal->columns;
+          terminal->blinks[r] = BLINK_SPAN_EMPTY;
+          terminal->alternate_blinks[r] = BLINK_SPAN_EMPTY;
+          terminal->line_generations[r] = terminal->generation;
+     }
+
+     pthread_mutex_init(&terminal->lock, NULL);
+     terminal->str_arena.limit = STR_ARENA_LIMIT;
+     terminal->clusters.collect_at = CLUSTER_COLLECT_MIN;
+     terminal->hyperlinks.collect_at = HYPERLINK_COLLECT_MIN;
+     terminal->clipboard.limit = CLIPBOARD_LIMIT;
+     for(int i = 0; i < PALETTE_SIZE; ++i) terminal->palette[i] = -1;
+
+     if(!history_init(&terminal->history, &terminal->clusters)){
+          LOG(LOG_LEVEL_ERROR, "failed to allocate %d lines of history\n", HISTORY_SIZE);
+          return false;
+     }
+
+     terminal_reset(terminal);
+     return true;
+}
+
+void terminal_control_code(Terminal_t* terminal, Rune_t rune)
+{
+     assert(is_controller(rune));
+
+     STAT_ADD(STAT_CONTROL_CODES, 1);
+
+     switch(rune){
+     default:
+          STAT_ADD(STAT_UNHANDLED, 1);
+          LOG(LOG_LEVEL_DEBUG, "unhandled control code: '%c'\n", rune);
+          break;
+     case '\t': // HT
+          terminal_put_tab(terminal, 1);
+          return;
+     case '\b': // BS
+          terminal_move_cursor_to(terminal, terminal->cursor.x - 1, terminal->cursor.y);
+          return;
+     case '\r': // CR
+          terminal_move_cursor_to(terminal, 0, terminal->cursor.y);
+          return;
+     case '\f': // LF
+     case '\v': // VT
+     case '\n': // LF
+          terminal_put_newline(terminal, terminal->mode & TERMINAL_MODE_CRLF);
+          return;
+     case '\a': // BEL
+          if(terminal->escape_state & ESCAPE_STATE_STR_END){
+               str_handle(terminal);
+          }
+          break;
+     case '\033': // ESC
+          csi_reset(&terminal->csi_escape);
+          terminal->escape_state &= ~(ESCAPE_STATE_CSI | ESCAPE_STATE_ALTCHARSET | ESCAPE_STATE_TEST);
+          terminal->escape_state |= ESCAPE_STATE_START;
+          return;
+     case '\016': // SO
+     case '\017': // SI
+          // TODO
+          break;
+     case '\032': // SUB
+          terminal_set_glyph(terminal, '?', &terminal->cursor.attributes, terminal->cursor.x, terminal->cursor.y);
+     case '\030':
+          csi_reset(&terminal->csi_escape);
+          break;
+     case '\005': // ENQ
+     case '\000': // NULL
+     case '\021': // XON
+     case '\023': // XOFF
+     case 0177:   // DEL
+          // ignored
+          return;
+     case 0x80: // PAD
+     case 0x81: // HOP
+     case 0x82: // BPH
+     case 0x83: // NBH
+     case 0x84: // IND
+          break;
+     case 0x85: // NEL
+          terminal_put_newline(terminal, true);
+          break;
+	case 0x86: // SSA
+	case 0x87: // ESA
+		break;
+	case 0x88: // HTS
+          terminal->tabs[terminal->cursor.x] = 1;
+          break;
+	case 0x89: // HTJ
+	case 0x8a: // VTS
+	case 0x8b: // PLD
+	case 0x8c: // PLU
+	case 0x8d: // RI
+	case 0x8e: // SS2
+	case 0x8f: // SS3
+	case 0x91: // PU1
+	case 0x92: // PU2
+	case 0x93: // STS
+	case 0x94: // CCH
+	case 0x95: // MW
+	case 0x96: // SPA
+	case 0x97: // EPA
+	case 0x98: // SOS
+	case 0x99: // SGCI
+		break;
+	case 0x9a: // DECID
+		tty_write(terminal->file_descriptor, VT_IDENTIFIER, sizeof(VT_IDENTIFIER) - 1);
+		break;
+	case 0x9b: // CSI
+	case 0x9c: // ST
+		break;
+	case 0x90: // DCS
+	case 0x9d: // OSC
+	case 0x9e: // PM
+	case 0x9f: // APC
+          str_sequence(terminal, rune);
+		return;
+     }
+
+     terminal->escape_state &= ~(ESCAPE_STATE_STR_END | ESCAPE_STATE_STR);
+}
+
+void terminal_set_mode(Terminal_t* terminal, bool set)
+{
+     CSIEscape_t* csi = &terminal->csi_escape;
+     int* arg;
+     int* last_arg = csi->arguments + csi->argument_count;
+     //int mode;
+     int alt;
+
+     for(arg = csi->arguments; arg <= last_arg; ++arg){
+          if(csi->private){
+               switch(*arg){
+               default:
+                    break;
+               case 1:
+                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_APPCURSOR);
+                    break;
+               case 5:
+                    //mode = terminal->mode;
+                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_REVERSE);
+                    // TODO if(mode != terminal->mode) redraw();
+                    break;
+               case 6:
+                    CHANGE_BIT(terminal->cursor.state, set, CURSOR_STATE_ORIGIN);
+                    terminal_move_cursor_to_absolute(terminal, 0, 0);
+                    break;
+               case 7:
+                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_WRAP);
+                    break;
+               case 0:
+               case 2:
+               case 3:
+               case 4:
+               case 8:
+               case 18:
+               case 19:
+               case 42:
+               case 12:
+                    // ignored
+                    break;
+               case 25:
+                    CHANGE_BIT(terminal->mode, !set, TERMINAL_MODE_HIDE);
+                    break;
+               case 9:
+                    // TODO: xsetpointermotion(0); ?
+                    CHANGE_BIT(terminal->mode, 0, TERMINAL_MODE_MOUSE);
+                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_MOUSEEX10);
+                    break;
+               case 1000:
+                    // TODO: xsetpointermotion(0); ?
+                    CHANGE_BIT(terminal->mode, 0, TERMINAL_MODE_MOUSE);
+                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_MOUSEBTN);
+                    break;
+               case 1002:
+                    // TODO: xsetpointermotion(0); ?
+                    CHANGE_BIT(terminal->mode, 0, TERMINAL_MODE_MOUSE);
+                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_MOUSEMOTION);
+                    break;
+               case 1003:
+                    // TODO: xsetpointermotion(0); ?
+                    CHANGE_BIT(terminal->mode, 0, TERMINAL_MODE_MOUSE);
+                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_MOUSEEMANY);
+                    break;
+               case 1004:
+                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_FOCUS);
+                    break;
+               case 1006:
+                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_MOUSEGR);
+                    break;
+               case 1034:
+                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_8BIT);
+                    break;
+               case 1049:
+                    if(set){
+                         terminal_cursor_save(terminal);
+                    }else{
+                         terminal_cursor_load(terminal);
+                    }
+                    // fallthrough
+               case 47:
+               case 1047:
+                    // f this layout
+                    alt = terminal->mode & TERMINAL_MODE_ALTSCREEN;
+                    if(alt) terminal_clear_region(terminal, 0, 0, terminal->columns - 1, terminal->rows - 1);
+                    if(set ^ alt) terminal_swap_screen(terminal);
+                    if(*arg != 1049) break;
+                    // fallthrough
+               case 1048:
+                    if(set){
+                         terminal_cursor_save(terminal);
+                    }else{
+                         terminal_cursor_load(terminal);
+                    }
+                    break;
+               case 2004:
+                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_BRCKTPASTE);
+                    break;
+               case 1001:
+               case 1005:
+               case 1015:
+                    // ignored
+                    break;
+               }
+          }else{
+               switch(*arg){
+               default:
+                    break;
+               case 2:
+                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_KBDLOCK);
+                    break;
+               case 4:
+                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_INSERT);
+                    break;
+               case 12:
+                    CHANGE_BIT(terminal->mode, !set, TERMINAL_MODE_ECHO);
+                    break;
+               case 20:
+                    CHANGE_BIT(terminal->mode, !set, TERMINAL_MODE_CRLF);
+                    break;
+               }
+          }
+     }
+}
+
+void terminal_set_attributes(Terminal_t* terminal)
+{
+     CSIEscape_t* csi = &terminal->csi_escape;
+
+     for(int i = 0; i < csi->argument_count; ++i){
+          switch(csi->arguments[i]){
+          default:
+               break;
+          case 0:
+               terminal->cursor.attributes.attributes &= ~(GLYPH_ATTRIBUTE_BOLD | GLYPH_ATTRIBUTE_FAINT |
+                                                           GLYPH_ATTRIBUTE_ITALIC | GLYPH_ATTRIBUTE_UNDERLINE |
+                                                           GLYPH_ATTRIBUTE_BLINK | GLYPH_ATTRIBUTE_REVERSE |
+                                                           GLYPH_ATTRIBUTE_INVISIBLE | GLYPH_ATTRIBUTE_STRUCK);
+               terminal->cursor.attributes.foreground = COLOR_FOREGROUND;
+               terminal->cursor.attributes.background = COLOR_BACKGROUND;
+               break;
+          case 1:
+               terminal->cursor.attributes.attributes |= GLYPH_ATTRIBUTE_BOLD;
+               break;
+          case 2:
+               terminal->cursor.attributes.attributes |= GLYPH_ATTRIBUTE_FAINT;
+               break;
+          case 3:
+               terminal->cursor.attributes.attributes |= GLYPH_ATTRIBUTE_ITALIC;
+               break;
+          case 4:
+               terminal->cursor.attributes.attributes |= GLYPH_ATTRIBUTE_UNDERLINE;
+               break;
+          case 5: // fallthrough
+          case 6:
+               terminal->cursor.attributes.attributes |= GLYPH_ATTRIBUTE_BLINK;
+               break;
+          case 7:
+               terminal->cursor.attributes.attributes |= GLYPH_ATTRIBUTE_REVERSE;
+               break;
+          case 8:
+               terminal->cursor.attributes.attributes |= GLYPH_ATTRIBUTE_INVISIBLE;
+               break;
+          case 9:
+               terminal->cursor.attributes.attributes |= GLYPH_ATTRIBUTE_STRUCK;
+               break;
+          case 21:
+               terminal->cursor.attributes.attributes &= ~GLYPH_ATTRIBUTE_BOLD;
+               break;
+          case 22:
+               terminal->cursor.attributes.attributes &= ~(GLYPH_ATTRIBUTE_BOLD | GLYPH_ATTRIBUTE_FAINT);
+               break;
+          case 23:
+               terminal->cursor.attributes.attributes &= ~GLYPH_ATTRIBUTE_ITALIC;
+               break;
+          case 24:
+               terminal->cursor.attributes.attributes &= ~GLYPH_ATTRIBUTE_UNDERLINE;
+               break;
+          case 25:
+               terminal->cursor.attributes.attributes &= ~GLYPH_ATTRIBUTE_BLINK;
+               break;
+          case 27:
+               terminal->cursor.attributes.attributes &= ~GLYPH_ATTRIBUTE_REVERSE;
+               break;
+          case 28:
+               terminal->cursor.attributes.attributes &= ~GLYPH_ATTRIBUTE_INVISIBLE;
+               break;
+          case 29:
+               terminal->cursor.attributes.attributes &= ~GLYPH_ATTRIBUTE_STRUCK;
+               break;
+          case 30:
+               terminal->cursor.attributes.foreground = COLOR_BLACK;
+               break;
+          case 31:
+               terminal->cursor.attributes.foreground = COLOR_RED;
+               break;
+          case 32:
+               terminal->cursor.attributes.foreground = COLOR_GREEN;
+               break;
+          case 33:
+               terminal->cursor.attributes.foreground = COLOR_YELLOW;
+               break;
+          case 34:
+               terminal->cursor.attributes.foreground = COLOR_BLUE;
+               break;
+          case 35:
+               terminal->cursor.attributes.foreground = COLOR_MAGENTA;
+               break;
+          case 36:
+               terminal->cursor.attributes.foreground = COLOR_CYAN;
+               break;
+          case 37:
+               terminal->cursor.attributes.foreground = COLOR_WHITE;
+               break;
+          case 38: // TODO: reserved fg color
+               break;
+          case 39:
+               terminal->cursor.attributes.foreground = COLOR_FOREGROUND;
+               break;
+          case 40:
+               terminal->cursor.attributes.background = COLOR_BLACK;
+               break;
+          case 41:
+               terminal->cursor.attributes.background = COLOR_RED;
+               break;
+          case 42:
+               terminal->cursor.attributes.background = COLOR_GREEN;
+               break;
+          case 43:
+               terminal->cursor.attributes.background = COLOR_YELLOW;
+               break;
+          case 44:
+               terminal->cursor.attributes.background = COLOR_BLUE;
+               break;
+          case 45:
+               terminal->cursor.attributes.background = COLOR_MAGENTA;
+               break;
+          case 46:
+               terminal->cursor.attributes.background = COLOR_CYAN;
+               break;
+          case 47:
+               terminal->cursor.attributes.background = COLOR_WHITE;
+               break;
+          case 48: // TODO: reserved bg color
+               break;
+          case 49:
+               terminal->cursor.attributes.background = COLOR_BACKGROUND;
+               break;
+          case 90:
+               terminal->cursor.attributes.foreground = COLOR_BRIGHT_BLACK;
+               break;
+          case 91:
+               terminal->cursor.attributes.foreground = COLOR_BRIGHT_RED;
+               break;
+          case 92:
+               terminal->cursor.attributes.foreground = COLOR_BRIGHT_GREEN;
+               break;
+          case 93:
+               terminal->cursor.attributes.foreground = COLOR_BRIGHT_YELLOW;
+               break;
+          case 94:
+               terminal->cursor.attributes.foreground = COLOR_BRIGHT_BLUE;
+               break;
+          case 95:
+               terminal->cursor.attributes.foreground = COLOR_BRIGHT_MAGENTA;
+               break;
+          case 96:
+               terminal->cursor.attributes.foreground = COLOR_BRIGHT_CYAN;
+               break;
+          case 97:
+               terminal->cursor.attributes.foreground = COLOR_BRIGHT_WHITE;
+               break;
+          case 100:
+               terminal->cursor.attributes.background = COLOR_BRIGHT_BLACK;
+               break;
+          case 101:
+               terminal->cursor.attributes.background = COLOR_BRIGHT_RED;
+               break;
+          case 102:
+               terminal->cursor.attributes.background = COLOR_BRIGHT_GREEN;
+               break;
+          case 103:
+               terminal->cursor.attributes.background = COLOR_BRIGHT_YELLOW;
+               break;
+          case 104:
+               terminal->cursor.attributes.background = COLOR_BRIGHT_BLUE;
+               break;
+          case 105:
+               terminal->cursor.attributes.background = COLOR_BRIGHT_MAGENTA;
+               break;
+          case 106:
+               terminal->cursor.attributes.background = COLOR_BRIGHT_CYAN;
+               break;
+          case 107:
+               terminal->cursor.attributes.background = COLOR_BRIGHT_WHITE;
+               break;
+          }
+     }
+}
+
+bool esc_handle(Terminal_t* terminal, Rune_t rune)
+{
+     STAT_ADD(STAT_ESC, 1);
+
+     switch(rune) {
+     case '[':
+          terminal->escape_state |= ESCAPE_STATE_CSI;
+          return false;
+     case '#':
+          terminal->escape_state |= ESCAPE_STATE_TEST;
+          return false;
+     case '%':
+          terminal->escape_state |= ESCAPE_STATE_UTF8;
+          return false;
+     case 'P': // DCS -- Device Control String
+     case '_': // APC -- Application Program Command
+     case '^': // PM -- Privacy Message
+     case ']': // OSC -- Operating System Command
+     case 'k': // old title set compatibility
+          str_sequence(terminal, rune);
+          return false;
+     case 'n': // LS2 -- Locking shift 2
+     case 'o': // LS3 -- Locking shift 3
+          // TODO
+          //term.charset = 2 + (ascii - 'n');
+          break;
+     case '(': // GZD4 -- set primary charset G0
+     case ')': // G1D4 -- set secondary charset G1
+     case '*': // G2D4 -- set tertiary charset G2
+     case '+': // G3D4 -- set quaternary charset G3
+          // TODO
+          //term.icharset = ascii - '(';
+          //term.esc |= ESC_ALTCHARSET;
+          return false;
+     case 'D': // IND -- Linefeed
+          if(terminal->cursor.y == terminal->bottom){
+               terminal_scroll_up(terminal, terminal->top, 1);
+          }else{
+               terminal_move_cursor_to(terminal, terminal->cursor.x, terminal->cursor.y + 1);
+          }
+          break;
+     case 'E': // NEL -- Next line
+          terminal_put_newline(terminal, 1); // always go to first col
+          break;
+     case 'H': // HTS -- Horizontal tab stop
+          terminal->tabs[terminal->cursor.x] = 1;
+          break;
+     case 'M': // RI -- Reverse index
+          if(terminal->cursor.y == terminal->top){
+               terminal_scroll_down(terminal, terminal->top, 1);
+          }else{
+               terminal_move_cursor_to(terminal, terminal->cursor.x, terminal->cursor.y - 1);
+          }
+          break;
+     case 'Z': // DECID -- Identify Terminal
+          tty_write(terminal->file_descriptor, VT_IDENTIFIER, sizeof(VT_IDENTIFIER) - 1);
+          break;
+     case 'c': // RIS -- Reset to inital state
+          terminal_reset(terminal);
+          //resettitle();
+          //xloadcols();
+          break;
+     case '=': // DECPAM -- Application keypad
+          terminal->mode |= TERMINAL_MODE_APPKEYPAD;
+          break;
+     case '>': // DECPNM -- Normal keypad
+          terminal->mode &= ~TERMINAL_MODE_APPKEYPAD;
+          break;
+     case '7': // DECSC -- Save Cursor
+          terminal_cursor_save(terminal);
+          break;
+     case '8': // DECRC -- Restore Cursor
+          terminal_cursor_load(terminal);
+          break;
+     case '\\': // ST -- String Terminator
+          if(terminal->escape_state & ESCAPE_STATE_STR_END) str_handle(terminal);
+          break;
+     default:
+          STAT_ADD(STAT_UNHANDLED, 1);
+          LOG(LOG_LEVEL_DEBUG, "erresc: unknown sequence ESC 0x%02X '%c' in sequence: '%s'\n", (unsigned char)rune, isprint(rune) ? rune : '.', terminal->csi_escape.buffer);
+          break;
+     }
+
+     return true;
+}
+
+void csi_handle(Terminal_t* terminal)
+{
+     CSIEscape_t* csi = &terminal->csi_escape;
+
+     STAT_ADD(STAT_CSI, 1);
+     if(STATS_ENABLED && BETWEEN(csi->mode[0], 0x40, 0x7F)) STATS_ADD(t_stats->csi_finals[csi->mode[0] - 0x40], 1);
+
+	switch(csi->mode[0]){
+	default:
+          STAT_ADD(STAT_UNHANDLED, 1);
+          LOG(LOG_LEVEL_DEBUG, "unhandled csi: '%c' in sequence: '%s'\n", csi->mode[0], csi->buffer);
+          break;
+     case '@':
+          DEFAULT(csi->arguments[0], 1);
+          terminal_insert_blank(terminal, csi->arguments[0]);
+          break;
+     case 'A':
+          DEFAULT(csi->arguments[0], 1);
+          terminal_move_cursor_to(terminal, terminal->cursor.x, terminal->cursor.y - csi->arguments[0]);
+          break;
+     case 'B':
+     case 'e':
+          DEFAULT(csi->arguments[0], 1);
+          terminal_move_cursor_to(terminal, terminal->cursor.x, terminal->cursor.y + csi->arguments[0]);
+          break;
+     case 'i':
+          // TODO
+          switch(csi->arguments[0]){
+          default:
+               break;
+          case 0:
+               break;
+          case 1:
+               break;
+          case 2:
+               break;
+          case 4:
+               break;
+          case 5:
+               break;
+          }
+          break;
+     case 'c':
+		if (csi->arguments[0] == 0) tty_write(terminal->file_descriptor, VT_IDENTIFIER, sizeof(VT_IDENTIFIER) - 1);
+          break;
+     case 'C':
+     case 'a':
+          DEFAULT(csi->arguments[0], 1);
+          terminal_move_cursor_to(terminal, terminal->cursor.x + csi->arguments[0], terminal->cursor.y);
+          break;
+     case 'D':
+          DEFAULT(csi->arguments[0], 1);
+          terminal_move_cursor_to(terminal, terminal->cursor.x - csi->arguments[0], terminal->cursor.y);
+          break;
+     case 'E':
+          DEFAULT(csi->arguments[0], 1);
+          terminal_move_cursor_to(terminal, 0, terminal->cursor.y + csi->arguments[0]);
+          break;
+     case 'F':
+          DEFAULT(csi->arguments[0], 1);
+          terminal_move_cursor_to(terminal, 0, terminal->cursor.y - csi->arguments[0]);
+          break;
+     case 'g':
+          switch(csi->arguments[0]){
+          default:
+               break;
+          case 0: // clear tab stop
+               terminal->tabs[terminal->cursor.x] = 0;
+               break;
+          case 3: // clear all tabs
+               memset(terminal->tabs, 0, terminal->columns * sizeof(*terminal->tabs));
+               break;
+          }
+          break;
+     case 'G':
+     case '`':
+          DEFAULT(csi->arguments[0], 1);
+          terminal_move_cursor_to(terminal, csi->arguments[0] - 1, terminal->cursor.y);
+          break;
+     case 'H':
+     case 'f':
+          DEFAULT(csi->arguments[0], 1);
+          DEFAULT(csi->arguments[1], 1);
+          terminal_move_cursor_to_absolute(terminal, csi->arguments[1] - 1, csi->arguments[0] - 1);
+          break;
+     case 'I':
+          DEFAULT(csi->arguments[0], 1);
+          terminal_put_tab(terminal, csi->arguments[0]);
+          break;
+     case 'J': // clear region in relation to cursor
+          switch(csi->arguments[0]){
+          default:
+               break;
+          case 0: // below
+               terminal_clear_region(terminal, terminal->cursor.x, terminal->cursor.y, terminal->columns - 1, terminal->cursor.y);
+               if(terminal->cursor.y < (terminal->rows - 1)){
+                    terminal_clear_region(terminal, 0, terminal->cursor.y + 1, terminal->columns - 1, terminal->rows - 1);
+               }
+               break;
+          case 1: // above
+               if(terminal->cursor.y > 1){
+                    terminal_clear_region(terminal, 0, 0, terminal->columns - 1, terminal->cursor.y - 1);
+               }
+               terminal_clear_region(terminal, 0, terminal->cursor.y, terminal->cursor.x, terminal->cursor.y);
+               break;
+          case 2: // all
+               terminal_clear_region(terminal, 0, 0, terminal->columns - 1, terminal->rows - 1);
+               break;
+          }
+          break;
+     case 'K': // clear line
+          switch(csi->arguments[0]){
+          default:
+               break;
+          case 0: // right of cursor
+               terminal_clear_region(terminal, terminal->cursor.x, terminal->cursor.y, terminal->columns - 1, terminal->cursor.y);
+               break;
+          case 1: // left of cursor
+               terminal_clear_region(terminal, 0, terminal->cursor.y, terminal->cursor.x, terminal->cursor.y);
+               break;
+          case 2: // all
+               terminal_clear_region(terminal, 0, terminal->cursor.y, terminal->columns - 1, terminal->cursor.y);
+               break;
+          }
+          break;
+     case 'S':
+          DEFAULT(csi->arguments[0], 1);
+          terminal_scroll_up(terminal, terminal->top, csi->arguments[0]);
+          break;
+     case 'T':
+          DEFAULT(csi->arguments[0], 1);
+          terminal_scroll_down(terminal, terminal->top, csi->arguments[0]);
+          break;
+     case 'L':
+          DEFAULT(csi->arguments[0], 1);
+          terminal_insert_blank_line(terminal, csi->arguments[0]);
+          break;
+     case 'l':
+          terminal_set_mode(terminal, false);
+          break;
+     case 'M':
+          DEFAULT(csi->arguments[0], 1);
+          terminal_delete_line(terminal, csi->arguments[0]);
+          break;
+     case 'X':
+          DEFAULT(csi->arguments[0], 1);
+          terminal_clear_region(terminal, terminal->cursor.x, terminal->cursor.y, terminal->cursor.x + csi->arguments[0] - 1, terminal->cursor.y);
+          break;
+     case 'P':
+          DEFAULT(csi->arguments[0], 1);
+          terminal_delete_char(terminal, csi->arguments[0]);
+          break;
+     case 'Z':
+          DEFAULT(csi->arguments[0], 1);
+          terminal_put_tab(terminal, -csi->arguments[0]);
+          break;
+     case 'd':
+          DEFAULT(csi->arguments[0], 1);
+          terminal_move_cursor_to_absolute(terminal, terminal->cursor.x, csi->arguments[0] - 1);
+          break;
+     case 'h':
+          terminal_set_mode(terminal, true);
+          break;
+     case 'm':
+          terminal_set_attributes(terminal);
+          break;
+     case 'n':
+          if(csi->arguments[0] == 6){
+               char buffer[BUFSIZ];
+               int len = snprintf(buffer, BUFSIZ, "\033[%i;%iR",
+                              terminal->cursor.x, terminal->cursor.y);
+               tty_write(terminal->file_descriptor, buffer, len);
+          }
+          break;
+     case 'r':
+          if(!csi->private){
+               DEFAULT(csi->arguments[0], 1);
+               DEFAULT(csi->arguments[1], terminal->rows);
+               terminal_set_scroll(terminal, csi->arguments[0] - 1, csi->arguments[1] - 1);
+               terminal_move_cursor_to_absolute(terminal, 0, 0);
+          }
+          break;
+     case 's':
+          terminal_cursor_save(terminal);
+          break;
+     case 'u':
+          terminal_cursor_load(terminal);
+          break;
+     case ' ': // cursor style
+          break;
+     }
+}
+
+bool arena_append(Arena_t* arena, const char* data, size_t length)
+{
+     if(arena->length + length > arena->limit){
+          arena->dropped += length;
+          return false;
+     }
+
+     if(arena->length + length > arena->capacity){
+          size_t capacity = arena->capacity ? arena->capacity : 256;
+          while(capacity < arena->length + length) capacity *= 2;
+          if(capacity > arena->limit) capacity = arena->limit;
+
+          char* new_data = realloc(arena->data, capacity);
+          if(!new_data){
+               arena->dropped += length;
+               return false;
+          }
+
+          arena->data = new_data;
+          arena->capacity = capacity;
+     }
+
+     memcpy(arena->data + arena->length, data, length);
+     arena->length += length;
+     return true;
+}
+
+void arena_reset(Arena_t* arena)
+{
+     arena->length = 0;
+     arena->dropped = 0;
+}
+
+uint32_t hyperlink_hash(const char* uri, size_t length)
+{
+     uint32_t hash = 2166136261u;
+     for(size_t i = 0; i < length; ++i){
+          hash ^= (unsigned char)(uri[i]);
+          hash *= 16777619u;
+     }
+     return hash;
+}
+
+void hyperlinks_insert_table(Hyperlinks_t* hyperlinks, uint16_t id)
+{
+     uint32_t slot = hyperlinks->links[id - 1].hash % HYPERLINK_TABLE_SIZE;
+     while(hyperlinks->table[slot]) slot = (slot + 1) % HYPERLINK_TABLE_SIZE;
+     hyperlinks->table[slot] = id;
+}
+
+// the id of the uri if it is already interned, 0 otherwise
+uint16_t hyperlink_find(Hyperlinks_t* hyperlinks, const char* uri, size_t length, uint32_t hash)
+{
+     if(!hyperlinks->table) return 0;
+
+     uint32_t slot = hash % HYPERLINK_TABLE_SIZE;
+     while(hyperlinks->table[slot]){
+          Hyperlink_t* link = hyperlinks->links + hyperlinks->table[slot] - 1;
+          if(link->hash == hash && strlen(link->uri) == length && memcmp(link->uri, uri, length) == 0){
+               return hyperlinks->table[slot];
+          }
+          slot = (slot + 1) % HYPERLINK_TABLE_SIZE;
+     }
+     return 0;
+}
+
+// stores a uri that is not interned yet, 0 when there is no room left for it
+uint16_t hyperlink_add(Hyperlinks_t* hyperlinks, const char* uri, size_t length, uint32_t hash)
+{
+     if(!hyperlinks->table){
+          hyperlinks->table = calloc(HYPERLINK_TABLE_SIZE, sizeof(*hyperlinks->table));
+          if(!hyperlinks->table) return 0;
+     }
+
+     if(hyperlinks->bytes + length + 1 > HYPERLINK_BYTES_LIMIT) return 0;
+     if(!hyperlinks->free_count && hyperlinks->count >= HYPERLINK_MAX) return 0;
+
+     char* copy = malloc(length + 1);
+     if(!copy) return 0;
+     memcpy(copy, uri, length);
+     copy[length] = 0;
+
+     uint16_t id;
+     if(hyperlinks->free_count){
+          id = hyperlinks->free[--hyperlinks->free_count];
+     }else{
+          if(hyperlinks->count == hyperlinks->capacity){
+               uint32_t capacity = hyperlinks->capacity ? hyperlinks->capacity * 2 : 64;
+               Hyperlink_t* links = realloc(hyperlinks->links, capacity * sizeof(*links));
+               if(!links){
+                    free(copy);
+                    return 0;
+               }
+               hyperlinks->links = links;
+               hyperlinks->capacity = capacity;
+          }
+          id = ++hyperlinks->count;
+     }
+
+     Hyperlink_t* link = hyperlinks->links + id - 1;
+     link->uri = copy;
+     link->hash = hash;
+     link->marked = false;
+     hyperlinks->live++;
+     hyperlinks->bytes += length + 1;
+     hyperlinks_insert_table(hyperlinks, id);
+     return id;
+}
+
+void hyperlinks_mark_glyphs(Hyperlinks_t* hyperlinks, Glyph_t* glyphs, int count)
+{
+     for(int i = 0; i < count; ++i){
+          uint16_t id = glyphs[i].link;
+          if(id && id <= hyperlinks->count) hyperlinks->links[id - 1].marked = true;
+     }
+}
+
+// frees every link no cell or cursor refers to any more
+void hyperlinks_sweep(Hyperlinks_t* hyperlinks)
+{
+     uint16_t* free_ids = realloc(hyperlinks->free, hyperlinks->count * sizeof(*free_ids));
+     if(!free_ids) return;
+     hyperlinks->free = free_ids;
+     hyperlinks->free_count = 0;
+     hyperlinks->live = 0;
+     hyperlinks->bytes = 0;
+
+     for(uint32_t id = 1; id <= hyperlinks->count; ++id){
+          Hyperlink_t* link = hyperlinks->links + id - 1;
+          if(link->marked){
+               link->marked = false;
+               hyperlinks->live++;
+               hyperlinks->bytes += strlen(link->uri) + 1;
+          }else{
+               free(link->uri);
+               link->uri = NULL;
+               hyperlinks->free[hyperlinks->free_count++] = id;
+          }
+     }
+
+     memset(hyperlinks->table, 0, HYPERLINK_TABLE_SIZE * sizeof(*hyperlinks->table));
+     for(uint32_t id = 1; id <= hyperlinks->count; ++id){
+          if(hyperlinks->links[id - 1].uri) hyperlinks_insert_table(hyperlinks, id);
+     }
+
+     // a collection looks at the whole history, so it waits until about as many links were asked for as survived it
+     hyperlinks->interned = 0;
+     hyperlinks->collect_at = hyperlinks->live;
+     if(hyperlinks->collect_at < HYPERLINK_COLLECT_MIN) hyperlinks->collect_at = HYPERLINK_COLLECT_MIN;
+}
+
+void terminal_collect_hyperlinks(Terminal_t* terminal)
+{
+     Hyperlinks_t* hyperlinks = &terminal->hyperlinks;
+     History_t* history = &terminal->history;
+
+     for(int y = 0; y < terminal->rows; ++y){
+          hyperlinks_mark_glyphs(hyperlinks, terminal->lines[y], terminal->columns);
+          hyperlinks_mark_glyphs(hyperlinks, terminal->alternate_lines[y], terminal->columns);
+     }
+     hyperlinks_mark_glyphs(hyperlinks, &terminal->cursor.attributes, 1);
+     for(int i = 0; i < ELEM_COUNT(g_cursor); ++i) hyperlinks_mark_glyphs(hyperlinks, &g_cursor[i].attributes, 1);
+
+     if(history->lines){
+          for(uint32_t handle = 0; handle < history->pool.count; ++handle){
+               HistoryLine_t* line = history->pool.lines + handle;
+               if(line->references && line->links) hyperlinks_mark_glyphs(hyperlinks, line->glyphs, line->length);
+          }
+     }
+
+     hyperlinks_sweep(hyperlinks);
+}
+
+// the id of the uri, interning it and collecting links no longer in use first when it is new and the table has grown
+uint16_t terminal_intern_hyperlink(Terminal_t* terminal, const char* uri, size_t length)
+{
+     Hyperlinks_t* hyperlinks = &terminal->hyperlinks;
+     uint32_t hash = hyperlink_hash(uri, length);
+     uint16_t id = hyperlink_find(hyperlinks, uri, length, hash);
+     if(id) return id;
+
+     // links asked for while the table is full are counted too, so a full table is not collected for every one
+     if(hyperlinks->interned >= hyperlinks->collect_at) terminal_collect_hyperlinks(terminal);
+     hyperlinks->interned++;
+
+     id = hyperlink_add(hyperlinks, uri, length, hash);
+     if(!id) LOG(LOG_LEVEL_DEBUG, "no room for another hyperlink, %u are in use\n", hyperlinks->live);
+     return id;
+}
+
+// hands the handler the part of the payload that belongs to 'field', returns how much was consumed
+size_t str_field_span(Terminal_t* terminal, const char* data, size_t length, int32_t field)
+{
+     STREscape_t* str = &terminal->str_escape;
+     size_t i = 0;
+
+     while(i < length && str->field < field){
+          if(data[i] == ';') str->field++;
+          i++;
+     }
+
+     return i;
+}
+
+void str_collect_data(Terminal_t* terminal, const char* data, size_t length)
+{
+     arena_append(&terminal->str_arena, data, length);
+}
+
+void str_discard_data(Terminal_t* terminal, const char* data, size_t length)
+{
+}
+
+void str_title_end(Terminal_t* terminal)
+{
+     size_t length = terminal->str_arena.length;
+     if(length >= TITLE_SIZE) length = TITLE_SIZE - 1;
+
+     // it is drawn in the border, where control characters would be written to the host as they are
+     for(size_t i = 0; i < length; ++i){
+          char c = terminal->str_arena.data[i];
+          terminal->title[i] = ((unsigned char)c < ' ' || c == 0x7F) ? '?' : c;
+     }
+     terminal->title[length] = 0;
+     terminal->title_dirty = true;
+}
+
+// OSC 8 ; params ; URI, an empty URI ends the hyperlink
+void str_hyperlink_data(Terminal_t* terminal, const char* data, size_t length)
+{
+     size_t skipped = str_field_span(terminal, data, length, 1);
+     arena_append(&terminal->str_arena, data + skipped, length - skipped);
+}
+
+void str_hyperlink_end(Terminal_t* terminal)
+{
+     Arena_t* arena = &terminal->str_arena;
+
+     if(arena->length == 0 || arena->dropped || arena->length >= HYPERLINK_URI_SIZE){
+          terminal->cursor.attributes.link = 0;
+     }else{
+          terminal->cursor.attributes.link = terminal_intern_hyperlink(terminal, arena->data, arena->length);
+     }
+}
+
+int base64_value(char c)
+{
+     if(BETWEEN(c, 'A', 'Z')) return c - 'A';
+     if(BETWEEN(c, 'a', 'z')) return c - 'a' + 26;
+     if(BETWEEN(c, '0', '9')) return c - '0' + 52;
+     if(c == '+') return 62;
+     if(c == '/') return 63;
+     return -1;
+}
+
+// OSC 52 ; selection ; base64 data, decoded as it arrives so the encoded payload is never stored
+void str_clipboard_data(Terminal_t* terminal, const char* data, size_t length)
+{
+     STREscape_t* str = &terminal->str_escape;
+     size_t i = 0;
+
+     if(str->clipboard == CLIPBOARD_STATE_SELECTION){
+          i = str_field_span(terminal, data, length, 1);
+          if(str->field < 1 || i == length) return;
+
+          if(data[i] == '?'){
+               str->clipboard = CLIPBOARD_STATE_QUERY;
+               return;
+          }
+
+          // a new selection replaces the old one, whether or not the view has taken that yet
+          arena_reset(&terminal->clipboard);
+          terminal->clipboard_ready = false;
+          str->clipboard = CLIPBOARD_STATE_DATA;
+     }
+     if(str->clipboard != CLIPBOARD_STATE_DATA) return;
+
+     char decoded[BUFSIZ];
+     size_t decoded_length = 0;
+
+     for(; i < length; ++i){
+          int value = base64_value(data[i]);
+          if(value < 0) continue; // padding and anything else
+
+          str->base64_bits = (str->base64_bits << 6) | value;
+          str->base64_count++;
+
+          if(str->base64_count == 4){
+               decoded[decoded_length++] = (str->base64_bits >> 16) & 0xFF;
+               decoded[decoded_length++] = (str->base64_bits >> 8) & 0xFF;
+               decoded[decoded_length++] = str->base64_bits & 0xFF;
+               str->base64_bits = 0;
+               str->base64_count = 0;
+
+               if(decoded_length + 3 > sizeof(decoded)){
+                    arena_append(&terminal->clipboard, decoded, decoded_length);
+                    decoded_length = 0;
+               }
+          }
+     }
+
+     arena_append(&terminal->clipboard, decoded, decoded_length);
+}
+
+void str_clipboard_end(Terminal_t* terminal)
+{
+     STREscape_t* str = &terminal->str_escape;
+     char decoded[2];
+
+     if(str->clipboard == CLIPBOARD_STATE_QUERY){
+          LOG(LOG_LEVEL_DEBUG, "ignored a clipboard query\n");
+          return;
+     }
+
+     // no data clears the selection
+     if(str->clipboard == CLIPBOARD_STATE_SELECTION) arena_reset(&terminal->clipboard);
+
+     // flush a final partial quantum
+     if(str->base64_count == 2){
+          decoded[0] = (str->base64_bits >> 4) & 0xFF;
+          arena_append(&terminal->clipboard, decoded, 1);
+     }else if(str->base64_count == 3){
+          decoded[0] = (str->base64_bits >> 10) & 0xFF;
+          decoded[1] = (str->base64_bits >> 2) & 0xFF;
+          arena_append(&terminal->clipboard, decoded, 2);
+     }
+
+     if(terminal->clipboard.dropped){
+          LOG(LOG_LEVEL_WARN, "clipboard selection too long, dropped it and %zu more bytes\n", terminal->clipboard.dropped);
+          arena_reset(&terminal->clipboard);
+          return;
+     }
+     terminal->clipboard_ready = true;
+}
+
+// one component of an rgb: spec, 1 to 4 hex digits ending at end. xterm scales them to the full range, so f, ff, fff
+// and ffff are all 255 and 8, 80, 800 and 8000 all about half of it
+bool parse_color_component(const char** spec, char end, unsigned int* value)
+{
+     const char* p = *spec;
+     unsigned int component = 0;
+     int digits = 0;
+     for(; isxdigit((unsigned char)(*p)) && digits <= 4; ++p, ++digits){
+          int digit = isdigit((unsigned char)(*p)) ? *p - '0' : tolower((unsigned char)(*p)) - 'a' + 10;
+          component = component * 16 + digit;
+     }
+     if(digits < 1 || digits > 4 || *p != end) return false;
+
+     unsigned int max = (1u << (digits * 4)) - 1;
+     *value = (component * 255 + max / 2) / max;
+     *spec = p + 1;
+     return true;
+}
+
+bool parse_color_spec(const char* spec, int32_t* rgb)
+{
+     unsigned int r, g, b;
+
+     if(strncmp(spec, "rgb:", 4) == 0){
+          spec += 4;
+          if(!parse_color_component(&spec, '/', &r) || !parse_color_component(&spec, '/', &g) ||
+             !parse_color_component(&spec, 0, &b)){
+               return false;
+          }
+          *rgb = (r << 16) | (g << 8) | b;
+          return true;
+     }
+
+     if(sscanf(spec, "#%02x%02x%02x", &r, &g, &b) == 3){
+          *rgb = (r << 16) | (g << 8) | b;
+          return true;
+     }
+
+     return false;
+}
+
+// OSC 4 ; index ; spec [; index ; spec ...]
+void str_palette_end(Terminal_t* terminal)
+{
+     Arena_t* arena = &terminal->str_arena;
+     char spec[64];
+
+     if(arena_append(arena, "", 1) == false) return;
+
+     char* p = arena->data;
+     while(*p){
+          char* end = NULL;
+          long index = strtol(p, &end, 10);
+          if(end == p || *end != ';') break;
+          p = end + 1;
+
+          size_t length = strcspn(p, ";");
+          if(length >= sizeof(spec)) length = sizeof(spec) - 1;
+          memcpy(spec, p, length);
+          spec[length] = 0;
+          p += strcspn(p, ";");
+          if(*p == ';') p++;
+
+          int32_t rgb;
+          if(BETWEEN(index, 0, PALETTE_SIZE - 1) && parse_color_spec(spec, &rgb)){
+               terminal->palette[index] = rgb;
+               terminal->palette_dirty = true;
+          }
+     }
+}
+
+// OSC 104 [; index ...], with no index every color is reset
+void str_palette_reset_end(Terminal_t* terminal)
+{
+     Arena_t* arena = &terminal->str_arena;
+
+     if(arena_append(arena, "", 1) == false) return;
+
+     char* p = arena->data;
+     bool any = false;
+     while(*p){
+          char* end = NULL;
+          long index = strtol(p, &end, 10);
+          if(end == p) break;
+          if(BETWEEN(index, 0, PALETTE_SIZE - 1)) terminal->palette[index] = -1;
+          any = true;
+          p = (*end == ';') ? end + 1 : end;
+     }
+
+     if(!any){
+          for(int i = 0; i < PALETTE_SIZE; ++i) terminal->palette[i] = -1;
+     }
+
+     terminal->palette_dirty = true;
+}
+
+void sixel_reset_palette(Sixel_t* sixel)
+{
+     // VT340 default colors, in percent
+     static const uint8_t defaults[16][3] = {
+          {0, 0, 0}, {20, 20, 80}, {80, 13, 13}, {20, 80, 20}, {80, 20, 80}, {20, 80, 80}, {80, 80, 20}, {53, 53, 53},
+          {26, 26, 26}, {33, 33, 60}, {60, 26, 26}, {33, 60, 33}, {60, 33, 60}, {33, 60, 60}, {60, 60, 33}, {80, 80, 80},
+     };
+
+     for(int i = 0; i < SIXEL_PALETTE_SIZE; ++i){
+          if(i < ELEM_COUNT(defaults)){
+               sixel->palette[i] = ((defaults[i][0] * 255 / 100) << 16) | ((defaults[i][1] * 255 / 100) << 8) |
+                                   (defaults[i][2] * 255 / 100);
+          }else{
+               sixel->palette[i] = 0;
+          }
+     }
+}
+
+int32_t sixel_hls_to_rgb(int hue, int lightness, int saturation)
+{
+     // sixel hue 0 is blue, rotate it so 0 is red
+     CLAMP(lightness, 0, 100);
+     CLAMP(saturation, 0, 100);
+     double h = ((hue + 240) % 360) / 360.0;
+     double l = lightness / 100.0;
+     double s = saturation / 100.0;
+     double q = (l < 0.5) ? l * (1.0 + s) : l + s - l * s;
+     double p = 2.0 * l - q;
+     double channels[3] = {h + 1.0 / 3.0, h, h - 1.0 / 3.0};
+     int32_t rgb = 0;
+
+     for(int i = 0; i < 3; ++i){
+          double t = channels[i];
+          double v;
+          if(t < 0.0) t += 1.0;
+          if(t > 1.0) t -= 1.0;
+
+          if(t < 1.0 / 6.0) v = p + (q - p) * 6.0 * t;
+          else if(t < 0.5) v = q;
+          else if(t < 2.0 / 3.0) v = p + (q - p) * (2.0 / 3.0 - t) * 6.0;
+          else v = p;
+
+          rgb = (rgb << 8) | (int32_t)(v * 255.0 + 0.5);
+     }
+
+     return rgb;
+}
+
+int32_t rgb_to_color(int32_t rgb)
+{
+     int r = (rgb >> 16) & 0xFF;
+     int g = (rgb >> 8) & 0xFF;
+     int b = rgb & 0xFF;
+
+     if(g_color_count >= 256){
+          // xterm 6x6x6 color cube
+          #define CUBE(v) ((v) < 48 ? 0 : (v) < 115 ? 1 : ((v) - 35) / 40)
+          return 16 + 36 * CUBE(r) + 6 * CUBE(g) + CUBE(b);
+          #undef CUBE
+     }
+
+     int color = ((r >= 128) ? COLOR_RED : 0) | ((g >= 128) ? COLOR_GREEN : 0) | ((b >= 128) ? COLOR_BLUE : 0);
+     if(g_color_count >= 16 && (r >= 192 || g >= 192 || b >= 192)) color += COLOR_BRIGHT_BLACK;
+     return color;
+}
+
+// works out which row of samples, if any, falls in the current band of 6 pixels
+void sixel_start_band(Sixel_t* sixel)
+{
+     int band_top = sixel->band * 6;
+     int sample_height = SIXEL_CELL_HEIGHT / 2;
+     int row = (band_top + sample_height - 1 - sample_height / 2) / sample_height;
+     int center = row * sample_height + sample_height / 2;
+
+     sixel->sample_row = -1;
+     if(BETWEEN(center, band_top, band_top + 5) && row < sixel->sample_rows){
+          sixel->sample_row = row;
+          sixel->sample_bit = center - band_top;
+     }
+}
+
+// how many bands the samples reach down through, nothing below them is kept
+int sixel_max_bands(Sixel_t* sixel)
+{
+     return (sixel->sample_rows * (SIXEL_CELL_HEIGHT / 2) + 5) / 6;
+}
+
+void sixel_put(Sixel_t* sixel, int value, int repeat)
+{
+     // nor is anything past their right edge, so neither the position nor the extent goes beyond it
+     int limit = sixel->sample_columns * SIXEL_CELL_WIDTH;
+     int x = sixel->x;
+     if(x >= limit || sixel->band >= sixel_max_bands(sixel)) return;
+     if(repeat > limit - x) repeat = limit - x;
+     sixel->x = x + repeat;
+
+     if(sixel->x > sixel->width) sixel->width = sixel->x;
+     if((sixel->band + 1) * 6 > sixel->height) sixel->height = (sixel->band + 1) * 6;
+
+     if(sixel->sample_row < 0 || !(value & (1 << sixel->sample_bit))) return;
+
+     // only the pixel at the center of each sample is kept
+     int sample_width = SIXEL_CELL_WIDTH;
+     int column = (x + sample_width - 1 - sample_width / 2) / sample_width;
+     int32_t* samples = sixel->samples + sixel->sample_row * sixel->sample_columns;
+
+     for(int center = column * sample_width + sample_width / 2;
+         center < x + repeat && column < sixel->sample_columns;
+         center += sample_width, ++column){
+          samples[column] = sixel->palette[sixel->color];
+     }
+}
+
+void sixel_command(Sixel_t* sixel)
+{
+     int* params = sixel->params;
+
+     switch(sixel->state){
+     default:
+          break;
+     case SIXEL_STATE_COLOR:
+          if(sixel->param_count >= 5){
+               if(params[1] == 1){
+                    sixel->palette[params[0] % SIXEL_PALETTE_SIZE] = sixel_hls_to_rgb(params[2], params[3], params[4]);
+               }else if(params[1] == 2){
+                    CLAMP(params[2], 0, 100);
+                    CLAMP(params[3], 0, 100);
+                    CLAMP(params[4], 0, 100);
+                    sixel->palette[params[0] % SIXEL_PALETTE_SIZE] = ((params[2] * 255 / 100) << 16) |
+                                                                     ((params[3] * 255 / 100) << 8) |
+                                                                     (params[4] * 255 / 100);
+               }
+          }
+          sixel->color = params[0] % SIXEL_PALETTE_SIZE;
+          break;
+     case SIXEL_STATE_RASTER:
+          // Pan ; Pad ; Ph ; Pv, we always sample at cell resolution
+          break;
+     }
+
+     sixel->state = SIXEL_STATE_DATA;
+}
+
+void str_sixel_data(Terminal_t* terminal, const char* data, size_t length)
+{
+     Sixel_t* sixel = &terminal->sixel;
+
+     for(size_t i = 0; i < length; ++i){
+          char c = data[i];
+
+          sixel->hash ^= (unsigned char)(c);
+          sixel->hash *= 1099511628211ull;
+
+          if(sixel->state != SIXEL_STATE_DATA){
+               if(isdigit(c)){
+                    if(sixel->param_count == 0) sixel->param_count = 1;
+                    int* param = sixel->params + sixel->param_count - 1;
+                    if(*param < 100000) *param = *param * 10 + (c - '0');
+                    continue;
+               }else if(c == ';'){
+                    if(sixel->param_count == 0) sixel->param_count = 1;
+                    if(sixel->param_count < SIXEL_PARAMETER_SIZE) sixel->params[sixel->param_count++] = 0;
+                    continue;
+               }else if(sixel->state == SIXEL_STATE_REPEAT){
+                    sixel->state = SIXEL_STATE_DATA;
+                    if(BETWEEN(c, '?', '~')) sixel_put(sixel, c - '?', sixel->params[0] ? sixel->params[0] : 1);
+                    continue;
+               }
+
+               sixel_command(sixel);
+          }
+
+          switch(c){
+          default:
+               if(BETWEEN(c, '?', '~')) sixel_put(sixel, c - '?', 1);
+               break;
+          case '!':
+          case '#':
+          case '"':
+               sixel->state = (c == '!') ? SIXEL_STATE_REPEAT : (c == '#') ? SIXEL_STATE_COLOR : SIXEL_STATE_RASTER;
+               memset(sixel->params, 0, sizeof(sixel->params));
+               sixel->param_count = 0;
+               break;
+          case '$':
+               sixel->x = 0;
+               break;
+          case '-':
+               sixel->x = 0;
+               if(sixel->band < sixel_max_bands(sixel)) sixel->band++;
+               sixel_start_band(sixel);
+               break;
+          }
+     }
+}
+
+void sixel_begin(Terminal_t* terminal)
+{
+     Sixel_t* sixel = &terminal->sixel;
+
+     // samples are kept at cell resolution, two per cell, so memory is capped by the screen width
+     int sample_columns = terminal->columns;
+     int sample_rows = SIXEL_MAX_ROWS * 2;
+     if(!sixel->samples || sixel->sample_columns != sample_columns){
+          free(sixel->samples);
+          sixel->samples = malloc(sample_columns * sample_rows * sizeof(*sixel->samples));
+          sixel->sample_columns = sixel->samples ? sample_columns : 0;
+     }
+
+     sixel->sample_rows = sixel->samples ? sample_rows : 0;
+     for(int i = 0; i < sixel->sample_columns * sixel->sample_rows; ++i) sixel->samples[i] = -1;
+
+     sixel->state = SIXEL_STATE_DATA;
+     sixel->x = 0;
+     sixel->band = 0;
+     sixel->width = 0;
+     sixel->height = 0;
+     sixel->color = 0;
+     sixel->hash = 14695981039346656037ull;
+     sixel_reset_palette(sixel);
+     sixel_start_band(sixel);
+}
+
+SixelImage_t* sixel_cache_image(Terminal_t* terminal)
+{
+     Sixel_t* sixel = &terminal->sixel;
+     SixelImage_t* victim = sixel->cache;
+
+     sixel->cache_clock++;
+
+     for(int i = 0; i < SIXEL_CACHE_SIZE; ++i){
+          SixelImage_t* image = sixel->cache + i;
+          if(image->cells && image->hash == sixel->hash){
+               image->last_used = sixel->cache_clock;
+               return image;
+          }
+          if(image->last_used < victim->last_used) victim = image;
+     }
+
+     int columns = (sixel->width + SIXEL_CELL_WIDTH - 1) / SIXEL_CELL_WIDTH;
+     int rows = (sixel->height + SIXEL_CELL_HEIGHT - 1) / SIXEL_CELL_HEIGHT;
+     if(columns > sixel->sample_columns) columns = sixel->sample_columns;
+     if(rows > sixel->sample_rows / 2) rows = sixel->sample_rows / 2;
+     if(columns == 0 || rows == 0) return NULL;
+
+     Glyph_t* cells = malloc(columns * rows * sizeof(*cells));
+     if(!cells) return NULL;
+
+     // two samples per cell, drawn with half blocks
+     for(int y = 0; y < rows; ++y){
+          int32_t* top = sixel->samples + (y * 2) * sixel->sample_columns;
+          int32_t* bottom = top + sixel->sample_columns;
+
+          for(int x = 0; x < columns; ++x){
+               Glyph_t* cell = cells + y * columns + x;
+               memset(cell, 0, sizeof(*cell));
+               cell->foreground = COLOR_FOREGROUND;
+               cell->background = COLOR_BACKGROUND;
+
+               if(top[x] >= 0){
+                    cell->rune = 0x2580; // upper half block
+                    cell->foreground = rgb_to_color(top[x]);
+                    if(bottom[x] >= 0) cell->background = rgb_to_color(bottom[x]);
+               }else if(bottom[x] >= 0){
+                    cell->rune = 0x2584; // lower half block
+                    cell->foreground = rgb_to_color(bottom[x]);
+               }else{
+                    cell->rune = ' ';
+               }
+          }
+     }
+
+     free(victim->cells);
+     victim->cells = cells;
+     victim->columns = columns;
+     victim->rows = rows;
+     victim->hash = sixel->hash;
+     victim->last_used = sixel->cache_clock;
+     return victim;
+}
+
+// OSC 133 ; kind [; exit status] [; options], kinds the index has no use for are ignored
+void str_mark_end(Terminal_t* terminal)
+{
+     Arena_t* arena = &terminal->str_arena;
+     if(arena->length == 0 || arena->dropped) return;
+
+     char kind = arena->data[0];
+     if(kind != MARK_PROMPT && kind != MARK_COMMAND && kind != MARK_OUTPUT && kind != MARK_FINISHED) return;
+     if(arena->length > 1 && arena->data[1] != ';') return; // "AB" is not an "A" mark
+
+     int32_t status = -1;
+     if(kind == MARK_FINISHED && arena->length > 2 && isdigit((unsigned char)arena->data[2])){
+          arena_append(arena, "", 1);
+          status = atoi(arena->data + 2);
+     }
+     marks_add(terminal, kind, status);
+}
+
+void str_sixel_end(Terminal_t* terminal)
+{
+     Sixel_t* sixel = &terminal->sixel;
+
+     terminal->mode &= ~TERMINAL_MODE_SIXEL;
+     if(sixel->state != SIXEL_STATE_DATA) sixel_command(sixel);
+
+     SixelImage_t* image = sixel_cache_image(terminal);
+     if(!image) return;
+
+     // the image goes at the cursor, which ends up on the line below it
+     for(int y = 0; y < image->rows; ++y){
+          int x = terminal->cursor.x;
+          for(int c = 0; c < image->columns && x + c < terminal->columns; ++c){
+               Glyph_t* cell = image->cells + y * image->columns + c;
+               terminal_set_glyph(terminal, cell->rune, cell, x + c, terminal->cursor.y);
+          }
+          terminal_put_newline(terminal, false);
+     }
+}
+
+const STRHandler_t g_str_discard = {str_discard_data, NULL};
+const STRHandler_t g_str_title = {str_collect_data, str_title_end};
+const STRHandler_t g_str_hyperlink = {str_hyperlink_data, str_hyperlink_end};
+const STRHandler_t g_str_clipboard = {str_clipboard_data, str_clipboard_end};
+const STRHandler_t g_str_palette = {str_collect_data, str_palette_end};
+const STRHandler_t g_str_palette_reset = {str_collect_data, str_palette_reset_end};
+const STRHandler_t g_str_sixel = {str_sixel_data, str_sixel_end};
+const STRHandler_t g_str_mark = {str_collect_data, str_mark_end};
+
+const STRHandler_t* osc_handler(int param)
+{
+     switch(param){
+     default:
+          STAT_ADD(STAT_UNHANDLED, 1);
+          LOG(LOG_LEVEL_DEBUG, "unhandled osc: %d\n", param);
+          break;
+     case 0:
+     case 1:
+     case 2:
+          return &g_str_title;
+     case 4:
+          return &g_str_palette;
+     case 8:
+          return &g_str_hyperlink;
+     case 52:
+          return &g_str_clipboard;
+     case 104:
+          return &g_str_palette_reset;
+     case 133:
+          return &g_str_mark;
+     }
+
+     return &g_str_discard;
+}
+
+// buffers the selector at the start of a string sequence and picks the handler for the rest
+size_t str_select_handler(Terminal_t* terminal, const char* data, size_t length)
+{
+     STREscape_t* str = &terminal->str_escape;
+     size_t i = 0;
+
+     switch(str->type){
+     default:
+          str->handler = &g_str_discard;
+          return 0;
+     case 'k':
+          str->handler = &g_str_title;
+          return 0;
+     case ']':
+          // OSC Ps ; Pt
+          while(i < length && !str->handler){
+               char c = data[i++];
+
+               if(c == ';'){
+                    str->header[str->header_length] = 0;
+                    str->handler = osc_handler(atoi(str->header));
+               }else if(isdigit(c) && str->header_length < STR_HEADER_SIZE - 1){
+                    str->header[str->header_length++] = c;
+               }else{
+                    str->handler = &g_str_discard;
+               }
+          }
+          return i;
+     case 'P':
+          // DCS parameters, then a final character picks the device control
+          while(i < length && !str->handler){
+               char c = data[i++];
+
+               if(BETWEEN(c, 0x40, 0x7E)){
+                    if(c == 'q'){
+                         terminal->mode |= TERMINAL_MODE_SIXEL;
+                         sixel_begin(terminal);
+                         str->handler = &g_str_sixel;
+                    }else{
+                         str->handler = &g_str_discard;
+                    }
+               }else if(str->header_length < STR_HEADER_SIZE - 1){
+                    str->header[str->header_length++] = c;
+               }else{
+                    str->handler = &g_str_discard;
+               }
+          }
+          return i;
+     }
+}
+
+void str_stream(Terminal_t* terminal, const char* data, size_t length)
+{
+     STREscape_t* str = &terminal->str_escape;
+
+     if(!str->handler){
+          size_t consumed = str_select_handler(terminal, data, length);
+          data += consumed;
+          length -= consumed;
+          if(!str->handler) return;
+     }
+
+     if(length) str->handler->data(terminal, data, length);
+}
+
+// how many bytes at the start of 'data' are string sequence payload, up to the terminator
+size_t str_payload_length(Terminal_t* terminal, const char* data, size_t length)
+{
+     bool utf8 = terminal->mode & TERMINAL_MODE_UTF8;
+
+     for(size_t i = 0; i < length; ++i){
+          unsigned char c = data[i];
+
+          switch(c){
+          default:
+               break;
+          case '\a':
+          case 030:
+          case 032:
+          case 033:
+               return i;
+          case 0xC2:
+               // C1 controls are two bytes in utf8
+               if(utf8){
+                    if(i + 1 >= length || is_controller_c1((unsigned char)(data[i + 1]))) return i;
+               }
+               break;
+          }
+
+          if(!utf8 && is_controller_c1(c)) return i;
+     }
+
+     return length;
+}
+
+void str_sequence(Terminal_t* terminal, Rune_t rune)
+{
+     memset(&terminal->str_escape, 0, sizeof(terminal->str_escape));
+     arena_reset(&terminal->str_arena);
+     terminal->mode &= ~TERMINAL_MODE_SIXEL;
+
+     switch(rune){
+     default:
+          break;
+     case 0x90:
+          rune = 'P';
+          break;
+     case 0x9f:
+          rune = '_';
+          break;
+     case 0x9e:
+          rune = '^';
+          break;
+     case 0x9d:
+          rune = ']';
+          break;
+     }
+
+     if(rune == 'P') terminal->escape_state |= ESCAPE_STATE_DCS;
+
+     terminal->str_escape.type = rune;
+     terminal->escape_state |= ESCAPE_STATE_STR;
+}
+
+void str_handle(Terminal_t* terminal)
+{
+     STREscape_t* str = &terminal->str_escape;
+
+     terminal->escape_state &= ~(ESCAPE_STATE_STR_END | ESCAPE_STATE_STR);
+
+     STAT_ADD(STAT_STR, 1);
+
+     // an OSC with no payload after the selector still needs its handler
+     if(!str->handler && str->type == ']' && str->header_length){
+          str->header[str->header_length] = 0;
+          str->handler = osc_handler(atoi(str->header));
+     }
+
+     if(str->handler && str->handler->end){
+          if(terminal->str_arena.dropped){
+               STAT_ADD(STAT_DROPPED_BYTES, terminal->str_arena.dropped);
+               LOG(LOG_LEVEL_WARN, "string sequence '%c' exceeded %d bytes, dropped %zu\n", str->type, STR_ARENA_LIMIT, terminal->str_arena.dropped);
+          }
+          str->handler->end(terminal);
+     }
+
+     str->handler = NULL;
+}
+
+void terminal_put(Terminal_t* terminal, Rune_t rune)
+{
+     char characters[UTF8_SIZE];
+     int width = 1;
+     int len = 0;
+
+     if(terminal->mode & TERMINAL_MODE_UTF8){
+          utf8_encode(rune, characters, UTF8_SIZE, &len);
+          width = rune_width(rune);
+     }else{
+          characters[0] = rune;
+          len = 1;
+          width = 1;
+     }
+
+     if(terminal->escape_state & ESCAPE_STATE_STR){
+          if(rune == '\a' || rune == 030 || rune == 032 || rune == 033 || is_controller_c1(rune)){
+               terminal->escape_state &= ~(ESCAPE_STATE_START | ESCAPE_STATE_STR | ESCAPE_STATE_DCS);
+               terminal->escape_state |= ESCAPE_STATE_STR_END;
+          }else{
+               str_stream(terminal, characters, len);
+               return;
+          }
+     }
+
+     if(is_controller(rune)){
+          terminal_control_code(terminal, rune);
+          return;
+     }
+
+     if(terminal->escape_state & ESCAPE_STATE_START){
+          if(terminal->escape_state & ESCAPE_STATE_CSI){
+               CSIEscape_t* csi = &terminal->csi_escape;
+               csi->buffer[csi->buffer_length] = rune;
+               csi->buffer_length++;
+
+               if(BETWEEN(rune, 0x40, 0x7E) || csi->buffer_length >= (ESCAPE_BUFFER_SIZE - 1)){
+                    terminal->escape_state = 0;
+                    csi_parse(csi);
+                    csi_handle(terminal);
+               }
+
+               return;
+          }else if(terminal->escape_state & ESCAPE_STATE_UTF8){
+               if(rune == 'G'){
+                    terminal->mode |= TERMINAL_MODE_UTF8;
+               }else if(rune == '@'){
+                    terminal->mode &= ~TERMINAL_MODE_UTF8;
+               }
+          }else if(terminal->escape_state & ESCAPE_STATE_ALTCHARSET){
+               // TODO
+          }else if(terminal->escape_state & ESCAPE_STATE_TEST){
+               // TODO
+          }else{
+               if(!esc_handle(terminal, rune)) return;
+          }
+
+          terminal->escape_state = 0;
+          return;
+     }
+
+     if(width == 0){
+          terminal_combine(terminal, rune);
+          return;
+     }
+
+     Glyph_t* current_glyph = terminal_line(terminal, terminal->cursor.y, terminal->cursor.x) + terminal->cursor.x;
+     if(terminal->mode & TERMINAL_MODE_WRAP && terminal->cursor.state & CURSOR_STATE_WRAPNEXT){
+          current_glyph->attributes |= GLYPH_ATTRIBUTE_WRAP;
+          terminal->line_generations[terminal->cursor.y] = terminal->generation;
+          terminal_put_newline(terminal, true);
+          current_glyph = terminal_line(terminal, terminal->cursor.y, terminal->cursor.x) + terminal->cursor.x;
+     }
+
+     if(terminal->mode & TERMINAL_MODE_INSERT && terminal->cursor.x + width < terminal->columns){
+          terminal_line(terminal, terminal->cursor.y, terminal->columns - 1);
+          memmove(current_glyph + width, current_glyph, (terminal->columns - terminal->cursor.x - width) * sizeof(*current_glyph));
+          terminal_blink_shift(terminal, terminal->cursor.y, terminal->cursor.x);
+          terminal_fix_wide_edge(terminal, terminal->columns, terminal->cursor.y);
+     }
+
+     if(terminal->cursor.x + width > terminal->columns){
+          // without autowrap a wide character that does not fit is drawn over the last cells of the row instead
+          if(terminal->mode & TERMINAL_MODE_WRAP){
+               terminal_put_newline(terminal, true);
+          }else{
+               terminal_move_cursor_to(terminal, terminal->columns - width, terminal->cursor.y);
+          }
+     }
+
+     if(width == 2){
+          terminal_set_wide_glyph(terminal, rune, &terminal->cursor.attributes, terminal->cursor.x, terminal->cursor.y);
+     }else{
+          terminal_set_glyph(terminal, rune, &terminal->cursor.attributes, terminal->cursor.x, terminal->cursor.y);
+     }
+     latency_echo(rune);
+
+     if(terminal->cursor.x + width < terminal->columns){
+          terminal_move_cursor_to(terminal, terminal->cursor.x + width, terminal->cursor.y);
+     }else{
+          terminal->cursor.state |= CURSOR_STATE_WRAPNEXT;
+     }
+}
+
+void terminal_echo(Terminal_t* terminal, Rune_t rune)
+{
+     if(is_controller(rune)){
+          if(rune & 0x80){
+               rune &= 0x7f;
+               terminal_put(terminal, '^');
+               terminal_put(terminal, '[');
+          }else if(rune != '\n' && rune != '\r' && rune != '\t'){
+               rune ^= 0x40;
+               terminal_put(terminal, '^');
+          }
+     }
+
+     terminal_put(terminal, rune);
+}
+
+// SIGCHLD is blocked in every thread created after this, so it only ever arrives through the returned signalfd
+int child_signal_block()
+{
+     sigset_t signals;
+     sigemptyset(&signals);
+     sigaddset(&signals, SIGCHLD);
+     pthread_sigmask(SIG_BLOCK, &signals, NULL);
+     return signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+// the child's environment: ours, less what described our own terminal, plus who the user is and what we emulate.
+// built before the spawn so the child has nothing left to do but exec. the strings set are kept in storage
+char** tty_environment(const char* shell, char storage[][PATH_MAX + 16], int storage_count)
+{
+     const struct passwd* pw = getpwuid(getuid());
+     if(pw == NULL){
+          LOG(LOG_LEVEL_ERROR, "getpwuid() failed: '%s'\n", strerror(errno));
+          return NULL;
+     }
+
+     const char* names[] = {"LOGNAME", "USER", "SHELL", "HOME", "TERM", "COLUMNS", "LINES", "TERMCAP"};
+     const char* values[] = {pw->pw_name, pw->pw_name, shell, pw->pw_dir, TERM_NAME};
+     assert(storage_count >= ELEM_COUNT(values));
+
+     int count = 0;
+     while(environ[count]) count++;
+
+     char** environment = calloc(count + ELEM_COUNT(values) + 1, sizeof(*environment));
+     if(!environment) return NULL;
+
+     int used = 0;
+     for(int i = 0; i < count; ++i){
+          bool replaced = false;
+          for(int n = 0; n < ELEM_COUNT(names) && !replaced; ++n){
+               size_t length = strlen(names[n]);
+               replaced = strncmp(environ[i], names[n], length) == 0 && environ[i][length] == '=';
+          }
+          if(!replaced) environment[used++] = environ[i];
+     }
+
+     for(int n = 0; n < ELEM_COUNT(values); ++n){
+          snprintf(storage[n], sizeof(storage[n]), "%s=%s", names[n], values[n]);
+          environment[used++] = storage[n];
+     }
+
+     return environment;
+}
+
+// starts the shell on a new pty. posix_spawn() clones without copying our address space, and the session, the
+// controlling terminal and the signals are all set up on the way to exec
+bool tty_create(int rows, int columns, pid_t* pid, int* tty_file_descriptor)
+{
+     int master_file_descriptor;
+     int slave_file_descriptor;
+     struct winsize window_size = {rows, columns, 0, 0};
+
+     if(openpty(&master_file_descriptor, &slave_file_descriptor, NULL, NULL, &window_size) < 0){
+          LOG(LOG_LEVEL_ERROR, "openpty() failed: '%s'\n", strerror(errno));
+          return false;
+     }
+
+     char slave_name[PATH_MAX];
+     if(ptsname_r(master_file_descriptor, slave_name, sizeof(slave_name)) != 0){
+          LOG(LOG_LEVEL_ERROR, "ptsname_r() failed: '%s'\n", strerror(errno));
+          return false;
+     }
+
+     char* shell = getenv("SHELL");
+     if(!shell) shell = DEFAULT_SHELL;
+
+     char storage[5][PATH_MAX + 16];
+     char** environment = tty_environment(shell, storage, ELEM_COUNT(storage));
+     if(!environment) return false;
+
+     // the child only has the slave as its standard streams. opened after setsid(), it becomes the controlling
+     // terminal of the child's session. a child that stops reading never blocks us writing keys to the master
+     fcntl(master_file_descriptor, F_SETFD, FD_CLOEXEC);
+     fcntl(master_file_descriptor, F_SETFL, fcntl(master_file_descriptor, F_GETFL) | O_NONBLOCK);
+     fcntl(slave_file_descriptor, F_SETFD, FD_CLOEXEC);
+
+     posix_spawn_file_actions_t actions;
+     posix_spawn_file_actions_init(&actions);
+     posix_spawn_file_actions_addopen(&actions, 0, slave_name, O_RDWR, 0);
+     posix_spawn_file_actions_adddup2(&actions, 0, 1);
+     posix_spawn_file_actions_adddup2(&actions, 0, 2);
+
+     // we block SIGCHLD and handle others, the shell starts out with neither
+     sigset_t no_signals;
+     sigset_t all_signals;
+     sigemptyset(&no_signals);
+     sigfillset(&all_signals);
+
+     posix_spawnattr_t attributes;
+     posix_spawnattr_init(&attributes);
+     posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+     posix_spawnattr_setsigmask(&attributes, &no_signals);
+     posix_spawnattr_setsigdefault(&attributes, &all_signals);
+
+     char* args[] = {shell, NULL};
+     int rc = posix_spawnp(pid, shell, &actions, &attributes, args, environment);
+
+     posix_spawnattr_destroy(&attributes);
+     posix_spawn_file_actions_destroy(&actions);
+     free(environment);
+     close(slave_file_descriptor);
+
+     if(rc != 0){
+          LOG(LOG_LEVEL_ERROR, "posix_spawnp() of '%s' failed: '%s'\n", shell, strerror(rc));
+          close(master_file_descriptor);
+          return false;
+     }
+
+     *tty_file_descriptor = master_file_descriptor;
+     return true;
+}
+
+// waits on a file descriptor that may be non-blocking, as the pty's master is
+void tty_wait(int file_descriptor, short events)
+{
+     struct pollfd ready = {file_descriptor, events, 0};
+     while(poll(&ready, 1, -1) < 0 && errno == EINTR);
+}
+
+bool tty_write(int file_descriptor, const char* string, size_t len)
+{
+     ssize_t written = 0;
+
+     while(written < len){
+          ssize_t rc = write(file_descriptor, string, len - written);
+
+          if(rc < 0 && errno == EINTR) continue;
+          if(rc < 0 && errno == EAGAIN){
+               tty_wait(file_descriptor, POLLOUT);
+               continue;
+          }
+          if(rc < 0){
+               printf("%s() write() to terminal failed: %s", __FUNCTION__, strerror(errno));
+               return false;
+          }
+
+          written += rc;
+          string += rc;
+     }
+
+     return true;
+}
+
+int utf8_sequence_length(char lead)
+{
+     if((lead & 0x80) == 0) return 1;
+     if((char)(lead & ~0x1F) == (char)(0xC0)) return 2;
+     if((char)(lead & ~0x0F) == (char)(0xE0)) return 3;
+     if((char)(lead & ~0x07) == (char)(0xF0)) return 4;
+     return 0;
+}
+
+// feeds a chunk of output to the terminal, returns how much of it was used, which is all of it
+// unless it ends part way through a utf8 sequence
+int terminal_parse(Terminal_t* terminal, const char* buffer, int buffer_length)
+{
+     Rune_t decoded;
+     size_t decoded_length;
+     uint64_t runes = 0; // counted here rather than per rune in terminal_put() to keep the counter out of the hottest path
+
+     for(int i = 0; i < buffer_length; ++i){
+          // hand string sequence payloads over in one piece rather than rune by rune
+          if(terminal->escape_state & ESCAPE_STATE_STR){
+               size_t payload_length = str_payload_length(terminal, buffer + i, buffer_length - i);
+               if(payload_length){
+                    str_stream(terminal, buffer + i, payload_length);
+                    i += payload_length - 1;
+                    continue;
+               }
+          }
+
+          if(utf8_decode(buffer + i, buffer_length - i, &decoded_length, &decoded)){
+               terminal_put(terminal, decoded);
+               runes++;
+               i += (decoded_length - 1);
+          }else if(terminal->mode & TERMINAL_MODE_UTF8 && utf8_sequence_length(buffer[i]) > buffer_length - i){
+               STAT_ADD(STAT_BYTES_PARSED, i);
+               STAT_ADD(STAT_RUNES, runes);
+               return i;
+          }else{
+               STAT_ADD(STAT_DROPPED_BYTES, 1);
+          }
+     }
+
+     STAT_ADD(STAT_BYTES_PARSED, buffer_length);
+     STAT_ADD(STAT_RUNES, runes);
+     return buffer_length;
+}
+
+bool byte_ring_init(ByteRing_t* ring, uint64_t size)
+{
+     ring->data = malloc(size);
+     ring->size = size;
+     ring->head = 0;
+     ring->tail = 0;
+     ring->data_ready = eventfd(0, EFD_CLOEXEC);
+     ring->space_ready = eventfd(0, EFD_CLOEXEC);
+     return ring->data && ring->data_ready >= 0 && ring->space_ready >= 0;
+}
+
+void byte_ring_free(ByteRing_t* ring)
+{
+     free(ring->data);
+     close(ring->data_ready);
+     close(ring->space_ready);
+}
+
+void byte_ring_signal(int event_file_descriptor)
+{
+     uint64_t one = 1;
+     if(write(event_file_descriptor, &one, sizeof(one)) < 0){
+          LOG(LOG_LEVEL_ERROR, "%s() failed to write eventfd: '%s'\n", __FUNCTION__, strerror(errno));
+     }
+}
+
+void byte_ring_wait(int event_file_descriptor)
+{
+     uint64_t count;
+     if(read(event_file_descriptor, &count, sizeof(count)) < 0 && errno != EINTR){
+          LOG(LOG_LEVEL_ERROR, "%s() failed to read eventfd: '%s'\n", __FUNCTION__, strerror(errno));
+     }
+}
+
+// the contiguous free space the producer can write into directly
+size_t byte_ring_writable(ByteRing_t* ring, char** space)
+{
+     uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+     uint64_t offset = ring->head & (ring->size - 1);
+     uint64_t free_space = ring->size - (ring->head - tail);
+     uint64_t until_end = ring->size - offset;
+
+     *space = ring->data + offset;
+     return (free_space < until_end) ? free_space : until_end;
+}
+
+void byte_ring_produce(ByteRing_t* ring, size_t length)
+{
+     uint64_t head = ring->head;
+     __atomic_store_n(&ring->head, head + length, __ATOMIC_SEQ_CST);
+
+     // if the consumer had caught up with us it may be waiting, a spurious signal just costs it a look
+     if(__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head) byte_ring_signal(ring->data_ready);
+}
+
+// copies out up to size bytes, returns how many
+size_t byte_ring_consume(ByteRing_t* ring, char* buffer, size_t size)
+{
+     uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+     uint64_t tail = ring->tail;
+     uint64_t available = head - tail;
+     if(available > size) available = size;
+     if(available == 0) return 0;
+
+     uint64_t offset = tail & (ring->size - 1);
+     uint64_t first = ring->size - offset;
+     if(first > available) first = available;
+     memcpy(buffer, ring->data + offset, first);
+     memcpy(buffer + first, ring->data, available - first);
+
+     __atomic_store_n(&ring->tail, tail + available, __ATOMIC_SEQ_CST);
+     if(__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) - tail == ring->size) byte_ring_signal(ring->space_ready);
+     return available;
+}
+
+bool session_log_open(SessionLog_t* log)
+{
+     log->file = open(log->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+     log->file_size = 0;
+     if(log->file < 0){
+          LOG(LOG_LEVEL_ERROR, "failed to open session log '%s': '%s'\n", log->path, strerror(errno));
+          return false;
+     }
+     return true;
+}
+
+// nothing of a transcript may be lost, so the pieces are numbered in the order they were written rather than
+// overwriting each other
+void session_log_rotate(SessionLog_t* log)
+{
+     char rotated[PATH_MAX + 16];
+
+     close(log->file);
+     snprintf(rotated, sizeof(rotated), "%s.%d", log->path, ++log->rotations);
+     if(rename(log->path, rotated) < 0){
+          LOG(LOG_LEVEL_ERROR, "failed to rotate session log '%s': '%s'\n", log->path, strerror(errno));
+     }
+     session_log_open(log);
+}
+
+void* session_log_thread(void* data)
+{
+     SessionLog_t* log = (SessionLog_t*)(data);
+     bool finished = false;
+
+     while(log->file >= 0){
+          ssize_t rc = splice(log->log[0], NULL, log->file, NULL, SESSION_LOG_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+          if(rc < 0 && errno == EINTR) continue;
+          if(rc == 0){
+               finished = true; // the reader is gone and everything it tee()d is written
+               break;
+          }
+          if(rc < 0){
+               LOG(LOG_LEVEL_ERROR, "%s() failed to write the session log: '%s'\n", __FUNCTION__, strerror(errno));
+               break;
+          }
+
+          log->file_size += rc;
+          if(log->file_size >= SESSION_LOG_ROTATE_SIZE) session_log_rotate(log);
+     }
+
+     if(log->file >= 0) close(log->file);
+     if(finished) return NULL;
+
+     // the reader stops teeing once it sees the failure, until then what it tee()s is thrown away so it never waits
+     // on a pipe nobody is emptying
+     __atomic_store_n(&log->failed, true, __ATOMIC_RELEASE);
+     char discard[BUFSIZ];
+     while(true){
+          ssize_t rc = read(log->log[0], discard, sizeof(discard));
+          if(rc < 0 && errno == EINTR) continue;
+          if(rc <= 0) break;
+     }
+     return NULL;
+}
+
+bool session_log_start(SessionLog_t* log, const char* path)
+{
+     snprintf(log->path, sizeof(log->path), "%s", path);
+     log->rotations = 0;
+     log->failed = false;
+     if(pipe2(log->output, O_CLOEXEC) < 0 || pipe2(log->log, O_CLOEXEC) < 0){
+          LOG(LOG_LEVEL_ERROR, "pipe2() failed: '%s'\n", strerror(errno));
+          return false;
+     }
+
+     // big enough for whatever one read of the pty brings, and for the log thread to fall that far behind
+     fcntl(log->output[1], F_SETPIPE_SZ, SESSION_LOG_PIPE_SIZE);
+     fcntl(log->log[1], F_SETPIPE_SZ, SESSION_LOG_PIPE_SIZE);
+
+     if(!session_log_open(log)) return false;
+
+     int rc = pthread_create(&log->thread, NULL, session_log_thread, log);
+     if(rc != 0){
+          LOG(LOG_LEVEL_ERROR, "pthread_create() failed: '%s'\n", strerror(rc));
+          return false;
+     }
+     return true;
+}
+
+// the transcript ends here, the child's output goes on without it
+void session_log_abandon(SessionLog_t* log)
+{
+     LOG(LOG_LEVEL_ERROR, "session log '%s' stopped, the transcript is incomplete\n", log->path);
+     close(log->log[1]);
+     log->log[1] = -1;
+}
+
+// reads the pty like read() would, but by way of the output pipe, whose pages are tee()d to the log pipe before
+// they are read out. a log thread that has fallen a whole pipe behind holds the reader up rather than lose output,
+// one that has failed is left behind and the pty is read directly
+ssize_t session_log_read(SessionLog_t* log, int file_descriptor, char* buffer, size_t size)
+{
+     if(log->log[1] >= 0 && __atomic_load_n(&log->failed, __ATOMIC_ACQUIRE)) session_log_abandon(log);
+     if(log->log[1] < 0) return read(file_descriptor, buffer, size);
+
+     ssize_t length = splice(file_descriptor, NULL, log->output[1], NULL, size, SPLICE_F_MOVE);
+     if(length <= 0) return length;
+
+     for(ssize_t done = 0; done < length;){
+          // tee() starts at the front of the pipe every time, so only what it copied is read out before it goes again
+          ssize_t teed = length - done;
+          if(log->log[1] >= 0){
+               teed = tee(log->output[0], log->log[1], length - done, 0);
+               if(teed < 0 && errno == EINTR) continue;
+               if(teed <= 0){
+                    LOG(LOG_LEVEL_ERROR, "%s() tee() failed: '%s'\n", __FUNCTION__, strerror(errno));
+                    session_log_abandon(log);
+                    teed = length - done;
+               }
+          }
+
+          ssize_t rc = read(log->output[0], buffer + done, teed);
+          if(rc < 0 && errno == EINTR) continue;
+          if(rc <= 0) return -1;
+          done += rc;
+     }
+
+     return length;
+}
+
+// once the reader has stopped, the log thread writes out what is left in the pipe and finishes
+void session_log_stop(SessionLog_t* log)
+{
+     if(log->log[1] >= 0) close(log->log[1]);
+     pthread_join(log->thread, NULL);
+     close(log->log[0]);
+     close(log->output[0]);
+     close(log->output[1]);
+}
+
+void* tty_reader(void* data)
+{
+     Pipeline_t* pipeline = (Pipeline_t*)(data);
+     ByteRing_t* ring = &pipeline->ring;
+
+     stats_thread("reader");
+     trace_thread("reader");
+
+     while(true){
+          char* space;
+          size_t space_length = byte_ring_writable(ring, &space);
+          if(space_length == 0){
+               // the parser is behind by a whole ring, only now does the child have to wait
+               STAT_ADD(STAT_RING_FULL, 1);
+               byte_ring_wait(ring->space_ready);
+               continue;
+          }
+
+          int rc;
+          {
+               TRACE_SCOPE("read");
+               int file_descriptor = pipeline->terminal->file_descriptor;
+               if(pipeline->session_log){
+                    rc = session_log_read(pipeline->session_log, file_descriptor, space, space_length);
+               }else{
+                    rc = read(file_descriptor, space, space_length);
+               }
+          }
+
+          if(rc < 0 && errno == EINTR) continue;
+          if(rc < 0 && errno == EAGAIN){
+               tty_wait(pipeline->terminal->file_descriptor, POLLIN);
+               continue;
+          }
+          if(rc <= 0){
+               // linux says EIO rather than end of file once the last of the child's side is closed
+               if(rc < 0 && errno != EIO){
+                    LOG(LOG_LEVEL_ERROR, "%s() failed to read from tty file descriptor: '%s'\n", __FUNCTION__, strerror(errno));
+               }
+               __atomic_store_n(&pipeline->eof, true, __ATOMIC_RELEASE);
+               byte_ring_signal(ring->data_ready);
+               return NULL;
+          }
+
+          byte_ring_produce(ring, rc);
+          STAT_ADD(STAT_READS, 1);
+          STAT_ADD(STAT_BYTES_READ, rc);
+          STAT_RECORD(HISTOGRAM_READ_BYTES, rc);
+     }
+}
+
+void pipeline_frame_ready(Pipeline_t* pipeline)
+{
+     if(!__atomic_exchange_n(&pipeline->frame_pending, true, __ATOMIC_ACQ_REL)) byte_ring_signal(pipeline->frame_ready);
+}
+
+// pipeline_stop() cancels the parser, which may be waiting to write a reply to the pty with the terminal locked
+void tty_parser_unlock(void* data)
+{
+     pthread_mutex_unlock((pthread_mutex_t*)(data));
+}
+
+void* tty_parser(void* data)
+{
+     Pipeline_t* pipeline = (Pipeline_t*)(data);
+     Terminal_t* terminal = pipeline->terminal;
+
+     char buffer[BUFSIZ];
+     int buffer_length = 0;
+
+     stats_thread("parser");
+     trace_thread("parser");
+
+     while(true){
+          // looked at before the ring, so whatever the reader read before it gave up is in there
+          bool eof = __atomic_load_n(&pipeline->eof, __ATOMIC_ACQUIRE);
+          size_t length = byte_ring_consume(&pipeline->ring, buffer + buffer_length, ELEM_COUNT(buffer) - buffer_length);
+          if(length == 0){
+               if(eof){
+                    __atomic_store_n(&pipeline->drained, true, __ATOMIC_RELEASE);
+                    pipeline_frame_ready(pipeline);
+                    return NULL;
+               }
+               byte_ring_wait(pipeline->ring.data_ready);
+               continue;
+          }
+
+          buffer_length += length;
+
+          // keep an incomplete utf8 sequence at the end for the next chunk
+          int consumed;
+          {
+               TRACE_SCOPE("parse");
+               pthread_mutex_lock(&terminal->lock);
+               pthread_cleanup_push(tty_parser_unlock, &terminal->lock);
+               consumed = terminal_parse(terminal, buffer, buffer_length);
+               pthread_cleanup_pop(1);
+          }
+          buffer_length -= consumed;
+          memmove(buffer, buffer + consumed, buffer_length);
+
+          pipeline_frame_ready(pipeline);
+     }
+}
+
+// child_signal is a signalfd of SIGCHLD from child_signal_block(), or -1 to leave the child to the caller
+bool pipeline_start(Pipeline_t* pipeline, Terminal_t* terminal, pid_t child, int child_signal)
+{
+     pipeline->terminal = terminal;
+     pipeline->child = child;
+     pipeline->child_signal = child_signal;
+     pipeline->frame_ready = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+     if(pipeline->frame_ready < 0 || !byte_ring_init(&pipeline->ring, PIPELINE_RING_SIZE)){
+          LOG(LOG_LEVEL_ERROR, "failed to set up the pipeline: '%s'\n", strerror(errno));
+          return false;
+     }
+
+     int rc = pthread_create(&pipeline->parser, NULL, tty_parser, pipeline);
+     if(rc == 0) rc = pthread_create(&pipeline->reader, NULL, tty_reader, pipeline);
+     if(rc != 0){
+          LOG(LOG_LEVEL_ERROR, "pthread_create() failed: '%s'\n", strerror(rc));
+          return false;
+     }
+     return true;
+}
+
+// reaps the child if it has exited
+void pipeline_reap(Pipeline_t* pipeline)
+{
+     struct signalfd_siginfo info;
+     while(read(pipeline->child_signal, &info, sizeof(info)) == sizeof(info));
+
+     if(pipeline->child_exited) return;
+
+     int status;
+     if(waitpid(pipeline->child, &status, WNOHANG) != pipeline->child) return;
+
+     pipeline->child_status = status;
+     pipeline->child_exited = time_nanoseconds();
+     LOG(LOG_LEVEL_INFO, "child %d exited with status %d\n", pipeline->child, status);
+}
+
+// true once the child has exited and its last output was parsed, or has had CHILD_DRAIN_NS to be. a grandchild that
+// still holds the pty open does not keep the session alive
+bool pipeline_finished(Pipeline_t* pipeline)
+{
+     if(!pipeline->child_exited) return false;
+     if(__atomic_load_n(&pipeline->drained, __ATOMIC_ACQUIRE)) return true;
+     return time_nanoseconds() - pipeline->child_exited >= CHILD_DRAIN_NS;
+}
+
+void pipeline_stop(Pipeline_t* pipeline)
+{
+     pthread_cancel(pipeline->reader);
+     pthread_join(pipeline->reader, NULL);
+     pthread_cancel(pipeline->parser);
+     pthread_join(pipeline->parser, NULL);
+
+     if(pipeline->session_log) session_log_stop(pipeline->session_log);
+     close(pipeline->frame_ready);
+     byte_ring_free(&pipeline->ring);
+}
+
+#define KEY_CURSOR(final) \
+     {"\033[" final, "\033[" final, "\033O" final, TERMINAL_MODE_APPCURSOR}, \
+     {"\033O" final, "\033[" final, "\033O" final, TERMINAL_MODE_APPCURSOR}
+#define KEY_KEYPAD(final, normal) {"\033O" final, normal, "\033O" final, TERMINAL_MODE_APPKEYPAD}
+#define KEY_SHIFTED(final, action) {"\033[1;2" final, "\033[1;2" final, "\033[1;2" final, 0, action}
+
+// only keys that differ by mode are here, anything else goes to the child as the host sent it. keypad() puts the
+// host in its application modes, but either form of a cursor key may arrive
+KeySequence_t g_key_sequences[] = {
+     KEY_CURSOR("A"), KEY_CURSOR("B"), KEY_CURSOR("C"), KEY_CURSOR("D"), KEY_CURSOR("H"), KEY_CURSOR("F"),
+     KEY_KEYPAD("j", "*"), KEY_KEYPAD("k", "+"), KEY_KEYPAD("l", ","), KEY_KEYPAD("m", "-"), KEY_KEYPAD("n", "."),
+     KEY_KEYPAD("o", "/"), KEY_KEYPAD("p", "0"), KEY_KEYPAD("q", "1"), KEY_KEYPAD("r", "2"), KEY_KEYPAD("s", "3"),
+     KEY_KEYPAD("t", "4"), KEY_KEYPAD("u", "5"), KEY_KEYPAD("v", "6"), KEY_KEYPAD("w", "7"), KEY_KEYPAD("x", "8"),
+     KEY_KEYPAD("y", "9"), KEY_KEYPAD("M", "\r"), KEY_KEYPAD("X", "="),
+     KEY_SHIFTED("A", KEY_ACTION_PAN_UP), KEY_SHIFTED("B", KEY_ACTION_PAN_DOWN), KEY_SHIFTED("C", KEY_ACTION_PAN_RIGHT),
+     KEY_SHIFTED("D", KEY_ACTION_PAN_LEFT), KEY_SHIFTED("H", KEY_ACTION_FOLLOW),
+     {KEY_SEARCH, KEY_SEARCH, KEY_SEARCH, 0, KEY_ACTION_SEARCH},
+};
+
+// node 0 is the root
+KeyTrieNode_t g_key_trie[KEY_TRIE_SIZE];
+
+uint16_t key_trie_child(uint16_t node, uint8_t byte)
+{
+     for(uint16_t child = g_key_trie[node].child; child; child = g_key_trie[child].sibling){
+          if(g_key_trie[child].byte == byte) return child;
+     }
+     return 0;
+}
+
+bool key_trie_build()
+{
+     int used = 1;
+     memset(g_key_trie, 0, sizeof(g_key_trie));
+
+     for(int i = 0; i < ELEM_COUNT(g_key_sequences); ++i){
+          uint16_t node = 0;
+          for(const char* c = g_key_sequences[i].sequence; *c; ++c){
+               uint16_t child = key_trie_child(node, *c);
+               if(!child){
+                    if(used == KEY_TRIE_SIZE) return false;
+                    child = used++;
+                    g_key_trie[child].byte = *c;
+                    g_key_trie[child].sibling = g_key_trie[node].child;
+                    g_key_trie[node].child = child;
+               }
+               node = child;
+          }
+          g_key_trie[node].sequence = i + 1;
+     }
+
+     return true;
+}
+
+// rewrites the keys in the input the way the child's modes ask for into output, which needs as much room as the
+// input, and counts keys whose action has its bit in take into actions rather than writing them. returns the length
+// written, *used falls short of length when the input ends part way into a sequence
+size_t key_decode(const char* input, size_t length, TerminalMode_t mode, uint32_t take, int32_t* actions, char* output,
+                  size_t* used)
+{
+     size_t written = 0;
+     size_t i = 0;
+
+     while(i < length){
+          uint16_t node = 0;
+          size_t end = i;
+          while(end < length){
+               uint16_t child = key_trie_child(node, input[end]);
+               if(!child) break;
+               node = child;
+               end++;
+               if(g_key_trie[node].sequence) break;
+          }
+
+          if(node && g_key_trie[node].sequence){
+               KeySequence_t* key = g_key_sequences + g_key_trie[node].sequence - 1;
+               i = end;
+               if(key->action && take & 1u << key->action){
+                    actions[key->action]++;
+                    continue;
+               }
+
+               const char* translated = (mode & key->mode) ? key->application : key->normal;
+               size_t translated_length = strlen(translated);
+               memcpy(output + written, translated, translated_length);
+               written += translated_length;
+          }else if(node && end == length){
+               break;
+          }else{
+               output[written++] = input[i++];
+          }
+     }
+
+     *used = i;
+     return written;
+}
+
+bool key_input_init(KeyInput_t* input, Terminal_t* terminal, int file_descriptor)
+{
+     input->terminal = terminal;
+     input->file_descriptor = file_descriptor;
+     input->pending = 0;
+     input->queued.limit = KEY_QUEUE_LIMIT;
+     return key_trie_build();
+}
+
+// writes as much of the queue as the pty takes without waiting, the rest goes once ppoll() says there is room
+void key_input_flush(KeyInput_t* input)
+{
+     Arena_t* queued = &input->queued;
+     size_t written = 0;
+
+     while(written < queued->length){
+          ssize_t rc = write(input->terminal->file_descriptor, queued->data + written, queued->length - written);
+          if(rc < 0 && errno == EINTR) continue;
+          if(rc < 0){
+               // the child is gone when it is anything but a full pty, and the keys with it
+               if(errno != EAGAIN){
+                    LOG(LOG_LEVEL_ERROR, "%s() write() to the pty failed: '%s'\n", __FUNCTION__, strerror(errno));
+                    written = queued->length;
+               }
+               break;
+          }
+          written += rc;
+     }
+
+     queued->length -= written;
+     memmove(queued->data, queued->data + written, queued->length);
+}
+
+void key_input_send(KeyInput_t* input, const char* keys, size_t length)
+{
+     Terminal_t* terminal = input->terminal;
+
+     if(memchr(keys, 17, length)) g_quit = true;
+     if(length == 1 && isprint((unsigned char)(keys[0]))) latency_sent(keys[0]);
+
+     if(!arena_append(&input->queued, keys, length)){
+          LOG(LOG_LEVEL_WARN, "the child is not reading its input, dropped %zu bytes of keys\n", length);
+          input->queued.dropped = 0;
+          return;
+     }
+     key_input_flush(input);
+
+     if(__atomic_load_n(&terminal->mode, __ATOMIC_RELAXED) & TERMINAL_MODE_ECHO){
+          pthread_mutex_lock(&terminal->lock);
+          for(size_t i = 0; i < length; i++){
+               terminal_echo(terminal, keys[i]);
+          }
+          pthread_mutex_unlock(&terminal->lock);
+     }
+}
+
+// while the search prompt is open keys edit its pattern rather than go to the child. enter or shift page up look
+// further back, any other sequence or a lone escape closes it
+void key_input_search(KeyInput_t* input, const char* keys, size_t length)
+{
+     for(size_t i = 0; i < length; ++i){
+          unsigned char c = keys[i];
+
+          if(c == '\033'){
+               size_t search_length = sizeof(KEY_SEARCH) - 1;
+               if(length - i >= search_length && memcmp(keys + i, KEY_SEARCH, search_length) == 0){
+                    input->actions[KEY_ACTION_SEARCH]++;
+                    i += search_length - 1;
+                    continue;
+               }
+               input->searching = false;
+               input->actions[KEY_ACTION_SEARCH_EDIT]++;
+               return;
+          }
+
+          if(c == '\r'){
+               input->actions[KEY_ACTION_SEARCH]++;
+          }else if(c == 0x7F || c == '\b'){
+               // a whole utf8 sequence at a time
+               while(input->search_length && (input->search[--input->search_length] & 0xC0) == 0x80);
+               input->actions[KEY_ACTION_SEARCH_EDIT]++;
+          }else if(c == 17){
+               g_quit = true;
+          }else if(c >= ' ' && input->search_length < SEARCH_PATTERN_SIZE - 1){
+               input->search[input->search_length++] = c;
+               input->actions[KEY_ACTION_SEARCH_EDIT]++;
+          }
+     }
+     input->search[input->search_length] = 0;
+}
+
+// reads what the host has for us and sends it on in one write, holding back a sequence that is cut off
+void key_input_read(KeyInput_t* input)
+{
+     int rc = read(input->file_descriptor, input->buffer + input->pending, sizeof(input->buffer) - input->pending);
+     if(rc < 0 && (errno == EINTR || errno == EAGAIN)) return;
+     if(rc <= 0){
+          LOG(LOG_LEVEL_INFO, "%s() stopped reading keys: '%s'\n", __FUNCTION__, rc ? strerror(errno) : "end of file");
+          input->file_descriptor = -1;
+          g_quit = true;
+          return;
+     }
+
+     if(input->searching){
+          key_input_search(input, input->buffer, input->pending + rc);
+          input->pending = 0;
+          return;
+     }
+
+     char output[BUFSIZ];
+     size_t used;
+     size_t length = input->pending + rc;
+     size_t written = key_decode(input->buffer, length, __atomic_load_n(&input->terminal->mode, __ATOMIC_RELAXED),
+                                 input->take_actions, input->actions, output, &used);
+     if(written) key_input_send(input, output, written);
+
+     if(input->actions[KEY_ACTION_SEARCH]){
+          // opens the prompt empty, there is nothing to look for yet
+          input->actions[KEY_ACTION_SEARCH] = 0;
+          input->actions[KEY_ACTION_SEARCH_EDIT]++;
+          input->searching = true;
+          input->search_length = 0;
+          input->search[0] = 0;
+     }
+
+     input->pending = length - used;
+     memmove(input->buffer, input->buffer + used, input->pending);
+     input->pending_deadline = time_nanoseconds() + KEY_SEQUENCE_TIMEOUT_NS;
+}
+
+bool key_input_has_actions(KeyInput_t* input)
+{
+     for(int i = KEY_ACTION_NONE + 1; i < KEY_ACTION_COUNT; ++i){
+          if(input->actions[i]) return true;
+     }
+     return false;
+}
+
+// sleeps until one of the events comes, a key with an action is taken or the deadline passes, passing on keys typed
+// in the meantime. returns whether either happened, the events' revents say which came
+bool key_input_wait(KeyInput_t* input, struct pollfd* events, int event_count, uint64_t deadline)
+{
+     assert(event_count <= KEY_WAIT_EVENTS);
+
+     while(!g_quit){
+          uint64_t now = time_nanoseconds();
+          bool pending = input && input->pending;
+          if(pending && now >= input->pending_deadline){
+               // nothing more came, so it was typed as it is
+               key_input_send(input, input->buffer, input->pending);
+               input->pending = 0;
+               continue;
+          }
+          if(now >= deadline) return false;
+
+          uint64_t until = (pending && input->pending_deadline < deadline) ? input->pending_deadline : deadline;
+          struct timespec timeout = {(until - now) / 1000000000ULL, (until - now) % 1000000000ULL};
+
+          // SIGUSR1 is blocked everywhere but here, so a request for the stats wakes this wait
+          sigset_t signals;
+          pthread_sigmask(SIG_SETMASK, NULL, &signals);
+          sigdelset(&signals, SIGUSR1);
+
+          // the pty is only waited on while it owes the child keys, ppoll() skips a negative descriptor
+          bool queued = input && input->queued.length;
+          struct pollfd file_descriptors[KEY_WAIT_EVENTS + 2] = {
+               {input ? input->file_descriptor : -1, POLLIN, 0},
+               {queued ? input->terminal->file_descriptor : -1, POLLOUT, 0},
+          };
+          memcpy(file_descriptors + 2, events, event_count * sizeof(*events));
+          if(ppoll(file_descriptors, event_count + 2, (until == UINT64_MAX) ? NULL : &timeout, &signals) < 0){
+               if(errno == EINTR && !g_stats_requested) continue;
+               return false;
+          }
+
+          if(file_descriptors[1].revents) key_input_flush(input);
+          if(file_descriptors[0].revents) key_input_read(input);
+
+          bool event = input && key_input_has_actions(input);
+          for(int i = 0; i < event_count; ++i){
+               events[i].revents = file_descriptors[i + 2].revents;
+               if(events[i].revents) event = true;
+          }
+          if(event) return true;
+     }
+
+     return false;
+}
+
+// sleeps until the parser has something new, but draws no more often than DRAW_USEC_LIMIT, returns false on timeout,
+// at the deadline when it is not 0, or when the child exits. with no deadline an idle session sleeps until then. keys,
+// when there is input to take them from, go to the child as they are typed in the meantime
+bool pipeline_wait_frame(Pipeline_t* pipeline, uint64_t* last_frame, KeyInput_t* input, uint64_t deadline)
+{
+     uint64_t timeout = deadline ? deadline : UINT64_MAX;
+
+     // a grandchild still holding the pty keeps the parser from ever saying it is drained, so that wait is bounded
+     if(pipeline->child_exited && pipeline->child_exited + CHILD_DRAIN_NS < timeout){
+          timeout = pipeline->child_exited + CHILD_DRAIN_NS;
+     }
+     struct pollfd events[2] = {{pipeline->frame_ready, POLLIN, 0}, {pipeline->child_signal, POLLIN, 0}};
+     if(!key_input_wait(input, events, ELEM_COUNT(events), timeout)) return false;
+     if(events[1].revents) pipeline_reap(pipeline);
+     // the view is drawn again after a pan whether or not the child wrote anything
+     if(!events[0].revents) return input && key_input_has_actions(input);
+
+     uint64_t count;
+     if(read(pipeline->frame_ready, &count, sizeof(count)) < 0 && errno != EAGAIN) return false;
+
+     key_input_wait(input, NULL, 0, *last_frame + DRAW_USEC_LIMIT * 1000ULL);
+
+     // cleared before the snapshot, so anything parsed after it asks for another frame
+     __atomic_store_n(&pipeline->frame_pending, false, __ATOMIC_RELEASE);
+     *last_frame = time_nanoseconds();
+     return true;
+}
+
+bool utf8_decode(const char* buffer, size_t buffer_len, size_t* len, Rune_t* u)
+{
+     if(buffer_len < 1) return false;
+
+     // 0xxxxxxx is just ascii
+     if((buffer[0] & 0x80) == 0){
+          *len = 1;
+          *u = buffer[0];
+     // 110xxxxx is a 2 byte utf8 string
+     }else if((char)(buffer[0] & ~0x1F) == (char)(0xC0)){
+          if(buffer_len < 2) return false;
+
+          *len = 2;
+          *u = buffer[0] & 0x1F;
+          *u <<= 6;
+          *u |= buffer[1] & 0x3F;
+     // 1110xxxx is a 3 byte utf8 string
+     }else if((char)(buffer[0] & ~0x0F) == (char)(0xE0)){
+          if(buffer_len < 3) return false;
+
+          *len = 3;
+          *u = buffer[0] & 0x0F;
+          *u <<= 6;
+          *u |= buffer[1] & 0x3F;
+          *u <<= 6;
+          *u |= buffer[2] & 0x3F;
+     // 11110xxx is a 4 byte utf8 string
+     }else if((char)(buffer[0] & ~0x07) == (char)(0xF0)){
+          if(buffer_len < 4) return false;
+
+          *len = 4;
+          *u = buffer[0] & 0x0F;
+          *u <<= 6;
+          *u |= buffer[1] & 0x3F;
+          *u <<= 6;
+          *u |= buffer[2] & 0x3F;
+          *u <<= 6;
+          *u |= buffer[3] & 0x3F;
+     }else{
+          return false;
+     }
+
+     return true;
+}
+
+bool utf8_encode(Rune_t u, char* buffer, size_t buffer_len, int* len)
+{
+     if(u < 0x80){
+          if(buffer_len < 1) return false;
+          *len = 1;
+
+          // leave as-is
+          buffer[0] = u;
+     }else if(u < 0x0800){
+          if(buffer_len < 2) return false;
+          *len = 2;
+
+          // u = 00000000 00000000 00000abc defghijk
+
+          // 2 bytes
+          // first byte:  110abcde
+          buffer[0] = 0xC0 | ((u >> 6) & 0x1f);
+
+          // second byte: 10fghijk
+          buffer[1] = 0x80 | (u & 0x3f);
+     }else if(u < 0x10000){
+          if(buffer_len < 3) return false;
+          *len = 3;
+
+          // u = 00000000 00000000 abcdefgh ijklmnop
+
+          // 3 bytes
+          // first byte:  1110abcd
+          buffer[0] = 0xE0 | ((u >> 12) & 0x0F);
+
+          // second byte: 10efghij
+          buffer[1] = 0x80 | ((u >> 6) & 0x3F);
+
+          // third byte:  10klmnop
+          buffer[2] = 0x80 | (u & 0x3F);
+     }else if(u < 0x110000){
+          if(buffer_len < 4) return false;
+          *len = 4;
+
+          // u = 00000000 000abcde fghijklm nopqrstu
+
+          // 4 bytes
+          // first byte:  11110abc
+          buffer[0] = 0xF0 | ((u >> 18) & 0x07);
+          // second byte: 10defghi
+          buffer[1] = 0x80 | ((u >> 12) & 0x3F);
+          // third byte:  10jklmno
+          buffer[2] = 0x80 | ((u >> 6) & 0x3F);
+          // fourth byte: 10pqrstu
+          buffer[3] = 0x80 | (u & 0x3F);
+     }
+
+     return true;
+}
+
+void view_init(View_t* view, WINDOW* window)
+{
+     view->window = window;
+     view->follow = true;
+     view->search_match = -1;
+     view->link_uris.limit = HYPERLINK_BYTES_LIMIT;
+     view->clipboard.limit = CLIPBOARD_LIMIT;
+     idlok(window, TRUE); // so scrolling the window can scroll the host
+     view->color_defs.count = 0;
+     view->color_pair = 0;
+     view->last_color_foreground = -1;
+     view->last_color_background = -1;
+
+     // remember the host palette so OSC 104 can put it back
+     for(int i = 0; i < PALETTE_SIZE; ++i){
+          view->applied_palette[i] = -1;
+          if(i >= COLORS || color_content(i, view->default_palette[i], view->default_palette[i] + 1, view->default_palette[i] + 2) == ERR){
+               view->default_palette[i][0] = view->default_palette[i][1] = view->default_palette[i][2] = 0;
+          }
+     }
+}
+
+void view_apply_palette(View_t* view)
+{
+     for(int i = 0; i < PALETTE_SIZE && i < COLORS && can_change_color(); ++i){
+          int32_t rgb = view->palette[i];
+          if(rgb == view->applied_palette[i]) continue;
+
+          if(rgb < 0){
+               init_color(i, view->default_palette[i][0], view->default_palette[i][1], view->default_palette[i][2]);
+          }else{
+               // curses color components go from 0 to 1000
+               init_color(i, ((rgb >> 16) & 0xFF) * 1000 / 255, ((rgb >> 8) & 0xFF) * 1000 / 255,
+                          (rgb & 0xFF) * 1000 / 255);
+          }
+
+          view->applied_palette[i] = rgb;
+     }
+}
+
+void view_set_color(View_t* view, Glyph_t* glyph)
+{
+     ColorDefs_t* color_defs = &view->color_defs;
+
+     wstandend(view->window);
+
+     if(glyph->foreground == COLOR_FOREGROUND && glyph->background == COLOR_BACKGROUND){
+          // no need to create a new color pair for the default
+     }else{
+          TRACE_SCOPE("color pair");
+
+          // does the new glyph match an existing definition?
+          int32_t matched_pair = -1;
+          for(int32_t i = 0; i < color_defs->count; ++i){
+               if(glyph->foreground == color_defs->pairs[i].foreground &&
+                  glyph->background == color_defs->pairs[i].background){
+                    matched_pair = i;
                     break;
-               case 1049:
-                    if(set){
-                         terminal_cursor_save(terminal);
-                    }else{
-                         terminal_cursor_load(terminal);
-                    }
-                    // fallthrough
-               case 47:
-               case 1047:
-                    // f this layout
-                    alt = terminal->mode & TERMINAL_MODE_ALTSCREEN;
-                    if(alt) terminal_clear_region(terminal, 0, 0, terminal->columns - 1, terminal->rows - 1);
-                    if(set ^ alt) terminal_swap_screen(terminal);
-                    if(*arg != 1049) break;
-                    // fallthrough
-               case 1048:
-                    if(set){
-                         terminal_cursor_save(terminal);
-                    }else{
-                         terminal_cursor_load(terminal);
+               }
+          }
+
+          // if so use that color pair
+          if(matched_pair >= 0){
+               wattron(view->window, COLOR_PAIR(matched_pair));
+          }else{
+               // increment the color pair we are going to define, but make sure it wraps around to 0 at the max
+               view->color_pair++;
+               view->color_pair %= COLOR_PAIRS;
+               if(view->color_pair == 0) view->color_pair++; // when we wrap around, start at 1, because curses doesn't like 0 index color pairs
+
+               // create the pair definition
+               init_pair(view->color_pair, glyph->foreground, glyph->background);
+
+               // set our internal definition
+               color_defs->pairs[view->color_pair].foreground = glyph->foreground;
+               color_defs->pairs[view->color_pair].background = glyph->background;
+
+               // override the count if we haven't wrapped around
+               int32_t new_count = view->color_pair;
+               if(new_count > color_defs->count) color_defs->count = new_count;
+
+               wattron(view->window, COLOR_PAIR(view->color_pair));
+          }
+     }
+
+     view->last_color_foreground = glyph->foreground;
+     view->last_color_background = glyph->background;
+}
+
+// draws the run of glyphs that share colors, handing curses wide characters so it has no utf8 to decode
+void view_flush_run(View_t* view, int row, int column)
+{
+     if(view->run_length == 0) return;
+
+     mvwaddnwstr(view->window, row + 1, column + 1, view->run, view->run_length);
+     view->run_length = 0;
+}
+
+bool view_resize(View_t* view, int rows, int columns)
+{
+     if(view->rows == rows && view->columns == columns) return true;
+
+     for(int r = 0; r < view->rows; ++r) free(view->lines[r]);
+     free(view->lines);
+     free(view->dirty);
+     free(view->copied);
+     free(view->blinks);
+
+     view->rows = rows;
+     view->columns = columns;
+     view->lines = calloc(rows, sizeof(*view->lines));
+     view->dirty = calloc(rows, sizeof(*view->dirty));
+     view->copied = calloc(rows, sizeof(*view->copied));
+     view->blinks = calloc(rows, sizeof(*view->blinks));
+     if(!view->lines || !view->dirty || !view->copied || !view->blinks) return false;
+
+     for(int r = 0; r < rows; ++r){
+          view->lines[r] = calloc(columns, sizeof(*view->lines[r]));
+          if(!view->lines[r]) return false;
+     }
+     return true;
+}
+
+// cluster runes from the terminal's table are copied along with the rows that use them, so drawing never looks at it
+Rune_t view_copy_cluster(View_t* view, Clusters_t* clusters, Rune_t rune)
+{
+     if(view->cluster_count == view->cluster_capacity){
+          uint32_t capacity = view->cluster_capacity ? view->cluster_capacity * 2 : 64;
+          Cluster_t* grown = realloc(view->clusters, capacity * sizeof(*grown));
+          if(!grown) return ' ';
+          view->clusters = grown;
+          view->cluster_capacity = capacity;
+     }
+
+     Cluster_t* copy = view->clusters + view->cluster_count;
+     copy->count = cluster_runes(clusters, rune, copy->runes);
+     return RUNE_CLUSTER_BIT | view->cluster_count++;
+}
+
+// the same goes for the uris of links, which are freed once the terminal no longer uses them
+uint16_t view_copy_link(View_t* view, Hyperlinks_t* hyperlinks, uint16_t id)
+{
+     if(id > hyperlinks->count || !hyperlinks->links[id - 1].uri || view->link_count >= HYPERLINK_MAX) return 0;
+
+     if(view->link_count == view->link_capacity){
+          uint32_t capacity = view->link_capacity ? view->link_capacity * 2 : 16;
+          uint32_t* grown = realloc(view->links, capacity * sizeof(*grown));
+          if(!grown) return 0;
+          view->links = grown;
+          view->link_capacity = capacity;
+     }
+
+     const char* uri = hyperlinks->links[id - 1].uri;
+     uint32_t offset = view->link_uris.length;
+     if(!arena_append(&view->link_uris, uri, strlen(uri) + 1)) return 0;
+     view->links[view->link_count] = offset;
+     return ++view->link_count;
+}
+
+// points a row's clusters and links at copies of them, true when it has any
+bool view_copy_references(View_t* view, Terminal_t* terminal, Glyph_t* line, int length)
+{
+     bool copied = false;
+     uint16_t link = 0;
+     uint16_t link_copy = 0;
+
+     for(int c = 0; c < length; ++c){
+          if(line[c].rune & RUNE_CLUSTER_BIT){
+               line[c].rune = view_copy_cluster(view, &terminal->clusters, line[c].rune);
+               copied = true;
+          }
+
+          // a link usually covers a run of cells, which share a copy
+          if(line[c].link){
+               if(line[c].link != link){
+                    link = line[c].link;
+                    link_copy = view_copy_link(view, &terminal->hyperlinks, link);
+               }
+               line[c].link = link_copy;
+               copied = true;
+          }
+     }
+
+     return copied;
+}
+
+// while the search prompt has a match, the rows show the history around it with the match in the middle of the
+// viewport, and the screen below the newest line once the match is that recent
+void view_snapshot_history(View_t* view, Terminal_t* terminal)
+{
+     History_t* history = &terminal->history;
+     int64_t top = view->search_match - view->viewport_y - view->viewport_rows / 2;
+     if(top > history->end) top = history->end;
+     if(top < history->start) top = history->start;
+
+     for(int r = 0; r < view->rows; ++r){
+          Glyph_t* line = view->lines[r];
+          Glyph_t* glyphs;
+          int length;
+          Glyph_t blank = {' ', 0, 0, COLOR_FOREGROUND, COLOR_BACKGROUND};
+          if(top + r < history->end){
+               HistoryLine_t* history_line = history_get(history, top + r);
+               glyphs = history_line->glyphs;
+               length = history_line->length;
+          }else{
+               int y = top + r - history->end;
+               glyphs = terminal->lines[y];
+               length = terminal->fills[y].from;
+               blank = terminal->fills[y].blank;
+          }
+
+          if(length > view->columns) length = view->columns;
+          memcpy(line, glyphs, length * sizeof(*line));
+          for(int c = length; c < view->columns; ++c) line[c] = blank;
+          view->copied[r] = view_copy_references(view, terminal, line, length);
+          view->dirty[r] = true;
+          view->blinks[r] = (BlinkSpan_t){view->columns, -1};
+     }
+}
+
+// copies what changed since the last frame out from under the parser, which is the only time the renderer holds the lock
+int view_snapshot(View_t* view, Terminal_t* terminal)
+{
+     TRACE_SCOPE("damage scan");
+     int dirty_rows = 0;
+
+     pthread_mutex_lock(&terminal->lock);
+
+     // a scroll says how the rows drawn last frame moved, which means nothing to a view of another size
+     bool resized = view->rows != terminal->rows || view->columns != terminal->columns;
+     if(!view_resize(view, terminal->rows, terminal->columns)){
+          pthread_mutex_unlock(&terminal->lock);
+          return 0;
+     }
+
+     // coming back from the history, every row of the screen is copied again
+     bool scrolled_back = view->searching && view->search_match >= 0;
+     bool returned = view->scrolled_back && !scrolled_back;
+     view->generation = terminal_changes(terminal, (resized || returned) ? 0 : view->generation, view->dirty,
+                                         &view->scroll);
+     view->scrolled_back = scrolled_back;
+     if(view->scrolled_back) view->scroll.count = 0;
+     if(view->scroll.count){
+          rows_rotate(view->lines, view->scroll.top, view->scroll.bottom, view->scroll.count);
+          flags_rotate(view->copied, view->scroll.top, view->scroll.bottom, view->scroll.count);
+     }
+
+     // the copied clusters and links start over every frame, so rows that refer to them are copied again even when
+     // they did not change: a scroll, a pan or a blink flip may draw them without their being dirty
+     view->cluster_count = 0;
+     view->link_count = 0;
+     arena_reset(&view->link_uris);
+
+     if(view->scrolled_back){
+          view_snapshot_history(view, terminal);
+          dirty_rows = terminal->rows;
+     }else{
+          for(int r = 0; r < terminal->rows; ++r){
+               if(!view->dirty[r] && !view->copied[r]) continue;
+
+               // filled cells are copied from the fill, the terminal's row stays as it is
+               Glyph_t* line = view->lines[r];
+               RowFill_t* fill = terminal->fills + r;
+               memcpy(line, terminal->lines[r], fill->from * sizeof(*line));
+               for(int c = fill->from; c < terminal->columns; ++c) line[c] = fill->blank;
+
+               view->copied[r] = view_copy_references(view, terminal, line, fill->from);
+               dirty_rows += view->dirty[r];
+          }
+
+          // spans change with their rows or move along with them, but there are few enough to copy them all
+          memcpy(view->blinks, terminal->blinks, terminal->rows * sizeof(*view->blinks));
+     }
+
+     view->blink_rows = 0;
+     for(int r = 0; r < terminal->rows; ++r) view->blink_rows += view->blinks[r].from <= view->blinks[r].to;
+
+     if(terminal->palette_dirty){
+          terminal->palette_dirty = false;
+          memcpy(view->palette, terminal->palette, sizeof(view->palette));
+          view->palette_dirty = true;
+     }
+
+     if(terminal->title_dirty){
+          terminal->title_dirty = false;
+          memcpy(view->title, terminal->title, sizeof(view->title));
+          view->title_dirty = true;
+     }
+
+     // the arenas trade places rather than copying the selection under the lock
+     if(terminal->clipboard_ready){
+          Arena_t clipboard = view->clipboard;
+          view->clipboard = terminal->clipboard;
+          terminal->clipboard = clipboard;
+          arena_reset(&terminal->clipboard);
+          terminal->clipboard_ready = false;
+          view->clipboard_ready = true;
+     }
+
+     view->cursor_x = terminal->cursor.x;
+     view->cursor_y = terminal->cursor.y;
+
+     pthread_mutex_unlock(&terminal->lock);
+     return dirty_rows;
+}
+
+// runs the prompt's search over the history with the terminal locked. a new pattern starts over from the newest line,
+// asking again goes on to older ones
+void view_search(View_t* view, Terminal_t* terminal, KeyInput_t* keys, bool edited)
+{
+     view->searching = keys->searching;
+     if(!keys->searching){
+          view->search_match = -1;
+          view->search_status[0] = 0;
+          return;
+     }
+
+     History_t* history = &terminal->history;
+     char text[VIEW_STATUS_SIZE] = "";
+     int64_t lines_up = 0;
+     bool found = false;
+
+     pthread_mutex_lock(&terminal->lock);
+     if(edited) view->search_match = -1;
+     int64_t from = (view->search_match < 0) ? history->end - 1 : view->search_match - 1;
+     int64_t match;
+     if(keys->search_length && history_search(history, keys->search, false, from, true, &match)){
+          view->search_match = match;
+          found = true;
+     }
+     if(view->search_match >= 0){
+          HistoryLine_t* line = history_get(history, view->search_match);
+          if(line) history_line_text(history, line, text, sizeof(text));
+          lines_up = history->end - view->search_match;
+     }
+     pthread_mutex_unlock(&terminal->lock);
+
+     char* status = view->search_status;
+     int length = snprintf(status, VIEW_STATUS_SIZE, " search: %s ", keys->search);
+     if(!keys->search_length || length >= VIEW_STATUS_SIZE) return;
+     if(view->search_match < 0){
+          snprintf(status + length, VIEW_STATUS_SIZE - length, "| no match ");
+     }else{
+          snprintf(status + length, VIEW_STATUS_SIZE - length, "| %s%" PRId64 " lines up: %s ",
+                   found ? "" : "no older match, ", lines_up, text);
+     }
+}
+
+// pans by the keys taken since the last frame, a pan by hand stops following the cursor until asked to again
+void view_apply_keys(View_t* view, Terminal_t* terminal, KeyInput_t* keys)
+{
+     int32_t* actions = keys->actions;
+     if(actions[KEY_ACTION_SEARCH] || actions[KEY_ACTION_SEARCH_EDIT]){
+          view_search(view, terminal, keys, actions[KEY_ACTION_SEARCH_EDIT] != 0);
+     }
+
+     view->viewport_y += actions[KEY_ACTION_PAN_DOWN] - actions[KEY_ACTION_PAN_UP];
+     view->viewport_x += (actions[KEY_ACTION_PAN_RIGHT] - actions[KEY_ACTION_PAN_LEFT]) * VIEW_PAN_COLUMNS;
+     if(actions[KEY_ACTION_PAN_DOWN] || actions[KEY_ACTION_PAN_UP] || actions[KEY_ACTION_PAN_RIGHT] ||
+        actions[KEY_ACTION_PAN_LEFT]){
+          view->follow = false;
+     }
+     if(actions[KEY_ACTION_FOLLOW]) view->follow = true;
+     memset(keys->actions, 0, sizeof(keys->actions));
+}
+
+// fits the viewport to the window and the cursor after a snapshot. when it moved every row in it is drawn again,
+// otherwise the window scrolls the part of a scroll inside it and the rows that came in from outside are drawn
+void view_viewport(View_t* view)
+{
+     int window_rows;
+     int window_columns;
+     getmaxyx(view->window, window_rows, window_columns);
+
+     int32_t rows = (window_rows - 2 < view->rows) ? window_rows - 2 : view->rows;
+     int32_t columns = (window_columns - 2 < view->columns) ? window_columns - 2 : view->columns;
+     int32_t x = view->viewport_x;
+     int32_t y = view->viewport_y;
+
+     if(view->follow){
+          if(view->cursor_x < x) x = view->cursor_x;
+          if(view->cursor_x >= x + columns) x = view->cursor_x - columns + 1;
+          if(view->cursor_y < y) y = view->cursor_y;
+          if(view->cursor_y >= y + rows) y = view->cursor_y - rows + 1;
+     }
+     CLAMP(x, 0, view->columns - columns);
+     CLAMP(y, 0, view->rows - rows);
+
+     bool moved = x != view->drawn_x || y != view->drawn_y || rows != view->viewport_rows ||
+                  columns != view->viewport_columns;
+     view->viewport_x = view->drawn_x = x;
+     view->viewport_y = view->drawn_y = y;
+     view->viewport_rows = rows;
+     view->viewport_columns = columns;
+
+     if(moved){
+          for(int r = 0; r < view->rows; ++r) view->dirty[r] = true;
+     }
+
+     Scroll_t* scroll = &view->viewport_scroll;
+     *scroll = view->scroll;
+     scroll->top = ((scroll->top > y) ? scroll->top : y) - y;
+     scroll->bottom = ((scroll->bottom < y + rows - 1) ? scroll->bottom : y + rows - 1) - y;
+     if(!scroll->count || moved){
+          scroll->count = 0;
+          return;
+     }
+
+     int first = scroll->top;
+     int last = scroll->bottom;
+     if(abs(scroll->count) <= scroll->bottom - scroll->top){
+          first = (scroll->count > 0) ? scroll->bottom - scroll->count + 1 : scroll->top;
+          last = (scroll->count > 0) ? scroll->bottom : scroll->top - scroll->count - 1;
+     }else{
+          scroll->count = 0;
+     }
+     for(int r = first; r <= last; ++r) view->dirty[y + r] = true;
+}
+
+// the cursor's position in the window, held to its edge while the viewport is panned away from it
+void view_cursor(View_t* view, int* row, int* column)
+{
+     *row = view->cursor_y - view->viewport_y;
+     *column = view->cursor_x - view->viewport_x;
+     CLAMP(*row, 0, view->viewport_rows - 1);
+     CLAMP(*column, 0, view->viewport_columns - 1);
+     (*row)++;
+     (*column)++;
+}
+
+// flips blinking glyphs every BLINK_PERIOD_NS while any are on the screen, and stops when none are
+void view_blink(View_t* view)
+{
+     view->blink_flip = false;
+     if(!view->blink_rows){
+          view->blink_off = false;
+          view->blink_deadline = 0;
+          return;
+     }
+
+     uint64_t now = time_nanoseconds();
+     if(!view->blink_deadline) view->blink_deadline = now + BLINK_PERIOD_NS;
+     if(now < view->blink_deadline) return;
+
+     view->blink_off = !view->blink_off;
+     view->blink_flip = true;
+     view->blink_deadline = now + BLINK_PERIOD_NS;
+}
+
+// the columns of row r to draw, all of the viewport's when the row changed, otherwise those a blink flip changed.
+// false when there are none
+bool view_draw_columns(View_t* view, int r, int* from, int* to)
+{
+     *from = view->viewport_x;
+     *to = view->viewport_x + view->viewport_columns - 1;
+     if(view->dirty[r]) return true;
+
+     BlinkSpan_t* span = view->blinks + r;
+     if(!view->blink_flip || span->from > *to || span->to < *from) return false;
+     if(span->from > *from) *from = span->from;
+     if(span->to < *to) *to = span->to;
+     return true;
+}
+
+// a glyph as the window shows it, drawn blank when it is half a wide character cut off by either edge of the
+// viewport, or blinks while blinking glyphs are off
+Glyph_t* view_glyph(View_t* view, Glyph_t* line, int column, Glyph_t* blank)
+{
+     Glyph_t* glyph = line + column;
+     bool cut = (column == view->viewport_x && glyph->attributes & GLYPH_ATTRIBUTE_WDUMMY) ||
+                (column == view->viewport_x + view->viewport_columns - 1 && glyph->attributes & GLYPH_ATTRIBUTE_WIDE) ||
+                (view->blink_off && glyph->attributes & GLYPH_ATTRIBUTE_BLINK);
+     if(!cut) return glyph;
+
+     *blank = *glyph;
+     blank->rune = ' ';
+     blank->attributes &= ~(GLYPH_ATTRIBUTE_WIDE | GLYPH_ATTRIBUTE_WDUMMY);
+     return blank;
+}
+
+// the child's title goes over the top border, as much of it as fits. curses has no way to draw the child's links, so
+// they are only shown by the vt backend
+void view_draw_title(View_t* view)
+{
+     wchar_t title[TITLE_SIZE];
+     int count = 0;
+     int width = 0;
+     int room = getmaxx(view->window) - 6;
+     size_t length = strlen(view->title);
+
+     for(size_t i = 0; i < length && count < TITLE_SIZE - 1;){
+          Rune_t rune;
+          size_t rune_length;
+          if(!utf8_decode(view->title + i, length - i, &rune_length, &rune)){
+               rune = '?';
+               rune_length = 1;
+          }
+          i += rune_length;
+
+          int rune_columns = rune_width(rune);
+          if(rune_columns < 1) continue;
+          if(width + rune_columns > room) break;
+          title[count++] = rune;
+          width += rune_columns;
+     }
+
+     if(!count) return;
+     mvwaddnstr(view->window, 0, 2, " ", 1);
+     waddnwstr(view->window, title, count);
+     waddnstr(view->window, " ", 1);
+}
+
+void view_draw(View_t* view, Terminal_t* terminal)
+{
+     WINDOW* window = view->window;
+     int dirty_rows = view_snapshot(view, terminal);
+     view_viewport(view);
+     view_blink(view);
+
+     TRACE_SCOPE("curses calls");
+
+     if(view->palette_dirty){
+          view->palette_dirty = false;
+          view_apply_palette(view);
+     }
+
+     // move the rows that scrolled in the window as well, only those scrolled in are dirty. box() puts back the
+     // borders this moved
+     Scroll_t* scroll = &view->viewport_scroll;
+     if(scroll->count){
+          wsetscrreg(window, scroll->top + 1, scroll->bottom + 1);
+          scrollok(window, TRUE);
+          wscrl(window, scroll->count);
+          scrollok(window, FALSE);
+     }
+
+     wstandend(window);
+     box(window, 0, 0);
+     view_draw_title(view);
+
+     // box() changes the attributes, so the next glyph has to set its colors again
+     view->last_color_foreground = -1;
+     view->last_color_background = -1;
+
+     // only the rows and columns in the viewport are drawn, curses would only clip the rest
+     for(int r = view->viewport_y; r < view->viewport_y + view->viewport_rows; ++r){
+          int from;
+          int to;
+          if(!view_draw_columns(view, r, &from, &to)) continue;
+
+          int row = r - view->viewport_y;
+          int run_column = 0;
+          view->run_length = 0;
+
+          for(int c = from; c <= to; ++c){
+               Glyph_t blank;
+               Glyph_t* glyph = view_glyph(view, view->lines[r], c, &blank);
+
+               // the right half of a wide character is drawn along with the left
+               if(glyph->attributes & GLYPH_ATTRIBUTE_WDUMMY) continue;
+
+               if(view->last_color_foreground != glyph->foreground || view->last_color_background != glyph->background){
+                    view_flush_run(view, row, run_column);
+                    view_set_color(view, glyph);
+               }
+
+               if(view->run_length + CLUSTER_MAX_RUNES > VIEW_RUN_SIZE) view_flush_run(view, row, run_column);
+               if(view->run_length == 0) run_column = c - view->viewport_x;
+
+               if(glyph->rune & RUNE_CLUSTER_BIT){
+                    Cluster_t* cluster = view->clusters + (glyph->rune & ~RUNE_CLUSTER_BIT);
+                    for(uint32_t i = 0; i < cluster->count; ++i) view->run[view->run_length++] = cluster->runes[i];
+               }else{
+                    view->run[view->run_length++] = (glyph->rune == 0) ? ' ' : glyph->rune;
+               }
+          }
+
+          view_flush_run(view, row, run_column);
+     }
+
+     STAT_ADD(STAT_FRAMES, 1);
+     STAT_ADD(STAT_DIRTY_ROWS, dirty_rows);
+     STAT_RECORD(HISTOGRAM_DIRTY_ROWS, dirty_rows);
+
+     int cursor_row;
+     int cursor_column;
+     view_cursor(view, &cursor_row, &cursor_column);
+     wmove(window, cursor_row, cursor_column);
+}
+
+// hands the selection the child set on to the host's clipboard with OSC 52, base64 encoded a chunk at a time
+void view_export_clipboard(View_t* view, int file_descriptor)
+{
+     static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+     const unsigned char* data = (const unsigned char*)view->clipboard.data;
+     size_t length = view->clipboard.length;
+     char chunk[BUFSIZ];
+     size_t used = snprintf(chunk, sizeof(chunk), "\033]52;c;");
+
+     for(size_t i = 0; i < length; i += 3){
+          size_t left = length - i;
+          uint32_t bits = (uint32_t)data[i] << 16;
+          if(left > 1) bits |= (uint32_t)data[i + 1] << 8;
+          if(left > 2) bits |= data[i + 2];
+
+          chunk[used++] = digits[(bits >> 18) & 0x3F];
+          chunk[used++] = digits[(bits >> 12) & 0x3F];
+          chunk[used++] = (left > 1) ? digits[(bits >> 6) & 0x3F] : '=';
+          chunk[used++] = (left > 2) ? digits[bits & 0x3F] : '=';
+
+          if(used + 4 > sizeof(chunk)){
+               if(!tty_write(file_descriptor, chunk, used)) return;
+               used = 0;
+          }
+     }
+
+     chunk[used++] = '\033';
+     chunk[used++] = '\\';
+     tty_write(file_descriptor, chunk, used);
+}
+
+bool vt_output_init(VTOutput_t* vt, int file_descriptor, int rows, int columns, int x, int y)
+{
+     memset(vt, 0, sizeof(*vt));
+     vt->file_descriptor = file_descriptor;
+     vt->frame.limit = VT_FRAME_LIMIT;
+     vt->rows = rows;
+     vt->columns = columns;
+     vt->x = x;
+     vt->y = y;
+     vt->cursor_x = -1;
+     vt->cursor_y = -1;
+     vt->foreground = VT_COLOR_UNKNOWN;
+     vt->background = VT_COLOR_UNKNOWN;
+
+     vt->screen = calloc(rows, sizeof(*vt->screen));
+     vt->shadow = calloc(rows, sizeof(*vt->shadow));
+     vt->dirty = calloc(rows, sizeof(*vt->dirty));
+     if(!vt->screen || !vt->shadow || !vt->dirty) return false;
+
+     Glyph_t blank = {' ', 0, 0, COLOR_FOREGROUND, COLOR_BACKGROUND};
+     Glyph_t unknown = {VT_RUNE_UNKNOWN, 0, 0, VT_COLOR_UNKNOWN, VT_COLOR_UNKNOWN};
+
+     for(int r = 0; r < rows; ++r){
+          vt->screen[r] = malloc(columns * sizeof(*vt->screen[r]));
+          vt->shadow[r] = malloc(columns * sizeof(*vt->shadow[r]));
+          if(!vt->screen[r] || !vt->shadow[r]) return false;
+
+          for(int c = 0; c < columns; ++c){
+               vt->screen[r][c] = blank;
+               vt->shadow[r][c] = unknown;
+          }
+
+          // the box curses draws around the view
+          Rune_t left = (r == 0) ? 0x250C : (r == rows - 1) ? 0x2514 : 0x2502;
+          Rune_t right = (r == 0) ? 0x2510 : (r == rows - 1) ? 0x2518 : 0x2502;
+          vt->screen[r][0].rune = left;
+          vt->screen[r][columns - 1].rune = right;
+          if(r == 0 || r == rows - 1){
+               for(int c = 1; c < columns - 1; ++c) vt->screen[r][c].rune = 0x2500;
+          }
+          vt->dirty[r] = true;
+     }
+
+     return true;
+}
+
+void vt_output_printf(VTOutput_t* vt, const char* format, ...)
+{
+     char buffer[64];
+     va_list args;
+     va_start(args, format);
+     int length = vsnprintf(buffer, sizeof(buffer), format, args);
+     va_end(args);
+     if(length > 0) arena_append(&vt->frame, buffer, (length < (int)(sizeof(buffer))) ? length : (int)(sizeof(buffer)) - 1);
+}
+
+// the sgr parameters selecting a color, base is 30 for the foreground and 40 for the background
+int vt_color_parameters(char* buffer, int32_t color, int base)
+{
+     if(color < 0) return sprintf(buffer, "%d", base + 9);
+     if(color < 8) return sprintf(buffer, "%d", base + color);
+     if(color < 16) return sprintf(buffer, "%d", base + 60 + color - 8);
+     return sprintf(buffer, "%d;5;%d", base + 8, color);
+}
+
+void vt_output_colors(VTOutput_t* vt, Glyph_t* glyph)
+{
+     if(glyph->foreground == vt->foreground && glyph->background == vt->background) return;
+
+     char sgr[32] = "\033[";
+     int length = 2;
+     if(glyph->foreground != vt->foreground) length += vt_color_parameters(sgr + length, glyph->foreground, 30);
+     if(glyph->background != vt->background){
+          if(length > 2) sgr[length++] = ';';
+          length += vt_color_parameters(sgr + length, glyph->background, 40);
+     }
+     sgr[length++] = 'm';
+     arena_append(&vt->frame, sgr, length);
+
+     vt->foreground = glyph->foreground;
+     vt->background = glyph->background;
+}
+
+// moves the host cursor with whichever sequence is shortest, or by writing out the cells in between again when
+// that is shorter still
+void vt_output_move(VTOutput_t* vt, int row, int column)
+{
+     if(vt->cursor_y == row && vt->cursor_x == column) return;
+
+     int host_row = vt->y + row + 1;
+     int host_column = vt->x + column + 1;
+
+     if(vt->cursor_y == row && vt->cursor_x >= 0){
+          int gap = column - vt->cursor_x;
+          if(gap > 0 && gap <= 3){
+               Glyph_t* cells = vt->shadow[row] + vt->cursor_x;
+               bool plain = true;
+               for(int i = 0; i < gap && plain; ++i){
+                    plain = cells[i].rune >= ' ' && cells[i].rune < 0x7F && !cells[i].attributes &&
+                            cells[i].foreground == vt->foreground && cells[i].background == vt->background &&
+                            cells[i].link == vt->link;
+               }
+               if(plain){
+                    for(int i = 0; i < gap; ++i){
+                         char character = cells[i].rune;
+                         arena_append(&vt->frame, &character, 1);
                     }
-                    break;
-               case 2004:
-                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_BRCKTPASTE);
-                    break;
-               case 1001:
-               case 1005:
-               case 1015:
-                    // ignored
-                    break;
+               }else{
+                    vt_output_printf(vt, gap == 1 ? "\033[C" : "\033[%dC", gap);
+               }
+          }else if(gap > 0){
+               vt_output_printf(vt, "\033[%dC", gap);
+          }else if(host_column == 1){
+               arena_append(&vt->frame, "\r", 1);
+          }else{
+               vt_output_printf(vt, -gap == 1 ? "\033[D" : "\033[%dD", -gap);
+          }
+     }else if(vt->cursor_x == column && vt->cursor_y >= 0){
+          int gap = row - vt->cursor_y;
+          vt_output_printf(vt, "\033[%d%c", abs(gap), (gap > 0) ? 'B' : 'A');
+     }else{
+          vt_output_printf(vt, "\033[%d;%dH", host_row, host_column);
+     }
+
+     vt->cursor_x = column;
+     vt->cursor_y = row;
+}
+
+bool vt_glyph_same(Glyph_t* a, Glyph_t* b)
+{
+     uint16_t width_attributes = GLYPH_ATTRIBUTE_WIDE | GLYPH_ATTRIBUTE_WDUMMY;
+     return a->rune == b->rune && a->foreground == b->foreground && a->background == b->background &&
+            a->link == b->link && (a->attributes & width_attributes) == (b->attributes & width_attributes);
+}
+
+// erasing leaves no link behind, so a blank with one has to be written
+bool vt_glyph_blank(Glyph_t* glyph)
+{
+     return (glyph->rune == ' ' || glyph->rune == 0) && !glyph->link &&
+            !(glyph->attributes & (GLYPH_ATTRIBUTE_WIDE | GLYPH_ATTRIBUTE_WDUMMY));
+}
+
+// opens the glyph's link on the host with OSC 8, or closes the one that is open
+void vt_output_link(VTOutput_t* vt, uint16_t link)
+{
+     if(link == vt->link) return;
+
+     arena_append(&vt->frame, "\033]8;;", 5);
+     if(link){
+          const char* uri = vt->link_uris->data + vt->links[link - 1];
+          arena_append(&vt->frame, uri, strlen(uri));
+     }
+     arena_append(&vt->frame, "\033\\", 2);
+     vt->link = link;
+}
+
+void vt_glyph_forget(Glyph_t* glyph)
+{
+     glyph->rune = VT_RUNE_UNKNOWN;
+     glyph->attributes = 0;
+}
+
+// writes out what differs between a row of the screen and the shadow, and updates the shadow to match
+void vt_output_row(VTOutput_t* vt, int row)
+{
+     Glyph_t* want = vt->screen[row];
+     Glyph_t* have = vt->shadow[row];
+
+     // writing over either half of a wide character on the host erases the other half
+     for(int c = 0; c < vt->columns; ++c){
+          if(vt_glyph_same(want + c, have + c)) continue;
+          if(c > 0 && ((have[c].attributes | want[c].attributes) & GLYPH_ATTRIBUTE_WDUMMY)) vt_glyph_forget(have + c - 1);
+          if(c + 1 < vt->columns && (have[c].attributes & GLYPH_ATTRIBUTE_WIDE)) vt_glyph_forget(have + c + 1);
+     }
+
+     for(int c = 0; c < vt->columns;){
+          Glyph_t* glyph = want + c;
+          if(vt_glyph_same(glyph, have + c)){
+               c++;
+               continue;
+          }
+
+          // a long enough run of blanks is cheaper to erase than to write, and erasing leaves the cursor alone
+          if(vt_glyph_blank(glyph)){
+               int end = c + 1;
+               while(end < vt->columns && vt_glyph_blank(want + end) && want[end].foreground == glyph->foreground &&
+                     want[end].background == glyph->background){
+                    end++;
+               }
+
+               if(end - c >= VT_ERASE_MIN){
+                    vt_output_move(vt, row, c);
+                    vt_output_colors(vt, glyph);
+                    vt_output_printf(vt, "\033[%dX", end - c);
+                    for(; c < end; ++c) have[c] = want[c];
+                    continue;
+               }
+          }
+
+          vt_output_move(vt, row, c);
+          vt_output_colors(vt, glyph);
+          vt_output_link(vt, glyph->link);
+
+          char utf8[UTF8_SIZE * CLUSTER_MAX_RUNES];
+          int length = 0;
+          if(glyph->rune & RUNE_CLUSTER_BIT){
+               Cluster_t* cluster = vt->clusters + (glyph->rune & ~RUNE_CLUSTER_BIT);
+               for(uint32_t i = 0; i < cluster->count; ++i){
+                    int rune_length = 0;
+                    utf8_encode(cluster->runes[i], utf8 + length, UTF8_SIZE, &rune_length);
+                    length += rune_length;
+               }
+          }else{
+               utf8_encode(glyph->rune ? glyph->rune : ' ', utf8, UTF8_SIZE, &length);
+          }
+          arena_append(&vt->frame, utf8, length);
+
+          int width = (glyph->attributes & GLYPH_ATTRIBUTE_WIDE && c + 1 < vt->columns) ? 2 : 1;
+          for(int i = 0; i < width; ++i) have[c + i] = want[c + i];
+
+          // clusters and links are numbered anew every frame, so one is never known to be on the host already
+          if(glyph->rune & RUNE_CLUSTER_BIT || glyph->link) vt_glyph_forget(have + c);
+
+          c += width;
+
+          // the same character over and over, like a bar or a rule, is cheaper to repeat than to write out. only
+          // ascii, since some hosts repeat nothing else
+          if(glyph->rune < 0x80 && !glyph->link){
+               int end = c;
+               while(end < vt->columns && vt_glyph_same(want + end, glyph)) end++;
+               while(end > c && vt_glyph_same(want + end - 1, have + end - 1)) end--;
+
+               int repeats = end - c;
+               if(repeats * length > 4 + (repeats >= 10) + (repeats >= 100)){
+                    vt_output_printf(vt, "\033[%db", repeats);
+                    for(; c < end; ++c) have[c] = want[c];
                }
-          }else{
-               switch(*arg){
-               default:
-                    break;
-               case 2:
-                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_KBDLOCK);
-                    break;
-               case 4:
-                    CHANGE_BIT(terminal->mode, set, TERMINAL_MODE_INSERT);
-                    break;
-               case 12:
-                    CHANGE_BIT(terminal->mode, !set, TERMINAL_MODE_ECHO);
-                    break;
-               case 20:
-                    CHANGE_BIT(terminal->mode, !set, TERMINAL_MODE_CRLF);
-                    break;
+          }
+          vt->cursor_x = c;
+
+          // at the right edge the host may be waiting to wrap, so its cursor is not where it looks
+          if(c >= vt->columns) vt->cursor_x = -1;
+     }
+
+     // a link left open would take in whatever the host writes next
+     vt_output_link(vt, 0);
+     vt->dirty[row] = false;
+}
+
+// copies the rows that changed since the last frame into the window, inside the border, once rows that scrolled
+// have been moved along in both the screen and the shadow
+void vt_output_view(VTOutput_t* vt, View_t* view)
+{
+     vt->clusters = view->clusters;
+     vt->link_uris = &view->link_uris;
+     vt->links = view->links;
+
+     Scroll_t* scroll = &view->viewport_scroll;
+     if(scroll->count){
+          int top = scroll->top + 1;
+          int bottom = scroll->bottom + 1;
+          rows_rotate(vt->screen, top, bottom, scroll->count);
+          rows_rotate(vt->shadow, top, bottom, scroll->count);
+
+          // the host scrolls whole lines, so the rows scrolled in come up blank, border and all
+          int first = (scroll->count > 0) ? bottom - scroll->count + 1 : top;
+          int last = (scroll->count > 0) ? bottom : top - scroll->count - 1;
+          Glyph_t blank = {' ', 0, 0, COLOR_FOREGROUND, COLOR_BACKGROUND};
+          for(int r = first; r <= last; ++r){
+               for(int c = 0; c < vt->columns; ++c) vt->shadow[r][c] = blank;
+               vt->dirty[r] = true;
+          }
+
+          vt->scroll = *scroll;
+     }
+
+     for(int r = view->viewport_y; r < view->viewport_y + view->viewport_rows; ++r){
+          int from;
+          int to;
+          int row = r - view->viewport_y + 1;
+          if(!view_draw_columns(view, r, &from, &to) && !vt->dirty[row]) continue;
+
+          // the rest of the row as the screen kept it may refer to clusters and links of an earlier frame, so a row
+          // with any, or one the host is sent whole again, is copied whole rather than only where a blink flipped
+          if(view->copied[r] || vt->dirty[row]){
+               from = view->viewport_x;
+               to = view->viewport_x + view->viewport_columns - 1;
+          }
+
+          Glyph_t* cells = vt->screen[row] + 1 - view->viewport_x;
+          for(int c = from; c <= to; ++c) cells[c] = *view_glyph(view, view->lines[r], c, cells + c);
+          vt->dirty[row] = true;
+     }
+}
+
+// puts utf8 text over a border row from column on, and the border back where the text does not reach
+void vt_output_border(VTOutput_t* vt, int r, int column, const char* text)
+{
+     Glyph_t* row = vt->screen[r];
+     size_t length = strlen(text);
+     size_t i = 0;
+
+     for(int c = 1; c < vt->columns - 1; ++c){
+          Rune_t rune = 0x2500;
+          size_t rune_length = 0;
+          if(c >= column && i < length){
+               if(!utf8_decode(text + i, length - i, &rune_length, &rune)){
+                    rune = '?';
+                    rune_length = 1;
                }
+               i += rune_length;
+          }
+
+          int width = rune_width(rune);
+          row[c].foreground = COLOR_FOREGROUND;
+          row[c].background = COLOR_BACKGROUND;
+          row[c].attributes = 0;
+          row[c].rune = (width == 1 || (width == 2 && c + 1 < vt->columns - 1)) ? rune : '?';
+          if(row[c].rune == rune && width == 2){
+               row[c].attributes = GLYPH_ATTRIBUTE_WIDE;
+               c++;
+               row[c] = row[c - 1];
+               row[c].rune = 0;
+               row[c].attributes = GLYPH_ATTRIBUTE_WDUMMY;
           }
      }
+     vt->dirty[r] = true;
 }
 
-void terminal_set_attributes(Terminal_t* terminal)
+// puts text over the bottom border, the way the stats overlay is drawn with curses
+void vt_output_status(VTOutput_t* vt, const char* text)
 {
-     CSIEscape_t* csi = &terminal->csi_escape;
+     vt_output_border(vt, vt->rows - 1, 1, text);
+}
 
-     for(int i = 0; i < csi->argument_count; ++i){
-          switch(csi->arguments[i]){
-          default:
-               break;
-          case 0:
-               terminal->cursor.attributes.attributes &= ~(GLYPH_ATTRIBUTE_BOLD | GLYPH_ATTRIBUTE_FAINT |
-                                                           GLYPH_ATTRIBUTE_ITALIC | GLYPH_ATTRIBUTE_UNDERLINE |
-                                                           GLYPH_ATTRIBUTE_BLINK | GLYPH_ATTRIBUTE_REVERSE |
-                                                           GLYPH_ATTRIBUTE_INVISIBLE | GLYPH_ATTRIBUTE_STRUCK);
-               terminal->cursor.attributes.foreground = COLOR_FOREGROUND;
-               terminal->cursor.attributes.background = COLOR_BACKGROUND;
-               break;
-          case 1:
-               terminal->cursor.attributes.attributes |= GLYPH_ATTRIBUTE_BOLD;
-               break;
-          case 2:
-               terminal->cursor.attributes.attributes |= GLYPH_ATTRIBUTE_FAINT;
-               break;
-          case 3:
-               terminal->cursor.attributes.attributes |= GLYPH_ATTRIBUTE_ITALIC;
-               break;
-          case 4:
-               terminal->cursor.attributes.attributes |= GLYPH_ATTRIBUTE_UNDERLINE;
-               break;
-          case 5: // fallthrough
-          case 6:
-               terminal->cursor.attributes.attributes |= GLYPH_ATTRIBUTE_BLINK;
-               break;
-          case 7:
-               terminal->cursor.attributes.attributes |= GLYPH_ATTRIBUTE_REVERSE;
-               break;
-          case 8:
-               terminal->cursor.attributes.attributes |= GLYPH_ATTRIBUTE_INVISIBLE;
-               break;
-          case 9:
-               terminal->cursor.attributes.attributes |= GLYPH_ATTRIBUTE_STRUCK;
-               break;
-          case 21:
-               terminal->cursor.attributes.attributes &= ~GLYPH_ATTRIBUTE_BOLD;
-               break;
-          case 22:
-               terminal->cursor.attributes.attributes &= ~(GLYPH_ATTRIBUTE_BOLD | GLYPH_ATTRIBUTE_FAINT);
-               break;
-          case 23:
-               terminal->cursor.attributes.attributes &= ~GLYPH_ATTRIBUTE_ITALIC;
-               break;
-          case 24:
-               terminal->cursor.attributes.attributes &= ~GLYPH_ATTRIBUTE_UNDERLINE;
-               break;
-          case 25:
-               terminal->cursor.attributes.attributes &= ~GLYPH_ATTRIBUTE_BLINK;
-               break;
-          case 27:
-               terminal->cursor.attributes.attributes &= ~GLYPH_ATTRIBUTE_REVERSE;
-               break;
-          case 28:
-               terminal->cursor.attributes.attributes &= ~GLYPH_ATTRIBUTE_INVISIBLE;
-               break;
-          case 29:
-               terminal->cursor.attributes.attributes &= ~GLYPH_ATTRIBUTE_STRUCK;
-               break;
-          case 30:
-               terminal->cursor.attributes.foreground = COLOR_BLACK;
-               break;
-          case 31:
-               terminal->cursor.attributes.foreground = COLOR_RED;
-               break;
-          case 32:
-               terminal->cursor.attributes.foreground = COLOR_GREEN;
-               break;
-          case 33:
-               terminal->cursor.attributes.foreground = COLOR_YELLOW;
-               break;
-          case 34:
-               terminal->cursor.attributes.foreground = COLOR_BLUE;
-               break;
-          case 35:
-               terminal->cursor.attributes.foreground = COLOR_MAGENTA;
-               break;
-          case 36:
-               terminal->cursor.attributes.foreground = COLOR_CYAN;
-               break;
-          case 37:
-               terminal->cursor.attributes.foreground = COLOR_WHITE;
-               break;
-          case 38: // TODO: reserved fg color
-               break;
-          case 39:
-               terminal->cursor.attributes.foreground = COLOR_FOREGROUND;
-               break;
-          case 40:
-               terminal->cursor.attributes.background = COLOR_BLACK;
-               break;
-          case 41:
-               terminal->cursor.attributes.background = COLOR_RED;
-               break;
-          case 42:
-               terminal->cursor.attributes.background = COLOR_GREEN;
-               break;
-          case 43:
-               terminal->cursor.attributes.background = COLOR_YELLOW;
-               break;
-          case 44:
-               terminal->cursor.attributes.background = COLOR_BLUE;
-               break;
-          case 45:
-               terminal->cursor.attributes.background = COLOR_MAGENTA;
-               break;
-          case 46:
-               terminal->cursor.attributes.background = COLOR_CYAN;
-               break;
-          case 47:
-               terminal->cursor.attributes.background = COLOR_WHITE;
-               break;
-          case 48: // TODO: reserved bg color
-               break;
-          case 49:
-               terminal->cursor.attributes.background = COLOR_BACKGROUND;
-               break;
-          case 90:
-               terminal->cursor.attributes.foreground = COLOR_BRIGHT_BLACK;
-               break;
-          case 91:
-               terminal->cursor.attributes.foreground = COLOR_BRIGHT_RED;
-               break;
-          case 92:
-               terminal->cursor.attributes.foreground = COLOR_BRIGHT_GREEN;
-               break;
-          case 93:
-               terminal->cursor.attributes.foreground = COLOR_BRIGHT_YELLOW;
-               break;
-          case 94:
-               terminal->cursor.attributes.foreground = COLOR_BRIGHT_BLUE;
-               break;
-          case 95:
-               terminal->cursor.attributes.foreground = COLOR_BRIGHT_MAGENTA;
-               break;
-          case 96:
-               terminal->cursor.attributes.foreground = COLOR_BRIGHT_CYAN;
-               break;
-          case 97:
-               terminal->cursor.attributes.foreground = COLOR_BRIGHT_WHITE;
-               break;
-          case 100:
-               terminal->cursor.attributes.background = COLOR_BRIGHT_BLACK;
-               break;
-          case 101:
-               terminal->cursor.attributes.background = COLOR_BRIGHT_RED;
-               break;
-          case 102:
-               terminal->cursor.attributes.background = COLOR_BRIGHT_GREEN;
-               break;
-          case 103:
-               terminal->cursor.attributes.background = COLOR_BRIGHT_YELLOW;
-               break;
-          case 104:
-               terminal->cursor.attributes.background = COLOR_BRIGHT_BLUE;
-               break;
-          case 105:
-               terminal->cursor.attributes.background = COLOR_BRIGHT_MAGENTA;
-               break;
-          case 106:
-               terminal->cursor.attributes.background = COLOR_BRIGHT_CYAN;
-               break;
-          case 107:
-               terminal->cursor.attributes.background = COLOR_BRIGHT_WHITE;
+// sets the host palette to the view's with OSC 4, and OSC 104 to put back an entry the child reset
+void vt_output_palette(VTOutput_t* vt, View_t* view)
+{
+     for(int i = 0; i < PALETTE_SIZE; ++i){
+          int32_t rgb = view->palette[i];
+          if(rgb == view->applied_palette[i]) continue;
+
+          if(rgb < 0){
+               vt_output_printf(vt, "\033]104;%d\033\\", i);
+          }else{
+               vt_output_printf(vt, "\033]4;%d;rgb:%02x/%02x/%02x\033\\", i, (rgb >> 16) & 0xFF, (rgb >> 8) & 0xFF, rgb & 0xFF);
+          }
+          view->applied_palette[i] = rgb;
+     }
+}
+
+// writes every change since the last frame inside a synchronized update, with one write(), and returns the bytes
+// written
+size_t vt_output_flush(VTOutput_t* vt, View_t* view)
+{
+     TRACE_SCOPE("vt output");
+     const char begin[] = "\033[?2026h";
+     const char end[] = "\033[?2026l";
+
+     arena_reset(&vt->frame);
+     arena_append(&vt->frame, begin, sizeof(begin) - 1);
+
+     if(view->palette_dirty){
+          view->palette_dirty = false;
+          vt_output_palette(vt, view);
+     }
+
+     // scroll the rows within the host's top and bottom margins, the rows scrolled in take the current background
+     if(vt->scroll.count){
+          Glyph_t blank = {' ', 0, 0, COLOR_FOREGROUND, COLOR_BACKGROUND};
+          vt_output_colors(vt, &blank);
+          vt_output_printf(vt, "\033[%d;%dr", vt->y + vt->scroll.top + 2, vt->y + vt->scroll.bottom + 2);
+          vt_output_printf(vt, "\033[%d%c", abs(vt->scroll.count), (vt->scroll.count > 0) ? 'S' : 'T');
+          vt_output_printf(vt, "\033[r");
+
+          // setting the margins sends the cursor home
+          vt->cursor_x = -1;
+          vt->cursor_y = -1;
+          vt->scroll.count = 0;
+     }
+
+     for(int r = 0; r < vt->rows; ++r){
+          if(vt->dirty[r]) vt_output_row(vt, r);
+     }
+
+     int cursor_row;
+     int cursor_column;
+     view_cursor(view, &cursor_row, &cursor_column);
+     vt_output_move(vt, cursor_row, cursor_column);
+
+     if(vt->frame.length == sizeof(begin) - 1) return 0;
+     arena_append(&vt->frame, end, sizeof(end) - 1);
+
+     // a frame that did not fit leaves the host in a state the shadow does not know
+     if(vt->frame.dropped){
+          LOG(LOG_LEVEL_WARN, "dropped a frame of more than %d bytes\n", VT_FRAME_LIMIT);
+          for(int r = 0; r < vt->rows; ++r){
+               for(int c = 0; c < vt->columns; ++c) vt_glyph_forget(vt->shadow[r] + c);
+               vt->dirty[r] = true;
+          }
+          vt->cursor_x = vt->cursor_y = -1;
+          vt->foreground = vt->background = VT_COLOR_UNKNOWN;
+          return 0;
+     }
+
+     size_t written = 0;
+     while(written < vt->frame.length){
+          ssize_t rc = write(vt->file_descriptor, vt->frame.data + written, vt->frame.length - written);
+          if(rc < 0){
+               if(errno == EINTR) continue;
+               LOG(LOG_LEVEL_ERROR, "write() of a frame failed: '%s'\n", strerror(errno));
                break;
           }
+          written += rc;
      }
+
+     STAT_ADD(STAT_OUTPUT_BYTES, written);
+     return written;
 }
 
-bool esc_handle(Terminal_t* terminal, Rune_t rune)
+void vt_output_draw(VTOutput_t* vt, View_t* view, Terminal_t* terminal)
 {
-     switch(rune) {
-     case '[':
-          terminal->escape_state |= ESCAPE_STATE_CSI;
-          return false;
-     case '#':
-          terminal->escape_state |= ESCAPE_STATE_TEST;
-          return false;
-     case '%':
-          terminal->escape_state |= ESCAPE_STATE_UTF8;
-          return false;
-     case 'P': // DCS -- Device Control String
-     case '_': // APC -- Application Program Command
-     case '^': // PM -- Privacy Message
-     case ']': // OSC -- Operating System Command
-     case 'k': // old title set compatibility
-          str_sequence(terminal, rune);
+     int dirty_rows = view_snapshot(view, terminal);
+     view_viewport(view);
+     view_blink(view);
+     vt_output_view(vt, view);
+
+     // the border is only drawn again where it changes
+     if(view->title_dirty){
+          view->title_dirty = false;
+          char title[TITLE_SIZE + 2] = "";
+          if(view->title[0]) snprintf(title, sizeof(title), " %s ", view->title);
+          vt_output_border(vt, 0, 2, title);
+     }
+
+     STAT_ADD(STAT_FRAMES, 1);
+     STAT_ADD(STAT_DIRTY_ROWS, dirty_rows);
+     STAT_RECORD(HISTOGRAM_DIRTY_ROWS, dirty_rows);
+}
+
+// leaves the host's colors as curses expects to find them
+void vt_output_stop(VTOutput_t* vt)
+{
+     const char reset[] = "\033[0m";
+     if(write(vt->file_descriptor, reset, sizeof(reset) - 1) < 0){
+          LOG(LOG_LEVEL_ERROR, "write() failed: '%s'\n", strerror(errno));
+     }
+}
+
+bool screen_export_create(ScreenExporter_t* exporter, const char* name, uint32_t row_capacity, uint32_t column_capacity)
+{
+     snprintf(exporter->name, sizeof(exporter->name), "%s", name);
+     exporter->size = screen_export_size(row_capacity, column_capacity);
+     exporter->rows = 0;
+     exporter->columns = 0;
+
+     int file_descriptor = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0600);
+     if(file_descriptor < 0){
+          LOG(LOG_LEVEL_ERROR, "shm_open(%s) failed: '%s'\n", name, strerror(errno));
           return false;
-     case 'n': // LS2 -- Locking shift 2
-     case 'o': // LS3 -- Locking shift 3
-          // TODO
-          //term.charset = 2 + (ascii - 'n');
-          break;
-     case '(': // GZD4 -- set primary charset G0
-     case ')': // G1D4 -- set secondary charset G1
-     case '*': // G2D4 -- set tertiary charset G2
-     case '+': // G3D4 -- set quaternary charset G3
-          // TODO
-          //term.icharset = ascii - '(';
-          //term.esc |= ESC_ALTCHARSET;
+     }
+
+     void* shared = MAP_FAILED;
+     if(ftruncate(file_descriptor, exporter->size) == 0){
+          shared = mmap(NULL, exporter->size, PROT_READ | PROT_WRITE, MAP_SHARED, file_descriptor, 0);
+     }
+     close(file_descriptor);
+     if(shared == MAP_FAILED){
+          LOG(LOG_LEVEL_ERROR, "failed to map %zu bytes of %s: '%s'\n", exporter->size, name, strerror(errno));
+          shm_unlink(name);
           return false;
-     case 'D': // IND -- Linefeed
-          if(terminal->cursor.y == terminal->bottom){
-               terminal_scroll_up(terminal, terminal->top, 1);
-          }else{
-               terminal_move_cursor_to(terminal, terminal->cursor.x, terminal->cursor.y + 1);
-          }
-          break;
-     case 'E': // NEL -- Next line
-          terminal_put_newline(terminal, 1); // always go to first col
-          break;
-     case 'H': // HTS -- Horizontal tab stop
-          terminal->tabs[terminal->cursor.x] = 1;
-          break;
-     case 'M': // RI -- Reverse index
-          if(terminal->cursor.y == terminal->top){
-               terminal_scroll_down(terminal, terminal->top, 1);
-          }else{
-               terminal_move_cursor_to(terminal, terminal->cursor.x, terminal->cursor.y - 1);
-          }
-          break;
-     case 'Z': // DECID -- Identify Terminal
-          tty_write(terminal->file_descriptor, VT_IDENTIFIER, sizeof(VT_IDENTIFIER) - 1);
-          break;
-     case 'c': // RIS -- Reset to inital state
-          terminal_reset(terminal);
-          //resettitle();
-          //xloadcols();
-          break;
-     case '=': // DECPAM -- Application keypad
-          terminal->mode |= TERMINAL_MODE_APPKEYPAD;
-          break;
-     case '>': // DECPNM -- Normal keypad
-          terminal->mode &= ~TERMINAL_MODE_APPKEYPAD;
-          break;
-     case '7': // DECSC -- Save Cursor
-          terminal_cursor_save(terminal);
-          break;
-     case '8': // DECRC -- Restore Cursor
-          terminal_cursor_load(terminal);
-          break;
-     case '\\': // ST -- String Terminator
-          if(terminal->escape_state & ESCAPE_STATE_STR_END) str_handle(terminal);
-          break;
-     default:
-          LOG("erresc: unknown sequence ESC 0x%02X '%c' in sequence: '%s'\n", (unsigned char)rune, isprint(rune) ? rune : '.', terminal->csi_escape.buffer);
-          break;
      }
 
+     // the magic goes in last, a reader attaching before then sees a zeroed object and gives up
+     exporter->shared = shared;
+     exporter->shared->version = SCREEN_EXPORT_VERSION;
+     exporter->shared->row_capacity = row_capacity;
+     exporter->shared->column_capacity = column_capacity;
+     __atomic_store_n(&exporter->shared->magic, SCREEN_EXPORT_MAGIC, __ATOMIC_RELEASE);
      return true;
 }
 
-void csi_handle(Terminal_t* terminal)
+// copies the rows of the view that changed with its last snapshot, which readers see all at once or not at all
+void screen_export_publish(ScreenExporter_t* exporter, View_t* view)
 {
-     CSIEscape_t* csi = &terminal->csi_escape;
-
-	switch(csi->mode[0]){
-	default:
-          LOG("unhandled csi: '%c' in sequence: '%s'\n", csi->mode[0], csi->buffer);
-          break;
-     case '@':
-          DEFAULT(csi->arguments[0], 1);
-          terminal_insert_blank(terminal, csi->arguments[0]);
-          break;
-     case 'A':
-          DEFAULT(csi->arguments[0], 1);
-          terminal_move_cursor_to(terminal, terminal->cursor.x, terminal->cursor.y - csi->arguments[0]);
-          break;
-     case 'B':
-     case 'e':
-          DEFAULT(csi->arguments[0], 1);
-          terminal_move_cursor_to(terminal, terminal->cursor.x, terminal->cursor.y + csi->arguments[0]);
-          break;
-     case 'i':
-          // TODO
-          switch(csi->arguments[0]){
-          default:
-               break;
-          case 0:
-               break;
-          case 1:
-               break;
-          case 2:
-               break;
-          case 4:
-               break;
-          case 5:
-               break;
+     TRACE_SCOPE("screen export");
+     ScreenExport_t* shared = exporter->shared;
+     uint64_t* generations = screen_export_generations(shared);
+     ScreenExportCell_t* cells = screen_export_cells(shared);
+
+     uint32_t rows = (view->rows < shared->row_capacity) ? view->rows : shared->row_capacity;
+     uint32_t columns = (view->columns < shared->column_capacity) ? view->columns : shared->column_capacity;
+     bool resized = rows != exporter->rows || columns != exporter->columns;
+     exporter->rows = rows;
+     exporter->columns = columns;
+
+     uint64_t frame = shared->frame + 1;
+     __atomic_store_n(&shared->sequence, shared->sequence + 1, __ATOMIC_RELAXED);
+     __atomic_thread_fence(__ATOMIC_RELEASE);
+
+     for(uint32_t r = 0; r < rows; ++r){
+          // rows the snapshot moved with a scroll are not dirty but hold something else now
+          bool scrolled = view->scroll.count && (int32_t)(r) >= view->scroll.top && (int32_t)(r) <= view->scroll.bottom;
+          if(!resized && !scrolled && !view->dirty[r]) continue;
+
+          Glyph_t* line = view->lines[r];
+          ScreenExportCell_t* cell = cells + r * shared->column_capacity;
+          for(uint32_t c = 0; c < columns; ++c){
+               Rune_t rune = line[c].rune;
+               if(rune & RUNE_CLUSTER_BIT) rune = view->clusters[rune & ~RUNE_CLUSTER_BIT].runes[0];
+               if(line[c].attributes & GLYPH_ATTRIBUTE_WDUMMY) rune = 0;
+               cell[c] = (ScreenExportCell_t){rune, line[c].attributes, line[c].foreground, line[c].background};
           }
-          break;
-     case 'c':
-		if (csi->arguments[0] == 0) tty_write(terminal->file_descriptor, VT_IDENTIFIER, sizeof(VT_IDENTIFIER) - 1);
-          break;
-     case 'C':
-     case 'a':
-          DEFAULT(csi->arguments[0], 1);
-          terminal_move_cursor_to(terminal, terminal->cursor.x + csi->arguments[0], terminal->cursor.y);
-          break;
-     case 'D':
-          DEFAULT(csi->arguments[0], 1);
-          terminal_move_cursor_to(terminal, terminal->cursor.x - csi->arguments[0], terminal->cursor.y);
-          break;
-     case 'E':
-          DEFAULT(csi->arguments[0], 1);
-          terminal_move_cursor_to(terminal, 0, terminal->cursor.y + csi->arguments[0]);
-          break;
-     case 'F':
-          DEFAULT(csi->arguments[0], 1);
-          terminal_move_cursor_to(terminal, 0, terminal->cursor.y - csi->arguments[0]);
-          break;
-     case 'g':
-          switch(csi->arguments[0]){
-          default:
-               break;
-          case 0: // clear tab stop
-               terminal->tabs[terminal->cursor.x] = 0;
-               break;
-          case 3: // clear all tabs
-               memset(terminal->tabs, 0, terminal->columns * sizeof(*terminal->tabs));
-               break;
+          __atomic_store_n(generations + r, frame, __ATOMIC_RELAXED);
+     }
+
+     __atomic_store_n(&shared->rows, rows, __ATOMIC_RELAXED);
+     __atomic_store_n(&shared->columns, columns, __ATOMIC_RELAXED);
+     __atomic_store_n(&shared->cursor_x, view->cursor_x, __ATOMIC_RELAXED);
+     __atomic_store_n(&shared->cursor_y, view->cursor_y, __ATOMIC_RELAXED);
+     __atomic_store_n(&shared->frame, frame, __ATOMIC_RELAXED);
+     __atomic_store_n(&shared->sequence, shared->sequence + 1, __ATOMIC_RELEASE);
+}
+
+void screen_export_destroy(ScreenExporter_t* exporter)
+{
+     munmap(exporter->shared, exporter->size);
+     shm_unlink(exporter->name);
+}
+
+int bench_width(int argc, char** argv)
+{
+     // mostly ascii with some latin, box drawing, cjk, combining marks and emoji mixed in
+     static const Rune_t samples[] = {'a', 'Z', ' ', '0', 0xE9, 0x2500, 0x2502, 0x4E2D, 0x6587, 0x0301, 0x1F600, 0x3042, 'x', '_', 0x00FC, 0xFF21};
+     const int count = 1 << 24;
+     Rune_t* runes = malloc(count * sizeof(*runes));
+     if(!runes) return 1;
+
+     uint32_t random = 12345;
+     for(int i = 0; i < count; ++i){
+          random = random * 1103515245 + 12345;
+          runes[i] = samples[(random >> 16) % ELEM_COUNT(samples)];
+     }
+
+     if(!setlocale(LC_CTYPE, "C.UTF-8")) setlocale(LC_CTYPE, "en_US.UTF-8");
+
+     int table_sum = 0;
+     uint64_t start = time_nanoseconds();
+     for(int i = 0; i < count; ++i) table_sum += rune_width(runes[i]);
+     uint64_t table = time_nanoseconds() - start;
+
+     int libc_sum = 0;
+     start = time_nanoseconds();
+     for(int i = 0; i < count; ++i) libc_sum += wcwidth(runes[i]);
+     uint64_t libc = time_nanoseconds() - start;
+
+     int mismatches = 0;
+     for(int i = 0; i < ELEM_COUNT(samples); ++i){
+          if(rune_width(samples[i]) != wcwidth(samples[i])) mismatches++;
+     }
+
+     printf("rune_width: %.2f ns/lookup (total width %d)\n", (double)(table) / count, table_sum);
+     printf("wcwidth:    %.2f ns/lookup (total width %d)\n", (double)(libc) / count, libc_sum);
+     printf("%d of %d sample widths differ from wcwidth in this locale\n", mismatches, (int)(ELEM_COUNT(samples)));
+
+     free(runes);
+     return 0;
+}
+
+// reads every file into one buffer, or makes up colored text with cursor movement and scrolling when there are none
+char* bench_parse_input(int argc, char** argv, size_t* length)
+{
+     size_t capacity = 1 << 20;
+     char* data = malloc(capacity);
+     *length = 0;
+
+     for(int i = 0; i < argc && data; ++i){
+          FILE* file = fopen(argv[i], "rb");
+          if(!file){
+               fprintf(stderr, "failed to open '%s': %s\n", argv[i], strerror(errno));
+               free(data);
+               return NULL;
           }
-          break;
-     case 'G':
-     case '`':
-          DEFAULT(csi->arguments[0], 1);
-          terminal_move_cursor_to(terminal, csi->arguments[0] - 1, terminal->cursor.y);
-          break;
-     case 'H':
-     case 'f':
-          DEFAULT(csi->arguments[0], 1);
-          DEFAULT(csi->arguments[1], 1);
-          terminal_move_cursor_to_absolute(terminal, csi->arguments[1] - 1, csi->arguments[0] - 1);
-          break;
-     case 'I':
-          DEFAULT(csi->arguments[0], 1);
-          terminal_put_tab(terminal, csi->arguments[0]);
-          break;
-     case 'J': // clear region in relation to cursor
-          switch(csi->arguments[0]){
-          default:
-               break;
-          case 0: // below
-               terminal_clear_region(terminal, terminal->cursor.x, terminal->cursor.y, terminal->columns - 1, terminal->cursor.y);
-               if(terminal->cursor.y < (terminal->rows - 1)){
-                    terminal_clear_region(terminal, 0, terminal->cursor.y + 1, terminal->columns - 1, terminal->rows - 1);
-               }
-               break;
-          case 1: // above
-               if(terminal->cursor.y > 1){
-                    terminal_clear_region(terminal, 0, 0, terminal->columns - 1, terminal->cursor.y - 1);
+
+          size_t rc;
+          do{
+               if(*length == capacity){
+                    capacity *= 2;
+                    char* grown = realloc(data, capacity);
+                    if(!grown){
+                         free(data);
+                         data = NULL;
+                         break;
+                    }
+                    data = grown;
                }
-               terminal_clear_region(terminal, 0, terminal->cursor.y, terminal->cursor.x, terminal->cursor.y);
-               break;
-          case 2: // all
-               terminal_clear_region(terminal, 0, 0, terminal->columns - 1, terminal->rows - 1);
-               break;
-          }
-          break;
-     case 'K': // clear line
-          switch(csi->arguments[0]){
+               rc = fread(data + *length, 1, capacity - *length, file);
+               *length += rc;
+          }while(rc > 0);
+          fclose(file);
+     }
+
+     if(argc > 0 || !data) return data;
+
+     uint32_t random = 12345;
+     while(*length + 64 < capacity){
+          random = random * 1103515245 + 12345;
+          switch((random >> 16) % 8){
           default:
+               *length += snprintf(data + *length, capacity - *length, "lorem ipsum dolor sit amet ");
+               break;
+          case 0:
+               *length += snprintf(data + *length, capacity - *length, "\033[%dm", 30 + (random >> 8) % 8);
+               break;
+          case 1:
+               *length += snprintf(data + *length, capacity - *length, "\033[0m\r\n");
+               break;
+          case 2:
+               *length += snprintf(data + *length, capacity - *length, "\033[%d;%dH\033[K", 1 + (random >> 4) % 24, 1 + (random >> 9) % 80);
                break;
-          case 0: // right of cursor
-               terminal_clear_region(terminal, terminal->cursor.x, terminal->cursor.y, terminal->columns - 1, terminal->cursor.y);
-               break;
-          case 1: // left of cursor
-               terminal_clear_region(terminal, 0, terminal->cursor.y, terminal->cursor.x, terminal->cursor.y);
-               break;
-          case 2: // all
-               terminal_clear_region(terminal, 0, terminal->cursor.y, terminal->columns - 1, terminal->cursor.y);
-               break;
-          }
-          break;
-     case 'S':
-          DEFAULT(csi->arguments[0], 1);
-          terminal_scroll_up(terminal, terminal->top, csi->arguments[0]);
-          break;
-     case 'T':
-          DEFAULT(csi->arguments[0], 1);
-          terminal_scroll_down(terminal, terminal->top, csi->arguments[0]);
-          break;
-     case 'L':
-          DEFAULT(csi->arguments[0], 1);
-          terminal_insert_blank_line(terminal, csi->arguments[0]);
-          break;
-     case 'l':
-          terminal_set_mode(terminal, false);
-          break;
-     case 'M':
-          DEFAULT(csi->arguments[0], 1);
-          terminal_delete_line(terminal, csi->arguments[0]);
-          break;
-     case 'X':
-          DEFAULT(csi->arguments[0], 1);
-          terminal_clear_region(terminal, terminal->cursor.x, terminal->cursor.y, terminal->cursor.x + csi->arguments[0] - 1, terminal->cursor.y);
-          break;
-     case 'P':
-          DEFAULT(csi->arguments[0], 1);
-          terminal_delete_char(terminal, csi->arguments[0]);
-          break;
-     case 'Z':
-          DEFAULT(csi->arguments[0], 1);
-          terminal_put_tab(terminal, -csi->arguments[0]);
-          break;
-     case 'd':
-          DEFAULT(csi->arguments[0], 1);
-          terminal_move_cursor_to_absolute(terminal, terminal->cursor.x, csi->arguments[0] - 1);
-          break;
-     case 'h':
-          terminal_set_mode(terminal, true);
-          break;
-     case 'm':
-          terminal_set_attributes(terminal);
-          break;
-     case 'n':
-          if(csi->arguments[0] == 6){
-               char buffer[BUFSIZ];
-               int len = snprintf(buffer, BUFSIZ, "\033[%i;%iR",
-                              terminal->cursor.x, terminal->cursor.y);
-               tty_write(terminal->file_descriptor, buffer, len);
-          }
-          break;
-     case 'r':
-          if(!csi->private){
-               DEFAULT(csi->arguments[0], 1);
-               DEFAULT(csi->arguments[1], terminal->rows);
-               terminal_set_scroll(terminal, csi->arguments[0] - 1, csi->arguments[1] - 1);
-               terminal_move_cursor_to_absolute(terminal, 0, 0);
           }
-          break;
-     case 's':
-          terminal_cursor_save(terminal);
-          break;
-     case 'u':
-          terminal_cursor_load(terminal);
-          break;
-     case ' ': // cursor style
-          break;
      }
+
+     return data;
+}
+
+// how much the line pool saves over storing every history line on its own
+void bench_report_history(History_t* history)
+{
+     LinePool_t* pool = &history->pool;
+     uint64_t shared = 0;
+     uint64_t unshared = 0;
+
+     for(uint32_t handle = 0; handle < pool->count; ++handle){
+          HistoryLine_t* line = pool->lines + handle;
+          if(!line->references) continue;
+          shared += line->length * sizeof(Glyph_t);
+          if(handle != LINE_POOL_EMPTY) unshared += (uint64_t)(line->references) * line->length * sizeof(Glyph_t);
+     }
+
+     // the empty line is always live but only counts when some line is blank
+     int64_t lines = history->end - history->start;
+     uint32_t distinct = pool->live - (pool->lines[LINE_POOL_EMPTY].references == 1);
+     printf("history: %" PRId64 " lines, %u distinct, dedup %.2fx, %.1f KB of glyphs instead of %.1f KB\n", lines,
+            distinct, distinct ? lines / (double)(distinct) : 1.0, shared / 1024.0, unshared / 1024.0);
 }
 
-void str_parse(Terminal_t* terminal)
+int bench_parse(int argc, char** argv)
 {
-     STREscape_t* str = &terminal->str_escape;
-     int c;
-     char *p = str->buffer;
+     const size_t target = 64 << 20;
+     size_t length;
+     char* data = bench_parse_input(argc, argv, &length);
+     if(!data || length == 0) return 1;
+
+     Terminal_t* terminal = calloc(1, sizeof(*terminal));
+     if(!terminal || !terminal_init(terminal, 24, 80)) return 1;
+
+     size_t parsed = 0;
+     uint64_t start = time_nanoseconds();
+     while(parsed < target){
+          // parse in read sized chunks like tty_reader() does
+          for(size_t offset = 0; offset < length;){
+               int chunk = (length - offset < BUFSIZ) ? length - offset : BUFSIZ;
+               int consumed = terminal_parse(terminal, data + offset, chunk);
+               offset += consumed ? consumed : chunk;
+          }
+          // later passes repeat the same lines, so only the first says anything about the input
+          if(parsed == 0) bench_report_history(&terminal->history);
+          parsed += length;
+     }
+     uint64_t elapsed = time_nanoseconds() - start;
 
-     str->argument_count = 0;
-     str->buffer[str->buffer_length] = 0;
+     StatsShard_t total;
+     stats_total(&total);
 
-     if(*p == 0) return;
+     printf("parsed %zu bytes (%zu byte input) in %.3f s\n", parsed, length, elapsed / 1e9);
+     printf("throughput: %.1f MB/s\n", parsed / (elapsed / 1e9) / 1e6);
+     printf("counted %" PRIu64 " bytes, %" PRIu64 " csi, %" PRIu64 " scrolled lines\n", total.counters[STAT_BYTES_PARSED],
+            total.counters[STAT_CSI], total.counters[STAT_SCROLLS]);
 
-     while(str->argument_count < ESCAPE_ARGUMENT_SIZE){
-          str->arguments[str->argument_count] = p;
-          str->argument_count++;
+     free(data);
+     return 0;
+}
 
-          while((c = *p) != ';' && c != 0){
-               ++p;
-          }
+// a curses screen that writes to output, big enough for any view we draw
+SCREEN* bench_screen(FILE* output)
+{
+     FILE* input = fopen("/dev/null", "r");
+     if(!output || !input) return NULL;
+
+     setenv("LINES", "100", 1);
+     setenv("COLUMNS", "400", 1);
+     SCREEN* screen = newterm("xterm-256color", output, input);
+     if(!screen) return NULL;
+
+     set_term(screen);
+     start_color();
+     use_default_colors();
+     g_color_count = COLORS;
+     return screen;
+}
 
-          if(c == 0) return;
-          *p++ = 0;
+int bench_render(int argc, char** argv)
+{
+     const int frames = 5000;
+     Terminal_t* terminal = calloc(1, sizeof(*terminal));
+     if(!terminal || !terminal_init(terminal, 24, 80)) return 1;
+
+     // a full screen tui: nested boxes, a table grid and some colored text
+     char screen_bytes[BUFSIZ * 8];
+     int length = snprintf(screen_bytes, sizeof(screen_bytes), "\033[H\033[2J");
+     for(int r = 0; r < terminal->rows; ++r){
+          length += snprintf(screen_bytes + length, sizeof(screen_bytes) - length, "\033[%d;1H\033[3%dm", r + 1, r % 8);
+          for(int c = 0; c < terminal->columns; ++c){
+               const char* piece = "─";
+               if(r == 0) piece = (c == 0) ? "┌" : (c == terminal->columns - 1) ? "┐" : (c % 16 == 0) ? "┬" : "─";
+               else if(r == terminal->rows - 1) piece = (c == 0) ? "└" : (c == terminal->columns - 1) ? "┘" : (c % 16 == 0) ? "┴" : "─";
+               else if(r % 4 == 0) piece = (c == 0) ? "├" : (c == terminal->columns - 1) ? "┤" : (c % 16 == 0) ? "┼" : "─";
+               else if(c % 16 == 0 || c == terminal->columns - 1) piece = "│";
+               else piece = (c % 16 < 8) ? "░" : " ";
+               length += snprintf(screen_bytes + length, sizeof(screen_bytes) - length, "%s", piece);
+          }
+     }
+     terminal_parse(terminal, screen_bytes, length);
+
+     SCREEN* screen = bench_screen(fopen("/dev/null", "w"));
+     if(!screen) return 1;
+
+     WINDOW* window = newwin(terminal->rows + 2, terminal->columns + 2, 0, 0);
+     View_t* view = calloc(1, sizeof(*view));
+     if(!window || !view) return 1;
+     view_init(view, window);
+
+     uint64_t draw = 0;
+     uint64_t refresh = 0;
+     for(int i = 0; i < frames; ++i){
+          terminal_all_dirty(terminal);
+
+          uint64_t start = time_nanoseconds();
+          view_draw(view, terminal);
+          uint64_t drawn = time_nanoseconds();
+          wrefresh(window);
+          refresh += time_nanoseconds() - drawn;
+          draw += drawn - start;
      }
+
+     delwin(window);
+     endwin();
+     delscreen(screen);
+
+     printf("%dx%d box drawing screen, %d frames\n", terminal->columns, terminal->rows, frames);
+     printf("draw:    %.1f us/frame\n", draw / 1000.0 / frames);
+     printf("refresh: %.1f us/frame\n", refresh / 1000.0 / frames);
+     return 0;
 }
 
-void str_sequence(Terminal_t* terminal, Rune_t rune)
+uint64_t bench_thread_nanoseconds()
 {
-     memset(&terminal->str_escape, 0, sizeof(terminal->str_escape));
+     struct timespec now;
+     clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+     return (uint64_t)(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+}
 
-     switch(rune){
-     default:
-          break;
-     case 0x90:
-          rune = 'P';
-          terminal->escape_state |= ESCAPE_STATE_DCS;
-          break;
-     case 0x9f:
-          rune = '_';
-          break;
-     case 0x9e:
-          rune = '^';
-          break;
-     case 0x9d:
-          rune = ']';
-          break;
+// parses the input frame_bytes at a time and draws a frame after each, with curses when vt is NULL, returns the cpu
+// time spent drawing
+uint64_t bench_output_frames(const char* data, size_t length, int frame_bytes, WINDOW* window, VTOutput_t* vt, int* frames)
+{
+     Terminal_t* terminal = calloc(1, sizeof(*terminal));
+     View_t* view = calloc(1, sizeof(*view));
+     if(!terminal || !view || !terminal_init(terminal, 24, 80)) return 0;
+     view_init(view, window);
+
+     uint64_t elapsed = 0;
+     *frames = 0;
+     // a few passes over the input, so a short one still makes enough frames to time
+     for(int pass = 0; pass < 4; ++pass){
+          for(size_t offset = 0; offset < length;){
+               int chunk = (length - offset < frame_bytes) ? length - offset : frame_bytes;
+               int consumed = terminal_parse(terminal, data + offset, chunk);
+               offset += consumed ? consumed : chunk;
+
+               uint64_t start = bench_thread_nanoseconds();
+               if(vt){
+                    vt_output_draw(vt, view, terminal);
+                    vt_output_flush(vt, view);
+               }else{
+                    view_draw(view, terminal);
+                    wrefresh(window);
+               }
+               elapsed += bench_thread_nanoseconds() - start;
+               (*frames)++;
+          }
      }
 
-     terminal->str_escape.type = rune;
-     terminal->escape_state |= ESCAPE_STATE_STR;
+     return elapsed;
 }
 
-void str_handle(Terminal_t* terminal)
+// what drawing the same frames costs through curses and with escape sequences of our own, both writing to a file
+// so their bytes can be counted
+bool bench_output_compare(const char* data, size_t length, int frame_bytes)
 {
-     STREscape_t* str = &terminal->str_escape;
+     FILE* curses_file = tmpfile();
+     FILE* vt_file = tmpfile();
+     if(!curses_file || !vt_file) return false;
 
-     terminal->escape_state &= ~(ESCAPE_STATE_STR_END | ESCAPE_STATE_STR);
-     str_parse(terminal);
-     int argument_count = str->argument_count;
-     int param = argument_count ? atoi(str->arguments[0]) : 0;
+     SCREEN* screen = bench_screen(curses_file);
+     if(!screen) return false;
 
-     switch(str->type){
-     default:
-          break;
-     case ']':
-          switch(param){
-          default:
-               break;
-          case 0:
-          case 1:
-          case 2:
-               break;
-          case 52:
-               break;
-          case 4:
-          case 104:
-               break;
+     WINDOW* window = newwin(24 + 2, 80 + 2, 0, 0);
+     VTOutput_t* vt = calloc(1, sizeof(*vt));
+     if(!window || !vt || !vt_output_init(vt, fileno(vt_file), 24 + 2, 80 + 2, 0, 0)) return false;
+
+     int curses_frames;
+     int vt_frames;
+     uint64_t curses_ns = bench_output_frames(data, length, frame_bytes, window, NULL, &curses_frames);
+     uint64_t vt_ns = bench_output_frames(data, length, frame_bytes, window, vt, &vt_frames);
+
+     delwin(window);
+     endwin();
+     fflush(curses_file);
+     delscreen(screen);
+
+     struct stat curses_stat;
+     struct stat vt_stat;
+     if(fstat(fileno(curses_file), &curses_stat) < 0 || fstat(fileno(vt_file), &vt_stat) < 0) return false;
+
+     printf("%d frames of 80x24, a frame every %d bytes of %zu byte input\n", curses_frames, frame_bytes, length);
+     printf("curses: %8.0f bytes/frame %7.1f us/frame\n", (double)(curses_stat.st_size) / curses_frames,
+            curses_ns / 1000.0 / curses_frames);
+     printf("vt:     %8.0f bytes/frame %7.1f us/frame\n", (double)(vt_stat.st_size) / vt_frames, vt_ns / 1000.0 / vt_frames);
+
+     fclose(curses_file);
+     fclose(vt_file);
+     return true;
+}
+
+// a frame per read, like output arriving faster than the frame rate, and a frame every few lines, like a log
+// scrolling by
+int bench_output(int argc, char** argv)
+{
+     size_t length;
+     char* data = bench_parse_input(argc, argv, &length);
+     if(!data || length == 0) return 1;
+
+     bool ok = bench_output_compare(data, length, BUFSIZ) && bench_output_compare(data, length, 256);
+
+     free(data);
+     return ok ? 0 : 1;
+}
+
+void* bench_ring_producer(void* data)
+{
+     ByteRing_t* ring = (ByteRing_t*)(data);
+     const uint64_t total = 4ULL << 30;
+     uint64_t written = 0;
+
+     while(written < total){
+          char* space;
+          size_t length = byte_ring_writable(ring, &space);
+          if(length == 0){
+               byte_ring_wait(ring->space_ready);
+               continue;
           }
-          break;
-     case 'k':
-          break;
-     case 'P':
-          terminal->mode |= ESCAPE_STATE_DCS;
-          break;
-     case '_':
-          break;
-     case '^':
-          break;
+
+          // about what a read() from the pty hands over
+          if(length > BUFSIZ) length = BUFSIZ;
+          memset(space, 'x', length);
+          byte_ring_produce(ring, length);
+          written += length;
      }
+     return NULL;
 }
 
-void terminal_put(Terminal_t* terminal, Rune_t rune)
+// the reader to parser hand off on its own, what the pipeline costs on top of parsing
+int bench_ring(int argc, char** argv)
 {
-     char characters[UTF8_SIZE];
-     int width = 1;
-     int len = 0;
+     const uint64_t total = 4ULL << 30;
+     ByteRing_t ring;
+     if(!byte_ring_init(&ring, PIPELINE_RING_SIZE)) return 1;
 
-     if(terminal->mode & TERMINAL_MODE_UTF8){
-          utf8_encode(rune, characters, UTF8_SIZE, &len);
-     }else{
-          characters[0] = rune;
-          width = 1;
+     pthread_t producer;
+     uint64_t start = time_nanoseconds();
+     if(pthread_create(&producer, NULL, bench_ring_producer, &ring) != 0) return 1;
+
+     char buffer[BUFSIZ];
+     uint64_t received = 0;
+     uint64_t waits = 0;
+     while(received < total){
+          size_t length = byte_ring_consume(&ring, buffer, sizeof(buffer));
+          if(length == 0){
+               waits++;
+               byte_ring_wait(ring.data_ready);
+               continue;
+          }
+          received += length;
      }
+     uint64_t elapsed = time_nanoseconds() - start;
+     pthread_join(producer, NULL);
 
-     if(terminal->escape_state & ESCAPE_STATE_STR){
-          if(rune == '\a' || rune == 030 || rune == 032 || rune == 033 || is_controller_c1(rune)){
-               terminal->escape_state &= ~(ESCAPE_STATE_START | ESCAPE_STATE_STR | ESCAPE_STATE_DCS);
-               if(terminal->mode & TERMINAL_MODE_SIXEL){
-                    CHANGE_BIT(terminal->mode, 0, TERMINAL_MODE_SIXEL);
-                    return;
-               }
+     printf("moved %" PRIu64 " bytes through a %d byte ring in %.3f s, consumer waited %" PRIu64 " times\n", received,
+            PIPELINE_RING_SIZE, elapsed / 1e9, waits);
+     printf("throughput: %.1f MB/s\n", received / (elapsed / 1e9) / 1e6);
+     return 0;
+}
 
-               terminal->escape_state |= ESCAPE_STATE_STR_END;
-          }else{
-               if(terminal->mode & TERMINAL_MODE_SIXEL){
-                    return;
-               }
+typedef struct{
+     int  file_descriptor;
+     int  keys;
+     bool done;
+}LatencyKeys_t;
 
-               if(terminal->escape_state & ESCAPE_STATE_DCS && terminal->str_escape.buffer_length == 0 && rune == 'q'){
-                    terminal->mode |= TERMINAL_MODE_SIXEL;
-               }
+// types like a person would, one key at a time at a random point in the frame, waiting for each to be shown
+void* bench_latency_keys(void* data)
+{
+     LatencyKeys_t* keys = (LatencyKeys_t*)(data);
+     uint32_t random = 12345;
 
-               if(terminal->str_escape.buffer_length + 1 >= (ESCAPE_BUFFER_SIZE - 1)){
-                    return;
-               }
+     for(int i = 0; i < keys->keys; ++i){
+          random = random * 1103515245 + 12345;
+          usleep((random >> 16) % DRAW_USEC_LIMIT);
 
-               terminal->str_escape.buffer[terminal->str_escape.buffer_length] = rune;
-               terminal->str_escape.buffer_length++;
-               return;
+          char key = 'a' + (i % 26);
+          latency_sent(key);
+          if(write(keys->file_descriptor, &key, 1) < 0) break;
+
+          uint64_t sent = time_nanoseconds();
+          while(__atomic_load_n(&g_latency.rune, __ATOMIC_ACQUIRE) && time_nanoseconds() - sent < LATENCY_TIMEOUT_NS){
+               usleep(100);
+          }
+
+          // finish the line every so often so the line discipline has room, and let cat's copy of it go by unmeasured
+          if(i % 32 == 31){
+               if(write(keys->file_descriptor, "\r", 1) < 0) break;
+               usleep(20000);
           }
      }
 
-     if(is_controller(rune)){
-          terminal_control_code(terminal, rune);
-          return;
+     __atomic_store_n(&keys->done, true, __ATOMIC_RELEASE);
+     return NULL;
+}
+
+int bench_latency(int argc, char** argv)
+{
+     int key_count = (argc > 0) ? atoi(argv[0]) : 500;
+
+     Terminal_t* terminal = calloc(1, sizeof(*terminal));
+     if(!terminal || !terminal_init(terminal, 24, 80)) return 1;
+
+     SCREEN* screen = bench_screen(fopen("/dev/null", "w"));
+     if(!screen) return 1;
+
+     WINDOW* window = newwin(terminal->rows + 2, terminal->columns + 2, 0, 0);
+     View_t* view = calloc(1, sizeof(*view));
+     if(!window || !view) return 1;
+     view_init(view, window);
+
+     // the line discipline echoes what we type, cat just soaks it up
+     pid_t pid;
+     setenv("SHELL", LATENCY_ECHO_CHILD, 1);
+     if(!tty_create(terminal->rows, terminal->columns, &pid, &terminal->file_descriptor)) return 1;
+
+     Pipeline_t pipeline = {};
+     LatencyKeys_t keys = {terminal->file_descriptor, key_count, false};
+     pthread_t keys_thread;
+
+     g_latency.enabled = true;
+     if(!pipeline_start(&pipeline, terminal, pid, -1)) return 1;
+     if(pthread_create(&keys_thread, NULL, bench_latency_keys, &keys) != 0) return 1;
+
+     // draw the way the main loop does. nothing wakes the wait once the last key has been drawn, so it is bounded to
+     // see keys.done
+     uint64_t last_frame = 0;
+     while(!__atomic_load_n(&keys.done, __ATOMIC_ACQUIRE)){
+          uint64_t deadline = time_nanoseconds() + DRAW_USEC_LIMIT * 1000ULL;
+          if(!pipeline_wait_frame(&pipeline, &last_frame, NULL, deadline)) continue;
+
+          view_draw(view, terminal);
+          wrefresh(window);
+          latency_displayed();
      }
 
-     if(terminal->escape_state & ESCAPE_STATE_START){
-          if(terminal->escape_state & ESCAPE_STATE_CSI){
-               CSIEscape_t* csi = &terminal->csi_escape;
-               csi->buffer[csi->buffer_length] = rune;
-               csi->buffer_length++;
+     pthread_join(keys_thread, NULL);
+     kill(pid, SIGKILL);
+     waitpid(pid, NULL, 0);
+     pipeline_stop(&pipeline);
 
-               if(BETWEEN(rune, 0x40, 0x7E) || csi->buffer_length >= (ESCAPE_BUFFER_SIZE - 1)){
-                    terminal->escape_state = 0;
-                    csi_parse(csi);
-                    csi_handle(terminal);
-               }
+     delwin(window);
+     endwin();
+     delscreen(screen);
 
-               return;
-          }else if(terminal->escape_state & ESCAPE_STATE_UTF8){
-               if(rune == 'G'){
-                    terminal->mode |= TERMINAL_MODE_UTF8;
-               }else if(rune == '@'){
-                    terminal->mode &= ~TERMINAL_MODE_UTF8;
-               }
-          }else if(terminal->escape_state & ESCAPE_STATE_ALTCHARSET){
-               // TODO
-          }else if(terminal->escape_state & ESCAPE_STATE_TEST){
-               // TODO
-          }else{
-               if(!esc_handle(terminal, rune)) return;
+     printf("%d keys echoed by %s, drawn at most every %d us\n", key_count, LATENCY_ECHO_CHILD, DRAW_USEC_LIMIT);
+     latency_report(stdout);
+     return 0;
+}
+
+// opens sessions one after another on a pty of our own, timed from the exec of cursed until the host has been sent
+// the shell's first prompt. takes the binary to time, this one by default, and how many sessions
+int bench_startup(int argc, char** argv)
+{
+     const char* binary = (argc > 0) ? argv[0] : "/proc/self/exe";
+     int session_count = (argc > 1) ? atoi(argv[1]) : 20;
+     if(session_count <= 0) return 1;
+
+     uint64_t* times = calloc(session_count, sizeof(*times));
+     if(!times) return 1;
+
+     setenv("TERM", "xterm-256color", 1);
+     setenv("SHELL", "/bin/sh", 1);
+     setenv("PS1", STARTUP_PROMPT " ", 1);
+     unsetenv("ENV");
+
+     for(int i = 0; i < session_count; ++i){
+          int host;
+          struct winsize size = {30, 100, 0, 0};
+          uint64_t start = time_nanoseconds();
+          pid_t pid = forkpty(&host, NULL, NULL, &size);
+          if(pid < 0) return 1;
+          if(pid == 0){
+               execl(binary, binary, (char*)(NULL));
+               _exit(1);
           }
 
-          terminal->escape_state = 0;
-          return;
+          // the prompt may be split across reads, so the tail of the last one is kept in front of the next
+          const size_t prompt_length = strlen(STARTUP_PROMPT);
+          char buffer[BUFSIZ];
+          size_t kept = 0;
+          bool found = false;
+          while(!found){
+               struct pollfd output = {host, POLLIN, 0};
+               if(poll(&output, 1, STARTUP_TIMEOUT_MS) <= 0) break;
+
+               ssize_t rc = read(host, buffer + kept, sizeof(buffer) - kept);
+               if(rc <= 0) break;
+
+               size_t length = kept + rc;
+               found = memmem(buffer, length, STARTUP_PROMPT, prompt_length) != NULL;
+               kept = (length < prompt_length) ? length : prompt_length - 1;
+               memmove(buffer, buffer + length - kept, kept);
+          }
+          times[i] = time_nanoseconds() - start;
+
+          kill(pid, SIGKILL);
+          waitpid(pid, NULL, 0);
+          close(host);
+
+          if(!found){
+               fprintf(stderr, "%s never showed the prompt\n", binary);
+               return 1;
+          }
      }
 
-     Glyph_t* current_glyph = terminal->lines[terminal->cursor.y] + terminal->cursor.x;
-     if(terminal->mode & TERMINAL_MODE_WRAP && terminal->cursor.state & CURSOR_STATE_WRAPNEXT){
-          current_glyph->attributes |= GLYPH_ATTRIBUTE_WRAP;
-          terminal_put_newline(terminal, true);
-          current_glyph = terminal->lines[terminal->cursor.y] + terminal->cursor.x;
+     qsort(times, session_count, sizeof(*times), latency_compare);
+     printf("%d sessions of %s, first prompt after min %.2f ms max %.2f ms\n", session_count, binary, times[0] / 1e6,
+            times[session_count - 1] / 1e6);
+     printf("startup: %.2f ms\n", times[session_count / 2] / 1e6);
+     free(times);
+     return 0;
+}
+
+typedef struct{
+     int         file_descriptor;
+     const char* data;
+     size_t      length;
+}PtyWriter_t;
+
+// plays the child, writing the input over and over until BENCH_PTY_BYTES have gone by, then hanging up
+void* bench_pty_writer(void* data)
+{
+     PtyWriter_t* writer = (PtyWriter_t*)(data);
+
+     for(uint64_t written = 0; written < BENCH_PTY_BYTES;){
+          size_t chunk = writer->length;
+          if(chunk > BENCH_PTY_BYTES - written) chunk = BENCH_PTY_BYTES - written;
+          if(!tty_write(writer->file_descriptor, writer->data, chunk)) break;
+          written += chunk;
      }
 
-     if(terminal->mode & TERMINAL_MODE_INSERT && terminal->cursor.x + width < terminal->columns){
-          memmove(current_glyph + width, current_glyph, (terminal->columns - terminal->cursor.x - width) * sizeof(*current_glyph));
+     close(writer->file_descriptor);
+     return NULL;
+}
+
+// pushes the input through a real pty to the parser, returns MB/s. with a path, a transcript is kept there as well
+double bench_pty_pass(const char* data, size_t length, const char* transcript)
+{
+     Terminal_t* terminal = calloc(1, sizeof(*terminal));
+     if(!terminal || !terminal_init(terminal, 24, 80)) return 0;
+
+     int slave;
+     if(openpty(&terminal->file_descriptor, &slave, NULL, NULL, NULL) < 0) return 0;
+
+     // the line discipline left as it is would turn every newline into two bytes
+     struct termios attributes;
+     tcgetattr(slave, &attributes);
+     cfmakeraw(&attributes);
+     tcsetattr(slave, TCSANOW, &attributes);
+
+     Pipeline_t pipeline = {};
+     SessionLog_t session_log = {};
+     if(transcript){
+          if(!session_log_start(&session_log, transcript)) return 0;
+          pipeline.session_log = &session_log;
      }
 
-     if(terminal->cursor.x + width > terminal->columns){
-          terminal_put_newline(terminal, true);
+     uint64_t start = time_nanoseconds();
+     PtyWriter_t writer = {slave, data, length};
+     pthread_t writer_thread;
+     if(!pipeline_start(&pipeline, terminal, 0, -1)) return 0;
+     if(pthread_create(&writer_thread, NULL, bench_pty_writer, &writer) != 0) return 0;
+
+     uint64_t last_frame = 0;
+     while(!__atomic_load_n(&pipeline.drained, __ATOMIC_ACQUIRE)){
+          pipeline_wait_frame(&pipeline, &last_frame, NULL, time_nanoseconds() + DRAW_USEC_LIMIT * 1000ULL);
      }
+     uint64_t elapsed = time_nanoseconds() - start;
 
-     terminal_set_glyph(terminal, rune, &terminal->cursor.attributes, terminal->cursor.x, terminal->cursor.y);
+     pthread_join(writer_thread, NULL);
+     pipeline_stop(&pipeline);
+     close(terminal->file_descriptor);
+     return BENCH_PTY_BYTES / (elapsed / 1e9) / 1e6;
+}
 
-     if(terminal->cursor.x + width < terminal->columns){
-          terminal_move_cursor_to(terminal, terminal->cursor.x + width, terminal->cursor.y);
-     }else{
-          terminal->cursor.state |= CURSOR_STATE_WRAPNEXT;
+// what keeping a transcript costs the pipeline, with a GB of the input going through a pty either way
+int bench_pty(int argc, char** argv)
+{
+     size_t length;
+     char* data = bench_parse_input(argc, argv, &length);
+     if(!data || length == 0) return 1;
+
+     char transcript[PATH_MAX];
+     snprintf(transcript, sizeof(transcript), "%s/cursed-bench-%d.transcript", P_tmpdir, getpid());
+
+     double plain = bench_pty_pass(data, length, NULL);
+     double logged = bench_pty_pass(data, length, transcript);
+
+     // the transcript and its rotated pieces, which between them should hold all of it
+     uint64_t transcript_size = 0;
+     int pieces = 0;
+     char piece[PATH_MAX + 16];
+     snprintf(piece, sizeof(piece), "%s", transcript);
+     for(struct stat piece_stat; stat(piece, &piece_stat) == 0;){
+          transcript_size += piece_stat.st_size;
+          unlink(piece);
+          snprintf(piece, sizeof(piece), "%s.%d", transcript, ++pieces);
+     }
+
+     printf("%llu MB through a pty, a transcript of %" PRIu64 " MB in %d pieces\n", BENCH_PTY_BYTES >> 20,
+            transcript_size >> 20, pieces);
+     printf("pty: %.1f MB/s\n", plain);
+     printf("transcript: %.1f MB/s\n", logged);
+     free(data);
+     if(transcript_size != BENCH_PTY_BYTES){
+          printf("transcript is %" PRIu64 " bytes, expected %llu\n", transcript_size, BENCH_PTY_BYTES);
+          return 1;
      }
+     return (plain > 0 && logged > 0) ? 0 : 1;
 }
 
-void terminal_echo(Terminal_t* terminal, Rune_t rune)
+// sessions whose child exits straight away, timed from the fork until the main loop would let go of them
+int bench_exit(int argc, char** argv)
 {
-     if(is_controller(rune)){
-          if(rune & 0x80){
-               rune &= 0x7f;
-               terminal_put(terminal, '^');
-               terminal_put(terminal, '[');
-          }else if(rune != '\n' && rune != '\r' && rune != '\t'){
-               rune ^= 0x40;
-               terminal_put(terminal, '^');
+     int session_count = (argc > 0) ? atoi(argv[0]) : 200;
+     int child_signal = child_signal_block();
+     if(child_signal < 0 || session_count <= 0) return 1;
+
+     Terminal_t* terminal = calloc(1, sizeof(*terminal));
+     if(!terminal || !terminal_init(terminal, 24, 80)) return 1;
+
+     setenv("SHELL", "/bin/true", 1);
+     uint64_t total = 0;
+     uint64_t longest = 0;
+     uint64_t cpu_start = bench_thread_nanoseconds();
+
+     for(int i = 0; i < session_count; ++i){
+          uint64_t start = time_nanoseconds();
+          pid_t pid;
+          if(!tty_create(terminal->rows, terminal->columns, &pid, &terminal->file_descriptor)) return 1;
+
+          Pipeline_t pipeline = {};
+          if(!pipeline_start(&pipeline, terminal, pid, child_signal)) return 1;
+
+          uint64_t last_frame = 0;
+          while(!pipeline_finished(&pipeline)){
+               pipeline_wait_frame(&pipeline, &last_frame, NULL, time_nanoseconds() + DRAW_USEC_LIMIT * 1000ULL);
           }
+
+          uint64_t elapsed = time_nanoseconds() - start;
+          total += elapsed;
+          if(elapsed > longest) longest = elapsed;
+
+          pipeline_stop(&pipeline);
+          close(terminal->file_descriptor);
      }
 
-     terminal_put(terminal, rune);
+     printf("%d sessions of /bin/true, %.1f us of the main thread's cpu each\n", session_count,
+            (bench_thread_nanoseconds() - cpu_start) / 1000.0 / session_count);
+     printf("exit: %.1f us/session, longest %.1f us\n", total / 1000.0 / session_count, longest / 1000.0);
+     return 0;
 }
 
-void handle_signal_child(int signal)
+// held down keys, letters and arrows, decoded a read's worth at a time the way the main loop does
+int bench_keys(int argc, char** argv)
 {
-     LOG("%s(%d)\n", __FUNCTION__, signal);
+     const int key_count = 1 << 22;
+     if(!key_trie_build()) return 1;
+
+     char* input = malloc(key_count * 3);
+     char* output = malloc(BUFSIZ);
+     if(!input || !output) return 1;
+
+     size_t length = 0;
+     for(int i = 0; i < key_count; ++i){
+          if(i % 4 == 3){
+               memcpy(input + length, "\033OA", 3);
+               length += 3;
+          }else{
+               input[length++] = 'a' + (i % 26);
+          }
+     }
+
+     uint64_t start = time_nanoseconds();
+     size_t written = 0;
+     for(size_t offset = 0; offset < length;){
+          size_t chunk = (length - offset < BUFSIZ) ? length - offset : BUFSIZ;
+          size_t used;
+          written += key_decode(input + offset, chunk, TERMINAL_MODE_APPKEYPAD, 0, NULL, output, &used);
+          offset += used;
+     }
+     uint64_t elapsed = time_nanoseconds() - start;
+
+     printf("decoded %d keys, %zu bytes to %zu\n", key_count, length, written);
+     printf("keys: %.2f ns/key\n", (double)(elapsed) / key_count);
+     free(input);
+     free(output);
+     return 0;
 }
 
-bool tty_create(int rows, int columns, pid_t* pid, int* tty_file_descriptor)
+// a 300 column log scrolling by, drawn through a window the size of the screen and one the size of a small console,
+// then panned up by hand. returns the cpu time spent drawing, and whether the pan showed the rows above
+uint64_t bench_viewport_frames(const char* data, size_t length, int window_rows, int window_columns, size_t* bytes,
+                               bool* panned)
 {
-     int master_file_descriptor;
-     int slave_file_descriptor;
-     struct winsize window_size = {rows, columns, 0, 0};
+     const int frame_bytes = 1024;
+     FILE* file = tmpfile();
+     Terminal_t* terminal = calloc(1, sizeof(*terminal));
+     View_t* view = calloc(1, sizeof(*view));
+     VTOutput_t* vt = calloc(1, sizeof(*vt));
+     WINDOW* window = newwin(window_rows, window_columns, 0, 0);
+     if(!file || !terminal || !view || !vt || !window || !terminal_init(terminal, 48, 300) ||
+        !vt_output_init(vt, fileno(file), window_rows, window_columns, 0, 0)){
+          return 0;
+     }
+     view_init(view, window);
 
-     if(openpty(&master_file_descriptor, &slave_file_descriptor, NULL, NULL, &window_size) < 0){
-          LOG("openpty() failed: '%s'\n", strerror(errno));
-          return false;
+     // panned to the bottom left by hand, following the cursor would chase it along every line
+     view->follow = false;
+     view->viewport_y = terminal->rows;
+
+     uint64_t elapsed = 0;
+     for(size_t offset = 0; offset < length;){
+          int chunk = (length - offset < frame_bytes) ? length - offset : frame_bytes;
+          int consumed = terminal_parse(terminal, data + offset, chunk);
+          offset += consumed ? consumed : chunk;
+
+          uint64_t start = bench_thread_nanoseconds();
+          vt_output_draw(vt, view, terminal);
+          vt_output_flush(vt, view);
+          elapsed += bench_thread_nanoseconds() - start;
      }
 
-     switch(*pid = fork()){
-     case -1:
-          LOG("fork() failed\n");
-          break;
-     case 0:
-          setsid();
+     // nothing the child wrote is dirty, only the pan moves what the window shows
+     KeyInput_t* keys = calloc(1, sizeof(*keys));
+     if(!keys) return 0;
+     keys->actions[KEY_ACTION_PAN_UP] = 5;
+     view_apply_keys(view, terminal, keys);
+     vt_output_draw(vt, view, terminal);
+     vt_output_flush(vt, view);
+     *panned = true;
+     for(int c = 0; c < view->viewport_columns; ++c){
+          if(vt->shadow[1][c + 1].rune != view->lines[view->viewport_y][view->viewport_x + c].rune) *panned = false;
+     }
+     free(keys);
 
-          dup2(slave_file_descriptor, 0);
-          dup2(slave_file_descriptor, 1);
-          dup2(slave_file_descriptor, 2);
+     struct stat file_stat;
+     *bytes = (fstat(fileno(file), &file_stat) == 0) ? file_stat.st_size : 0;
+     delwin(window);
+     fclose(file);
+     return elapsed;
+}
 
-          if(ioctl(slave_file_descriptor, TIOCSCTTY, NULL)){
-               LOG("ioctl() TIOCSCTTY failed: '%s'\n", strerror(errno));
-               return false;
-          }
+int bench_viewport(int argc, char** argv)
+{
+     const int lines = 20000;
+     size_t capacity = lines * 320;
+     char* data = malloc(capacity);
+     if(!data) return 1;
+
+     size_t length = 0;
+     for(int i = 0; i < lines; ++i){
+          length += snprintf(data + length, capacity - length, "\033[3%dm%6d\033[0m", i % 8, i);
+          for(int c = 0; c < 290; ++c) data[length++] = 'a' + (i + c) % 26;
+          length += snprintf(data + length, capacity - length, "\r\n");
+     }
 
-          close(slave_file_descriptor);
-          close(master_file_descriptor);
+     SCREEN* screen = bench_screen(fopen("/dev/null", "w"));
+     if(!screen) return 1;
 
-          {
-               const struct passwd* pw;
-               char* shell = getenv("SHELL");
-               if(!shell) shell = DEFAULT_SHELL;
-
-               pw = getpwuid(getuid());
-               if(pw == NULL){
-                    LOG("getpwuid() failed: '%s'\n", strerror(errno));
-                    return false;
-               }
+     size_t full_bytes;
+     size_t clipped_bytes;
+     bool full_panned;
+     bool clipped_panned;
+     uint64_t full = bench_viewport_frames(data, length, 48 + 2, 300 + 2, &full_bytes, &full_panned);
+     uint64_t clipped = bench_viewport_frames(data, length, 24 + 2, 80 + 2, &clipped_bytes, &clipped_panned);
+     int frames = (length + 1023) / 1024;
 
-               char** args = (char *[]){NULL};
-
-               unsetenv("COLUMNS");
-               unsetenv("LINES");
-               unsetenv("TERMCAP");
-               setenv("LOGNAME", pw->pw_name, 1);
-               setenv("USER", pw->pw_name, 1);
-               setenv("SHELL", shell, 1);
-               setenv("HOME", pw->pw_dir, 1);
-               setenv("TERM", TERM_NAME, 1);
-
-               signal(SIGCHLD, SIG_DFL);
-               signal(SIGHUP, SIG_DFL);
-               signal(SIGINT, SIG_DFL);
-               signal(SIGQUIT, SIG_DFL);
-               signal(SIGTERM, SIG_DFL);
-               signal(SIGALRM, SIG_DFL);
-
-               execvp(shell, args);
-               _exit(1);
-          }
-          break;
-     default:
-          close(slave_file_descriptor);
-          *tty_file_descriptor = master_file_descriptor;
-          signal(SIGCHLD, handle_signal_child);
-          break;
-     }
+     endwin();
+     delscreen(screen);
 
-     return true;
+     printf("300x48 screen, %d frames of a %d line log\n", frames, lines);
+     printf("whole screen: %8.0f bytes/frame %7.1f us/frame\n", (double)(full_bytes) / frames, full / 1000.0 / frames);
+     printf("80x24 window: %8.0f bytes/frame %7.1f us/frame\n", (double)(clipped_bytes) / frames,
+            clipped / 1000.0 / frames);
+
+     free(data);
+     if(!full_panned || !clipped_panned){
+          printf("panning did not show the rows above\n");
+          return 1;
+     }
+     return 0;
 }
 
-bool tty_write(int file_descriptor, const char* string, size_t len)
+// a full screen with a single blinking word, flipped as if the timer came due every frame, against drawing it all
+int bench_blink(int argc, char** argv)
 {
-     ssize_t written = 0;
+     const int flips = 10000;
+     FILE* file = tmpfile();
+     Terminal_t* terminal = calloc(1, sizeof(*terminal));
+     View_t* view = calloc(1, sizeof(*view));
+     VTOutput_t* vt = calloc(1, sizeof(*vt));
+     SCREEN* screen = bench_screen(fopen("/dev/null", "w"));
+     if(!file || !terminal || !view || !vt || !screen || !terminal_init(terminal, 24, 80) ||
+        !vt_output_init(vt, fileno(file), 24 + 2, 80 + 2, 0, 0)){
+          return 1;
+     }
 
-     while(written < len){
-          ssize_t rc = write(file_descriptor, string, len - written);
+     WINDOW* window = newwin(24 + 2, 80 + 2, 0, 0);
+     if(!window) return 1;
+     view_init(view, window);
 
-          if(rc < 0){
-               printf("%s() write() to terminal failed: %s", __FUNCTION__, strerror(errno));
-               return false;
+     char text[BUFSIZ * 4];
+     int length = snprintf(text, sizeof(text), "\033[H");
+     for(int r = 0; r < terminal->rows; ++r){
+          length += snprintf(text + length, sizeof(text) - length, "\033[%d;1H\033[3%dm", r + 1, r % 8);
+          for(int c = 0; c < terminal->columns; ++c) text[length++] = 'a' + (r + c) % 26;
+     }
+     length += snprintf(text + length, sizeof(text) - length, "\033[12;38H\033[5mALERT\033[0m e\xcc\x81");
+     terminal_parse(terminal, text, length);
+     vt_output_draw(vt, view, terminal);
+     vt_output_flush(vt, view);
+
+     uint64_t times[2] = {0};
+     off_t bytes[2] = {0};
+     for(int redraw = 0; redraw < 2; ++redraw){
+          off_t start_bytes = lseek(fileno(file), 0, SEEK_CUR);
+          uint64_t start = bench_thread_nanoseconds();
+          for(int i = 0; i < flips; ++i){
+               if(redraw) terminal_all_dirty(terminal);
+               view->blink_deadline = 1;
+               vt_output_draw(vt, view, terminal);
+               vt_output_flush(vt, view);
           }
+          times[redraw] = bench_thread_nanoseconds() - start;
+          bytes[redraw] = lseek(fileno(file), 0, SEEK_CUR) - start_bytes;
+     }
 
-          written += rc;
-          string += rc;
+     // a flip sends the blinking row again, and the cluster beside the word has to go with the copies of this frame
+     // while another row's takes the place its copy had
+     const char other[] = "\033[1;1Ha\xcc\x8a";
+     for(int i = 0; i < 2; ++i){
+          terminal_parse(terminal, other, sizeof(other) - 1);
+          view->blink_deadline = 1;
+          vt_output_draw(vt, view, terminal);
+          vt_output_flush(vt, view);
      }
+     Glyph_t* cluster = vt->screen[12] + 1 + 43;
+     bool flipped = (cluster->rune & RUNE_CLUSTER_BIT) && vt->clusters[cluster->rune & ~RUNE_CLUSTER_BIT].runes[1] == 0x301;
 
-     return true;
+     delwin(window);
+     endwin();
+     delscreen(screen);
+     fclose(file);
+
+     printf("80x24 screen, %d blinking rows, %d flips\n", view->blink_rows, flips);
+     printf("spans:  %6.0f bytes/flip %6.1f us/flip\n", (double)(bytes[0]) / flips, times[0] / 1000.0 / flips);
+     printf("redraw: %6.0f bytes/flip %6.1f us/flip\n", (double)(bytes[1]) / flips, times[1] / 1000.0 / flips);
+     if(!flipped){
+          printf("a cluster on the blinking row was drawn wrong\n");
+          return 1;
+     }
+     return 0;
 }
 
-void* tty_reader(void* data)
+// the nearest prompt before line the way it is found without marks, reading history back until a line starts with one
+int64_t bench_marks_rescan(Terminal_t* terminal, int64_t line)
 {
-     TTYThreadData_t* thread_data = (TTYThreadData_t*)(data);
+     History_t* history = &terminal->history;
+     char text[HISTORY_TEXT_SIZE];
+     while(--line >= history->start){
+          HistoryLine_t* history_line = history_get(history, line);
+          if(!history_line) continue;
+          int length = history_line_text(history, history_line, text, sizeof(text));
+          if(length >= 2 && text[0] == '$' && text[1] == ' ') return line;
+     }
+     return -1;
+}
 
-     char buffer[BUFSIZ];
-     int buffer_length = 0;
-     Rune_t decoded;
-     size_t decoded_length;
+// a shell session marked the way shells with semantic prompts do it, then prompts jumped to and outputs pulled back
+int bench_marks(int argc, char** argv)
+{
+     const int commands = 10000;
+     const int lookups = 100000;
+     const int rescans = 1000;
+     Terminal_t* terminal = calloc(1, sizeof(*terminal));
+     char* text = malloc(BUFSIZ * 4);
+     if(!terminal || !text || !terminal_init(terminal, 24, 80)) return 1;
+
+     uint64_t start = bench_thread_nanoseconds();
+     for(int i = 0; i < commands; ++i){
+          int length = snprintf(text, BUFSIZ * 4, "\033]133;A\a$ \033]133;B\acommand %d\r\n\033]133;C\a", i);
+          // outputs of 1 to 64 lines, so a prompt is a screen or two back on average
+          for(int j = 0; j <= i % 64; ++j){
+               length += snprintf(text + length, BUFSIZ * 4 - length, "output %d.%d\r\n", i, j);
+          }
+          length += snprintf(text + length, BUFSIZ * 4 - length, "\033]133;D;%d\a", i % 3);
+          terminal_parse(terminal, text, length);
+     }
+     uint64_t parse_time = bench_thread_nanoseconds() - start;
+
+     History_t* history = &terminal->history;
+     Marks_t* marks = &terminal->marks;
+     uint64_t seed = 1;
+     int64_t* lines = malloc(lookups * sizeof(*lines));
+     if(!lines) return 1;
+     for(int i = 0; i < lookups; ++i){
+          seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+          lines[i] = history->start + (seed >> 33) % (history->end - history->start);
+     }
 
-     while(true){
-          int rc = read(thread_data->terminal->file_descriptor, buffer, ELEM_COUNT(buffer));
+     // both ways of finding the prompt have to agree
+     int mismatches = 0;
+     start = bench_thread_nanoseconds();
+     for(int i = 0; i < rescans; ++i){
+          if(bench_marks_rescan(terminal, lines[i]) < 0) mismatches++;
+     }
+     uint64_t rescan_time = bench_thread_nanoseconds() - start;
 
-          if(rc < 0){
-               LOG("%s() failed to read from tty file descriptor: '%s'\n", __FUNCTION__, strerror(errno));
-               return NULL;
-          }
+     int64_t found = 0;
+     start = bench_thread_nanoseconds();
+     for(int i = 0; i < lookups; ++i){
+          Mark_t* mark = marks_prompt(terminal, lines[i], false);
+          if(mark) found += mark->line;
+     }
+     uint64_t jump_time = bench_thread_nanoseconds() - start;
 
-          buffer_length = rc;
+     for(int i = 0; i < rescans; ++i){
+          Mark_t* mark = marks_prompt(terminal, lines[i], false);
+          if(!mark || mark->line != bench_marks_rescan(terminal, lines[i])) mismatches++;
+     }
 
-          for(int i = 0; i < buffer_length; ++i){
-               if(utf8_decode(buffer + i, buffer_length, &decoded_length, &decoded)){
-                    terminal_put(thread_data->terminal, decoded);
-                    i += (decoded_length - 1);
-               }
-          }
+     char* output = malloc(BUFSIZ * 4);
+     char* expected = malloc(BUFSIZ * 4);
+     if(!output || !expected) return 1;
+     start = bench_thread_nanoseconds();
+     for(int i = 0; i < lookups; ++i){
+          seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+          if(marks_command_output(terminal, 1 + (seed >> 33) % commands, output, BUFSIZ * 4) < 0) mismatches++;
+     }
+     uint64_t output_time = bench_thread_nanoseconds() - start;
 
-          sleep(0);
+     for(int i = 0; i < commands; i += 97){
+          int length = 0;
+          for(int j = 0; j <= i % 64; ++j){
+               length += snprintf(expected + length, BUFSIZ * 4 - length, "output %d.%d\n", i, j);
+          }
+          if(marks_command_output(terminal, i + 1, output, BUFSIZ * 4) != length ||
+             memcmp(output, expected, length) != 0){
+               mismatches++;
+          }
      }
+
+     if(found == 0) mismatches++;
+
+     printf("%d commands, %" PRId64 " lines of history, %u marks of %zu bytes, parsed in %.1f ms\n", commands,
+            history->end - history->start, marks->count - marks->first, sizeof(*marks->marks), parse_time / 1000000.0);
+     printf("prompt rescan: %8.1f us/jump\n", rescan_time / 1000.0 / rescans);
+     printf("prompt marks:  %8.3f us/jump\n", jump_time / 1000.0 / lookups);
+     printf("output marks:  %8.3f us/command\n", output_time / 1000.0 / lookups);
+     printf("mismatches: %d\n", mismatches);
+     return mismatches ? 1 : 0;
 }
 
-void* tty_write_keys(void* data)
+// every line matching the pattern, oldest first, found by reading the whole history
+int bench_search_scan(History_t* history, const char* pattern, bool is_regex, int64_t* matches, int capacity)
 {
-     TTYThreadData_t* thread_data = (TTYThreadData_t*)(data);
-     int rc, key;
-     char character = 0;
-     char* string = NULL;
-     size_t len = 0;
-     bool free_string = false;
-
-     while(true){
-          key = getch();
-          string = keybound(key, 0);
+     regex_t regex;
+     if(is_regex && regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB) != 0) return -1;
+
+     char text[HISTORY_TEXT_SIZE];
+     int count = 0;
+     for(int64_t line = history->start; line < history->end && count < capacity; ++line){
+          history_line_text(history, history_get(history, line), text, HISTORY_TEXT_SIZE);
+          if(is_regex ? regexec(&regex, text, 0, NULL, 0) == 0 : strstr(text, pattern) != NULL) matches[count++] = line;
+     }
 
-          if(!string){
-               free_string = false;
-               len = 1;
+     if(is_regex) regfree(&regex);
+     return count;
+}
 
-               switch(key){
-               default:
-                    character = key;
-                    break;
-               // damnit curses
-               case 10:
-                    character = 13;
-                    break;
+// parses a service log with a rare error in it, which is what gets searched for, returns the cpu time it took
+uint64_t bench_search_log(Terminal_t* terminal, int lines, char* text)
+{
+     const int error_interval = 65537;
+
+     uint64_t start = bench_thread_nanoseconds();
+     for(int i = 0; i < lines;){
+          int length = 0;
+          for(; i < lines && length < BUFSIZ * 3; ++i){
+               if(i % error_interval == error_interval - 1){
+                    length += snprintf(text + length, BUFSIZ * 4 - length,
+                                       "12:%02d:%02d ERROR disk quota exceeded on volume %d\r\n", i / 60 % 60, i % 60,
+                                       i / error_interval);
+               }else{
+                    length += snprintf(text + length, BUFSIZ * 4 - length,
+                                       "12:%02d:%02d worker %d handled request %d in %d ms\r\n", i / 60 % 60, i % 60,
+                                       i % 8, i, i * 7 % 900);
                }
-
-               string = (char*)(&character);
-          }else{
-               free_string = true;
-               len = strlen(string);
           }
+          terminal_parse(terminal, text, length);
+     }
+     return bench_thread_nanoseconds() - start;
+}
 
-          switch(key){
-          default:
-               break;
-          case 17:
-               g_quit = true;
-               break;
+int bench_search(int argc, char** argv)
+{
+     const int lines = HISTORY_SIZE;
+     const int match_capacity = 4096;
+     Terminal_t* terminal = calloc(1, sizeof(*terminal));
+     char* text = malloc(BUFSIZ * 4);
+     if(!terminal || !text || !terminal_init(terminal, 24, 80)) return 1;
+
+     uint64_t parse_time = bench_search_log(terminal, lines, text);
+     uint64_t start;
+
+     History_t* history = &terminal->history;
+     struct{
+          const char* pattern;
+          bool        is_regex;
+     }queries[] = {
+          {"ERROR disk quota", false},
+          {"ERROR .* volume [0-9]*7$", true},
+          {"handled request 424242 ", false},
+          {"segmentation fault", false},
+     };
+
+     int64_t* expected = malloc(match_capacity * sizeof(*expected));
+     if(!expected) return 1;
+
+     printf("%" PRId64 " lines of history, parsed in %.1f ms\n", history->end - history->start, parse_time / 1000000.0);
+     int mismatches = 0;
+     for(int q = 0; q < ELEM_COUNT(queries); ++q){
+          const char* pattern = queries[q].pattern;
+          bool is_regex = queries[q].is_regex;
+
+          start = bench_thread_nanoseconds();
+          int count = bench_search_scan(history, pattern, is_regex, expected, match_capacity);
+          uint64_t scan_time = bench_thread_nanoseconds() - start;
+
+          // the newest match is what the prompt shows first
+          int64_t match = -1;
+          start = bench_thread_nanoseconds();
+          bool found = history_search(history, pattern, is_regex, history->end - 1, true, &match);
+          uint64_t first_time = bench_thread_nanoseconds() - start;
+          if(found != (count > 0) || (found && match != expected[count - 1])) mismatches++;
+
+          // every match, walking back from the newest and forward from the oldest
+          int backward = 0;
+          start = bench_thread_nanoseconds();
+          for(int64_t from = history->end - 1; history_search(history, pattern, is_regex, from, true, &match);
+              from = match - 1){
+               if(backward >= count || match != expected[count - 1 - backward]) mismatches++;
+               backward++;
           }
-
-          rc = write(thread_data->terminal->file_descriptor, string, len);
-          if(rc < 0){
-               printf("%s() write() to terminal failed: %s", __FUNCTION__, strerror(errno));
-               return NULL;
+          uint64_t backward_time = bench_thread_nanoseconds() - start;
+
+          int forward = 0;
+          start = bench_thread_nanoseconds();
+          for(int64_t from = history->start; history_search(history, pattern, is_regex, from, false, &match);
+              from = match + 1){
+               if(forward >= count || match != expected[forward]) mismatches++;
+               forward++;
           }
+          uint64_t forward_time = bench_thread_nanoseconds() - start;
+          if(backward != count || forward != count) mismatches++;
 
-          if(thread_data->terminal->mode & TERMINAL_MODE_ECHO){
-               for(int i = 0; i < len; i++){
-                    terminal_echo(thread_data->terminal, string[i]);
-               }
-          }
+          printf("%-26s %4d matches  scan %8.2f ms  newest %8.3f ms  all back %8.3f ms  all forward %8.3f ms\n",
+                 pattern, count, scan_time / 1000000.0, first_time / 1000000.0, backward_time / 1000000.0,
+                 forward_time / 1000000.0);
+     }
 
-          if(free_string) free(string);
+     // what the index costs the parser: the same log parsed into fresh terminals with and without it, taking turns so
+     // neither gets the warmer cache, and the fastest of each kept
+     const int rounds = 3;
+     const int compared_lines = HISTORY_SIZE / 4;
+     uint64_t best[2] = {UINT64_MAX, UINT64_MAX};
+     for(int round = 0; round < rounds; ++round){
+          for(int indexed = 0; indexed < 2; ++indexed){
+               Terminal_t* compared = calloc(1, sizeof(*compared));
+               if(!compared || !terminal_init(compared, 24, 80)) return 1;
+               compared->history.indexed = indexed;
+               uint64_t elapsed = bench_search_log(compared, compared_lines, text);
+               if(elapsed < best[indexed]) best[indexed] = elapsed;
+          }
      }
 
-     return NULL;
+     double plain_ns = (double)best[0] / compared_lines;
+     double indexed_ns = (double)best[1] / compared_lines;
+     printf("parse: %.1f ns/line without the index, %.1f ns/line with it, %.1f%% of parse throughput\n", plain_ns,
+            indexed_ns, (1.0 - plain_ns / indexed_ns) * 100.0);
+     printf("mismatches: %d\n", mismatches);
+     return mismatches ? 1 : 0;
 }
 
-bool utf8_decode(const char* buffer, size_t buffer_len, size_t* len, Rune_t* u)
+// a copy of the screen kept by something other than the renderer, brought up to date every interval frames
+typedef struct{
+     int       interval;
+     uint64_t  generation;
+     Glyph_t** lines;
+     bool*     changed;
+     uint64_t  syncs;
+     uint64_t  rows_copied;
+     uint64_t  mismatches;
+}GenerationConsumer_t;
+
+void bench_consumer_row(Terminal_t* terminal, int r, Glyph_t* line)
 {
-     if(buffer_len < 1) return false;
+     RowFill_t* fill = terminal->fills + r;
+     memcpy(line, terminal->lines[r], fill->from * sizeof(*line));
+     for(int c = fill->from; c < terminal->columns; ++c) line[c] = fill->blank;
+}
 
-     // 0xxxxxxx is just ascii
-     if((buffer[0] & 0x80) == 0){
-          *len = 1;
-          *u = buffer[0];
-     // 110xxxxx is a 2 byte utf8 string
-     }else if((char)(buffer[0] & ~0x1F) == (char)(0xC0)){
-          if(buffer_len < 2) return false;
+void bench_consumer_sync(GenerationConsumer_t* consumer, Terminal_t* terminal, bool take_scroll, Glyph_t* check)
+{
+     Scroll_t scroll;
+     consumer->generation = terminal_changes(terminal, consumer->generation, consumer->changed,
+                                             take_scroll ? &scroll : NULL);
+     if(take_scroll && scroll.count) rows_rotate(consumer->lines, scroll.top, scroll.bottom, scroll.count);
+
+     for(int r = 0; r < terminal->rows; ++r){
+          if(consumer->changed[r]){
+               bench_consumer_row(terminal, r, consumer->lines[r]);
+               consumer->rows_copied++;
+          }
 
-          *len = 2;
-          *u = buffer[0] & 0x1F;
-          *u <<= 6;
-          *u |= buffer[1] & 0x3F;
-     // 1110xxxx is a 3 byte utf8 string
-     }else if((char)(buffer[0] & ~0x0F) == (char)(0xE0)){
-          if(buffer_len < 3) return false;
+          // whatever was skipped has to match what a full rescan would have copied
+          bench_consumer_row(terminal, r, check);
+          if(memcmp(check, consumer->lines[r], terminal->columns * sizeof(*check)) != 0) consumer->mismatches++;
+     }
+     consumer->syncs++;
+}
 
-          *len = 3;
-          *u = buffer[0] & 0x0F;
-          *u <<= 6;
-          *u |= buffer[1] & 0x3F;
-          *u <<= 6;
-          *u |= buffer[2] & 0x3F;
-     // 11110xxx is a 4 byte utf8 string
-     }else if((char)(buffer[0] & ~0x07) == (char)(0xF0)){
-          if(buffer_len < 4) return false;
+// consumers that catch up at different rates each copy only the rows that changed since they last looked
+int bench_generations(int argc, char** argv)
+{
+     const int frame_bytes = 256;
+     const int intervals[] = {1, 4, 16, 64};
+     size_t length;
+     char* data = bench_parse_input(argc, argv, &length);
+     if(!data || length == 0) return 1;
+
+     Terminal_t* terminal = calloc(1, sizeof(*terminal));
+     Glyph_t* check = calloc(80, sizeof(*check));
+     GenerationConsumer_t consumers[ELEM_COUNT(intervals)] = {};
+     if(!terminal || !check || !terminal_init(terminal, 24, 80)) return 1;
+
+     for(int i = 0; i < ELEM_COUNT(intervals); ++i){
+          GenerationConsumer_t* consumer = consumers + i;
+          consumer->interval = intervals[i];
+          consumer->lines = calloc(terminal->rows, sizeof(*consumer->lines));
+          consumer->changed = calloc(terminal->rows, sizeof(*consumer->changed));
+          if(!consumer->lines || !consumer->changed) return 1;
+          for(int r = 0; r < terminal->rows; ++r){
+               consumer->lines[r] = calloc(terminal->columns, sizeof(*consumer->lines[r]));
+               if(!consumer->lines[r]) return 1;
+          }
+     }
 
-          *len = 4;
-          *u = buffer[0] & 0x0F;
-          *u <<= 6;
-          *u |= buffer[1] & 0x3F;
-          *u <<= 6;
-          *u |= buffer[2] & 0x3F;
-          *u <<= 6;
-          *u |= buffer[3] & 0x3F;
-     }else{
-          return false;
+     int frames = 0;
+     for(size_t offset = 0; offset < length; ++frames){
+          int chunk = (length - offset < frame_bytes) ? length - offset : frame_bytes;
+          int consumed = terminal_parse(terminal, data + offset, chunk);
+          offset += consumed ? consumed : chunk;
+
+          // the consumer syncing every frame takes scrolls like the renderer, the rest copy what moved
+          for(int i = 0; i < ELEM_COUNT(intervals); ++i){
+               if(frames % consumers[i].interval == 0) bench_consumer_sync(consumers + i, terminal, i == 0, check);
+          }
      }
 
-     return true;
+     printf("%d frames of 80x24, a frame every %d bytes of %zu byte input\n", frames, frame_bytes, length);
+     uint64_t mismatches = 0;
+     for(int i = 0; i < ELEM_COUNT(intervals); ++i){
+          GenerationConsumer_t* consumer = consumers + i;
+          printf("every %2d frames: %6.2f of %d rows copied per sync, %" PRIu64 " rows differing from a rescan\n",
+                 consumer->interval, (double)(consumer->rows_copied) / consumer->syncs, terminal->rows,
+                 consumer->mismatches);
+          mismatches += consumer->mismatches;
+     }
+
+     free(data);
+     return mismatches ? 1 : 0;
 }
 
-bool utf8_encode(Rune_t u, char* buffer, size_t buffer_len, int* len)
+typedef struct{
+     const char* name;
+     bool        stop;
+     uint64_t    snapshots;
+     uint64_t    retries;
+     bool        attached;
+}ExportReader_t;
+
+// another process reading the screen as often as it can, through nothing but screen_export.h
+void* bench_export_reader(void* arg)
 {
-     if(u < 0x80){
-          if(buffer_len < 1) return false;
-          *len = 1;
+     ExportReader_t* reader = arg;
+     ScreenExportReader_t export;
+     if(!screen_export_attach(&export, reader->name)) return NULL;
+     reader->attached = true;
+
+     ScreenExportCell_t* cells = calloc(screen_export_cell_count(&export), sizeof(*cells));
+     uint64_t* generations = calloc(export.shared->row_capacity, sizeof(*generations));
+     while(cells && generations && !__atomic_load_n(&reader->stop, __ATOMIC_RELAXED)){
+          ScreenExportState_t state;
+          screen_export_read(&export, &state, cells, generations);
+          reader->snapshots++;
+          reader->retries += state.retries;
+     }
 
-          // leave as-is
-          buffer[0] = u;
-     }else if(u < 0x0800){
-          if(buffer_len < 2) return false;
-          *len = 2;
+     free(cells);
+     free(generations);
+     screen_export_detach(&export);
+     return NULL;
+}
 
-          // u = 00000000 00000000 00000abc defghijk
+// parses the input a frame at a time and publishes each, returns the cpu time spent publishing
+uint64_t bench_export_frames(const char* data, size_t length, ScreenExporter_t* exporter, int* frames)
+{
+     const int frame_bytes = 256;
+     Terminal_t* terminal = calloc(1, sizeof(*terminal));
+     View_t* view = calloc(1, sizeof(*view));
+     if(!terminal || !view || !terminal_init(terminal, 24, 80)) return 0;
 
-          // 2 bytes
-          // first byte:  110abcde
-          buffer[0] = 0xC0 | ((u >> 6) & 0x1f);
+     uint64_t elapsed = 0;
+     *frames = 0;
+     for(int pass = 0; pass < 4; ++pass){
+          for(size_t offset = 0; offset < length;){
+               int chunk = (length - offset < frame_bytes) ? length - offset : frame_bytes;
+               int consumed = terminal_parse(terminal, data + offset, chunk);
+               offset += consumed ? consumed : chunk;
+               view_snapshot(view, terminal);
+
+               uint64_t start = bench_thread_nanoseconds();
+               screen_export_publish(exporter, view);
+               elapsed += bench_thread_nanoseconds() - start;
+               (*frames)++;
+          }
+     }
+     return elapsed;
+}
 
-          // second byte: 10fghijk
-          buffer[1] = 0x80 | (u & 0x3f);
-     }else if(u < 0x10000){
-          if(buffer_len < 3) return false;
-          *len = 3;
+// a cluster on a row that only moved with a scroll is published with the row, true when it came out right
+bool bench_export_scrolled_cluster(const char* name)
+{
+     const char first[] = "\033[24;1He\xcc\x81";
+     const char second[] = "\r\na\xcc\x8a";
+     ScreenExporter_t exporter;
+     Terminal_t* terminal = calloc(1, sizeof(*terminal));
+     View_t* view = calloc(1, sizeof(*view));
+     if(!terminal || !view || !terminal_init(terminal, 24, 80) || !screen_export_create(&exporter, name, 24, 80)){
+          return false;
+     }
 
-          // u = 00000000 00000000 abcdefgh ijklmnop
+     terminal_parse(terminal, first, sizeof(first) - 1);
+     view_snapshot(view, terminal);
+     screen_export_publish(&exporter, view);
+     terminal_parse(terminal, second, sizeof(second) - 1);
+     view_snapshot(view, terminal);
+     screen_export_publish(&exporter, view);
+
+     Rune_t runes[CLUSTER_MAX_RUNES];
+     cluster_runes(&terminal->clusters, terminal->lines[22][0].rune, runes);
+     bool published = screen_export_cells(exporter.shared)[22 * exporter.shared->column_capacity].rune == runes[0];
+     screen_export_destroy(&exporter);
+     return published;
+}
 
-          // 3 bytes
-          // first byte:  1110abcd
-          buffer[0] = 0xE0 | ((u >> 12) & 0x0F);
+// what publishing costs the emulator with nobody reading, and with readers copying the screen in a loop
+int bench_export(int argc, char** argv)
+{
+     const int reader_counts[] = {0, 1, 4};
+     size_t length;
+     char* data = bench_parse_input(argc, argv, &length);
+     if(!data || length == 0) return 1;
+
+     char name[NAME_MAX];
+     snprintf(name, sizeof(name), "/cursed-bench-%d", (int)(getpid()));
+
+     for(int i = 0; i < ELEM_COUNT(reader_counts); ++i){
+          ScreenExporter_t exporter;
+          if(!screen_export_create(&exporter, name, 24, 80)) return 1;
+
+          ExportReader_t readers[4] = {};
+          pthread_t threads[4];
+          for(int r = 0; r < reader_counts[i]; ++r){
+               readers[r].name = name;
+               if(pthread_create(threads + r, NULL, bench_export_reader, readers + r) != 0) return 1;
+          }
 
-          // second byte: 10efghij
-          buffer[1] = 0x80 | ((u >> 6) & 0x3F);
+          int frames;
+          uint64_t elapsed = bench_export_frames(data, length, &exporter, &frames);
+
+          uint64_t snapshots = 0;
+          uint64_t retries = 0;
+          for(int r = 0; r < reader_counts[i]; ++r){
+               __atomic_store_n(&readers[r].stop, true, __ATOMIC_RELAXED);
+               pthread_join(threads[r], NULL);
+               if(!readers[r].attached) return 1;
+               snapshots += readers[r].snapshots;
+               retries += readers[r].retries;
+          }
+          screen_export_destroy(&exporter);
 
-          // third byte:  10klmnop
-          buffer[2] = 0x80 | (u & 0x3F);
-     }else if(u < 0x110000){
-          if(buffer_len < 4) return false;
-          *len = 4;
+          printf("%d readers: publish %.2f us/frame over %d frames, %" PRIu64 " snapshots read, %.2f%% retried\n",
+                 reader_counts[i], elapsed / 1000.0 / frames, frames, snapshots,
+                 snapshots ? retries * 100.0 / (snapshots + retries) : 0.0);
+     }
 
-          // u = 00000000 000abcde fghijklm nopqrstu
+     free(data);
+     if(!bench_export_scrolled_cluster(name)){
+          printf("a cluster that scrolled was published wrong\n");
+          return 1;
+     }
+     return 0;
+}
 
-          // 4 bytes
-          // first byte:  11110abc
-          buffer[0] = 0xF0 | ((u >> 18) & 0x07);
-          // second byte: 10defghi
-          buffer[1] = 0x80 | ((u >> 12) & 0x3F);
-          // third byte:  10jklmno
-          buffer[2] = 0x80 | ((u >> 6) & 0x3F);
-          // fourth byte: 10pqrstu
-          buffer[3] = 0x80 | (u & 0x3F);
+typedef struct{
+     const char* name;
+     int (*run)(int argc, char** argv);
+}Benchmark_t;
+
+Benchmark_t g_benchmarks[] = {
+     {"width", bench_width},
+     {"render", bench_render},
+     {"output", bench_output},
+     {"parse", bench_parse},
+     {"latency", bench_latency},
+     {"ring", bench_ring},
+     {"keys", bench_keys},
+     {"exit", bench_exit},
+     {"startup", bench_startup},
+     {"pty", bench_pty},
+     {"export", bench_export},
+     {"generations", bench_generations},
+     {"viewport", bench_viewport},
+     {"blink", bench_blink},
+     {"marks", bench_marks},
+     {"search", bench_search},
+};
+
+int run_benchmark(const char* name, int argc, char** argv)
+{
+     for(int i = 0; i < ELEM_COUNT(g_benchmarks); ++i){
+          if(strcmp(g_benchmarks[i].name, name) == 0) return g_benchmarks[i].run(argc, argv);
      }
 
-     return true;
+     fprintf(stderr, "unknown benchmark '%s', available:", name);
+     for(int i = 0; i < ELEM_COUNT(g_benchmarks); ++i) fprintf(stderr, " %s", g_benchmarks[i].name);
+     fprintf(stderr, "\n");
+     return 1;
 }
 
 int main(int argc, char** argv)
 {
      setlocale(LC_ALL, "");
 
+     int opt;
+     while((opt = getopt(argc, argv, "b:g:l:o:t:x:spH")) != -1){
+          switch(opt){
+          default:
+               fprintf(stderr, "usage: %s [-s] [-p] [-H] [-g columnsxrows] [-o curses|vt] [-t transcript] [-x shm name] "
+                       "[-l error|warn|info|debug] "
+                       "[-b benchmark [files...]]\n", argv[0]);
+               return 1;
+          case 't':
+               // keep everything the child writes in this file
+               g_session_log_path = optarg;
+               break;
+          case 'g':
+               // the screen may be bigger than the host, the window onto it pans
+               if(sscanf(optarg, "%dx%d", &g_screen_columns, &g_screen_rows) != 2 || g_screen_columns < 1 ||
+                  g_screen_rows < 1){
+                    fprintf(stderr, "bad geometry '%s', expected columnsxrows\n", optarg);
+                    return 1;
+               }
+               break;
+          case 'x':
+               // publish the screen for other processes in this shared memory object, see screen_export.h
+               g_screen_export_name = optarg;
+               break;
+          case 'H':
+               // hold the final screen once the child exits
+               g_hold = true;
+               break;
+          case 'o':
+               if(strcmp(optarg, "vt") == 0){
+                    g_vt_output = true;
+               }else if(strcmp(optarg, "curses") != 0){
+                    fprintf(stderr, "unknown output '%s'\n", optarg);
+                    return 1;
+               }
+               break;
+          case 'p':
+               // measure typing latency, reported with the stats on SIGUSR1
+               g_latency.enabled = true;
+               break;
+          case 's':
+               g_stats_overlay = true;
+               break;
+          case 'l':
+               g_log_level = -1;
+               for(int i = 0; i < ELEM_COUNT(g_log_level_names); ++i){
+                    if(strcmp(optarg, g_log_level_names[i]) == 0) g_log_level = i;
+               }
+               if(g_log_level < 0){
+                    fprintf(stderr, "unknown log level '%s'\n", optarg);
+                    return 1;
+               }
+               break;
+          case 'b':
+               // benchmarks run headless, without a log, curses or a shell
+               g_log_level = -1;
+               return run_benchmark(optarg, argc - optind, argv + optind);
+          }
+     }
+
+     // before the first thread starts, so none of them takes SIGCHLD away from the signalfd, nor SIGUSR1 from the
+     // main loop, which only takes it while it waits
+     sigset_t stats_signal;
+     sigemptyset(&stats_signal);
+     sigaddset(&stats_signal, SIGUSR1);
+     pthread_sigmask(SIG_BLOCK, &stats_signal, NULL);
+     int child_signal = child_signal_block();
+     if(child_signal < 0){
+          fprintf(stderr, "failed to watch for the child exiting: %s\n", strerror(errno));
+          return 1;
+     }
+
      // setup log
      {
-          g_log = fopen(LOGFILE_NAME, "w");
-          if(!g_log){
+          if(!log_start(LOGFILE_NAME)){
                fprintf(stderr, "failed to create log file: %s\n", LOGFILE_NAME);
                return 1;
           }
@@ -1704,35 +8028,30 @@ int main(int argc, char** argv)
      int tty_file_descriptor;
      pid_t tty_pid;
 
-     // init terminal structure
+     if(!terminal_init(&terminal, g_screen_rows, g_screen_columns)){
+          LOG(LOG_LEVEL_ERROR, "failed to allocate terminal\n");
+          return 1;
+     }
+
+     Pipeline_t pipeline = {};
+
+     if(g_session_log_path){
+          pipeline.session_log = calloc(1, sizeof(*pipeline.session_log));
+          if(!pipeline.session_log || !session_log_start(pipeline.session_log, g_session_log_path)) return 1;
+     }
+
+     // create terminal, the shell starts up while curses does
      {
-          terminal.columns = 80;
-          terminal.rows = 24;
-          terminal.bottom = terminal.rows - 1;
-
-          // allocate lines
-          terminal.lines = calloc(terminal.rows, sizeof(*terminal.lines));
-          for(int r = 0; r < terminal.rows; ++r){
-               terminal.lines[r] = calloc(terminal.columns, sizeof(*terminal.lines[r]));
-
-               // default fg and bg
-               for(int g = 0; g < terminal.columns; ++g){
-                    terminal.lines[r][g].foreground = -1;
-                    terminal.lines[r][g].background = -1;
-               }
+          if(!tty_create(terminal.rows, terminal.columns, &tty_pid, &tty_file_descriptor)){
+               return 1;
           }
 
-          terminal.alternate_lines = calloc(terminal.rows, sizeof(*terminal.alternate_lines));
-          for(int r = 0; r < terminal.rows; ++r){
-               terminal.alternate_lines[r] = calloc(terminal.columns, sizeof(*terminal.alternate_lines[r]));
-          }
+          terminal.file_descriptor = tty_file_descriptor;
 
-          terminal.tabs = calloc(terminal.columns, sizeof(*terminal.tabs));
-          terminal.dirty_lines = calloc(terminal.rows, sizeof(*terminal.dirty_lines));
-          terminal_reset(&terminal);
+          if(!pipeline_start(&pipeline, &terminal, tty_pid, child_signal)) return 1;
      }
 
-     WINDOW* view = NULL;
+     WINDOW* window = NULL;
      int entire_window_width;
      int entire_window_height;
 
@@ -1744,158 +8063,214 @@ int main(int argc, char** argv)
      // init curses
      {
           initscr();
-          keypad(stdscr, TRUE);
+          keypad(stdscr, TRUE); // the host keypad then sends sequences key_decode() can tell from digits
           raw();
           cbreak();
           noecho();
           start_color();
           use_default_colors();
+          g_color_count = COLORS;
 
           getmaxyx(stdscr, entire_window_height, entire_window_width);
 
+          // a screen bigger than the host is shown through a window as big as the host
+          if(view_width > entire_window_width) view_width = entire_window_width;
+          if(view_height > entire_window_height) view_height = entire_window_height;
+
           // find the top left corner of a centered window
           view_x = ((entire_window_width - view_width) / 2);
           view_y = ((entire_window_height - view_height) / 2);
 
-          view = newwin(view_height, view_width, view_y, view_x);
+          window = newwin(view_height, view_width, view_y, view_x);
      }
 
-     ColorDefs_t color_defs;
-     color_defs.count = 0;
-
-     pthread_t tty_read_thread;
-     pthread_t tty_write_thread;
+     View_t* view = calloc(1, sizeof(*view));
+     if(!view){
+          LOG(LOG_LEVEL_ERROR, "failed to allocate view\n");
+          return 1;
+     }
+     view_init(view, window);
 
-     // create terminal
-     {
-          if(!tty_create(terminal.rows, terminal.columns, &tty_pid, &tty_file_descriptor)){
+     VTOutput_t* vt = NULL;
+     if(g_vt_output){
+          vt = calloc(1, sizeof(*vt));
+          if(!vt || !vt_output_init(vt, STDOUT_FILENO, view_height, view_width, view_x, view_y)){
+               LOG(LOG_LEVEL_ERROR, "failed to allocate vt output\n");
                return 1;
           }
+     }
 
-          terminal.file_descriptor = tty_file_descriptor;
+     // a terminal never outgrows the host screen, nor the size it started at
+     ScreenExporter_t* exporter = NULL;
+     if(g_screen_export_name){
+          exporter = calloc(1, sizeof(*exporter));
+          uint32_t row_capacity = (entire_window_height > terminal.rows) ? entire_window_height : terminal.rows;
+          uint32_t column_capacity = (entire_window_width > terminal.columns) ? entire_window_width : terminal.columns;
+          if(!exporter || !screen_export_create(exporter, g_screen_export_name, row_capacity, column_capacity)) return 1;
+     }
 
-          TTYThreadData_t* data = calloc(1, sizeof(*data));
-          data->terminal = &terminal;
+     // SIGUSR1 asks for the counters to be written out
+     signal(SIGUSR1, handle_signal_stats);
 
-          int rc = pthread_create(&tty_read_thread, NULL, tty_reader, data);
-          if(rc != 0){
-               LOG("pthread_create() failed: '%s'\n", strerror(errno));
-               return 1;
-          }
+     // keys are read raw from stdin on this thread, curses never reads them
+     KeyInput_t* keys = calloc(1, sizeof(*keys));
+     if(!keys || !key_input_init(keys, &terminal, STDIN_FILENO)){
+          LOG(LOG_LEVEL_ERROR, "failed to set up key input\n");
+          return 1;
      }
-
-     // setup getch thread
-     {
-          TTYThreadData_t* data = calloc(1, sizeof(*data));
-          data->terminal = &terminal;
-          int rc = pthread_create(&tty_write_thread, NULL, tty_write_keys, data);
-          if(rc != 0){
-               LOG("pthread_create() failed: '%s'\n", strerror(errno));
-               return 1;
-          }
+     // the search prompt is always taken, the pan keys only when there is somewhere to pan to
+     keys->take_actions = 1u << KEY_ACTION_SEARCH;
+     if(view_width < terminal.columns + 2 || view_height < terminal.rows + 2){
+          for(int i = KEY_ACTION_PAN_UP; i <= KEY_ACTION_FOLLOW; ++i) keys->take_actions |= 1u << i;
      }
 
      clear();
      refresh();
 
-     struct timeval previous_draw_time;
-     struct timeval current_draw_time;
-     uint64_t elapsed = 0;
-     int32_t color_pair = 0;
-     int32_t last_color_foreground = -1;
-     int32_t last_color_background = -1;
+     uint64_t last_frame = 0;
+
+     trace_thread("main");
+
+     StatsShard_t* overlay_stats = calloc(2, sizeof(*overlay_stats));
+     uint64_t overlay_time = time_nanoseconds();
+     char overlay[256] = "";
+     bool status_shown = false;
 
      // main program loop
-     while(!g_quit){
-          gettimeofday(&previous_draw_time, NULL);
+     while(!g_quit && !pipeline_finished(&pipeline)){
+          // only blinking and the overlay wake an idle session on a timer
+          uint64_t deadline = view->blink_rows ? view->blink_deadline : 0;
+          if(g_stats_overlay && (!deadline || overlay_time + STATS_OVERLAY_NS < deadline)){
+               deadline = overlay_time + STATS_OVERLAY_NS;
+          }
+          bool frame = pipeline_wait_frame(&pipeline, &last_frame, keys, deadline);
+          if(key_input_has_actions(keys)) view_apply_keys(view, &terminal, keys);
+
+          if(g_stats_requested){
+               g_stats_requested = 0;
+               if(stats_write(STATS_FILE_NAME)){
+                    LOG(LOG_LEVEL_INFO, "wrote stats to %s\n", STATS_FILE_NAME);
+               }else{
+                    LOG(LOG_LEVEL_ERROR, "failed to write stats to %s: '%s'\n", STATS_FILE_NAME, strerror(errno));
+               }
 
-          do{
-               gettimeofday(&current_draw_time, NULL);
-               elapsed = (current_draw_time.tv_sec - previous_draw_time.tv_sec) * 1000000LL +
-                         (current_draw_time.tv_usec - previous_draw_time.tv_usec);
-          }while(elapsed < DRAW_USEC_LIMIT);
-
-          wstandend(view);
-          box(view, 0, 0);
-
-          for(int r = 0; r < terminal.rows; ++r){
-               if(terminal.dirty_lines[r]){
-                    for(int c = 0; c < terminal.columns; ++c){
-                         Glyph_t* glyph = terminal.lines[r] + c;
-
-                         if(last_color_foreground != glyph->foreground || last_color_background != glyph->background){
-                              wstandend(view);
-
-                              if(glyph->foreground == COLOR_FOREGROUND && glyph->background == COLOR_BACKGROUND){
-                                   // no need to create a new color pair for the default
-                              }else{
-                                   // does the new glyph match an existing definition?
-                                   int32_t matched_pair = -1;
-                                   for(int32_t i = 0; i < color_defs.count; ++i){
-                                        if(glyph->foreground == color_defs.pairs[i].foreground &&
-                                           glyph->background == color_defs.pairs[i].background){
-                                             matched_pair = i;
-                                             break;
-                                        }
-                                   }
-
-                                   // if so use that color pair
-                                   if(matched_pair >= 0){
-                                        wattron(view, COLOR_PAIR(matched_pair));
-                                   }else{
-                                        // increment the color pair we are going to define, but make sure it wraps around to 0 at the max
-                                        color_pair++;
-                                        color_pair %= COLOR_PAIRS;
-                                        if(color_pair == 0) color_pair++; // when we wrap around, start at 1, because curses doesn't like 0 index color pairs
-
-                                        // create the pair definition
-                                        init_pair(color_pair, glyph->foreground, glyph->background);
-
-                                        // set our internal definition
-                                        color_defs.pairs[color_pair].foreground = glyph->foreground;
-                                        color_defs.pairs[color_pair].background = glyph->background;
-
-                                        // override the count if we haven't wrapped around
-                                        int32_t new_count = color_pair;
-                                        if(new_count > color_defs.count) color_defs.count = new_count;
-
-                                        wattron(view, COLOR_PAIR(color_pair));
-                                   }
-                              }
-
-                              last_color_foreground = glyph->foreground;
-                              last_color_background = glyph->background;
-                         }
-
-                         if(glyph->rune < 0x80){
-                              mvwaddch(view, r + 1, c + 1, glyph->rune);
-                         }else{
-                              char utf8_string[UTF8_SIZE];
-                              int len;
-                              utf8_encode(glyph->rune, utf8_string, UTF8_SIZE, &len);
-                              utf8_string[len] = 0;
-                              mvwaddstr(view, r + 1, c + 1, utf8_string);
-                         }
-                    }
+#ifdef TRACE
+               if(trace_write(TRACE_FILE_NAME)){
+                    LOG(LOG_LEVEL_INFO, "wrote trace to %s\n", TRACE_FILE_NAME);
+               }else{
+                    LOG(LOG_LEVEL_ERROR, "failed to write trace to %s: '%s'\n", TRACE_FILE_NAME, strerror(errno));
+               }
+#endif
+          }
+
+          // blinking glyphs flip on a timer of their own, which is never waited for while none are on screen
+          bool blink = view->blink_rows && time_nanoseconds() >= view->blink_deadline;
+
+          // without a frame there is only the overlay to keep current
+          if(!frame && !blink && !g_stats_overlay) continue;
+
+          uint64_t frame_start = time_nanoseconds();
+
+          if(frame || blink){
+               if(vt){
+                    vt_output_draw(vt, view, &terminal);
+               }else{
+                    view_draw(view, &terminal);
+               }
+               // observers are shown the screen, which the view copies again whole once the search is done
+               if(exporter && !view->scrolled_back) screen_export_publish(exporter, view);
+          }
+
+          if(g_stats_overlay && overlay_stats){
+               if(frame_start - overlay_time >= STATS_OVERLAY_NS){
+                    stats_total(overlay_stats + 1);
+                    stats_overlay(overlay, sizeof(overlay), overlay_stats, overlay_stats + 1, frame_start - overlay_time);
+                    overlay_stats[0] = overlay_stats[1];
+                    overlay_time = frame_start;
+               }
+          }
 
-                    terminal.dirty_lines[r] = false;
+          // the search prompt takes the place of the overlay while it is open
+          const char* status = keys->searching ? view->search_status : (g_stats_overlay ? overlay : NULL);
+          if(status){
+               // drawn over the bottom border, which view_draw() redraws every frame
+               if(vt){
+                    vt_output_status(vt, status);
+               }else{
+                    wstandend(window);
+                    mvwaddnstr(window, view_height - 1, 1, status, view_width - 2);
+
+                    int cursor_row;
+                    int cursor_column;
+                    view_cursor(view, &cursor_row, &cursor_column);
+                    wmove(window, cursor_row, cursor_column);
                }
+          }else if(vt && status_shown){
+               // the vt backend draws its border once, so it is put back by hand
+               vt_output_status(vt, "");
+          }
+          status_shown = status != NULL;
+
+          if(vt){
+               vt_output_flush(vt, view);
+          }else{
+               TRACE_SCOPE("refresh");
+               wrefresh(window);
           }
 
-          wmove(view, terminal.cursor.y + 1, terminal.cursor.x + 1);
-          wrefresh(view);
+          // written after the frame, so it never lands in the middle of one
+          if(view->clipboard_ready){
+               view->clipboard_ready = false;
+               view_export_clipboard(view, STDOUT_FILENO);
+          }
+          if(!frame) continue;
+
+          latency_displayed();
+
+          uint64_t frame_time = time_nanoseconds() - frame_start;
+          STAT_ADD(STAT_FRAME_NS, frame_time);
+          STAT_RECORD(HISTOGRAM_FRAME_NS, frame_time);
+     }
+
+     int status = 0;
+     if(pipeline.child_exited){
+          status = WIFEXITED(pipeline.child_status) ? WEXITSTATUS(pipeline.child_status) :
+                   128 + WTERMSIG(pipeline.child_status);
+          LOG(LOG_LEVEL_INFO, "child exited with %d, the last of its output took %.1f ms\n", status,
+              (time_nanoseconds() - pipeline.child_exited) / 1e6);
+
+          if(g_hold && !g_quit){
+               // nothing runs while the final screen is up, a key press is all that is waited for
+               char message[64];
+               snprintf(message, sizeof(message), " exited with status %d, press a key ", status);
+               if(vt){
+                    vt_output_status(vt, message);
+                    vt_output_flush(vt, view);
+               }else{
+                    wstandend(window);
+                    mvwaddnstr(window, view_height - 1, 1, message, view_width - 2);
+                    wrefresh(window);
+               }
+
+               struct pollfd key = {STDIN_FILENO, POLLIN, 0};
+               poll(&key, 1, -1);
+          }
      }
 
-     pthread_cancel(tty_read_thread);
-     pthread_join(tty_read_thread, NULL);
-     pthread_cancel(tty_write_thread);
-     pthread_join(tty_write_thread, NULL);
+     pipeline_stop(&pipeline);
+
+     if(vt) vt_output_stop(vt);
+     if(exporter) screen_export_destroy(exporter);
 
      // cleanup curses
-     delwin(view);
+     delwin(window);
      endwin();
 
-     fclose(g_log);
+#ifdef TRACE
+     trace_write(TRACE_FILE_NAME);
+#endif
 
-     return 0;
+     log_stop();
+
+     return status;
 }
@@ -0,0 +1,158 @@
+// the screen as cursed -x name publishes it in the posix shared memory object of that name, and what it takes to
+// read it from another process. the emulator bumps sequence to odd before it changes anything and to even after, so
+// a reader copies what it wants, then checks sequence has not moved, without any system call or lock
+
+#ifndef SCREEN_EXPORT_H
+#define SCREEN_EXPORT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SCREEN_EXPORT_MAGIC 0x73727563u // "curs" in memory
+#define SCREEN_EXPORT_VERSION 1
+
+typedef struct{
+     uint32_t rune;       // the first rune of a cluster, 0 for the right half of a wide glyph
+     uint32_t attributes; // as cursed keeps them: bold 1, faint 2, italic 4, underline 8, blink 16, reverse 32, wide 512
+     int32_t  foreground; // palette index, -1 for the default
+     int32_t  background;
+}ScreenExportCell_t;
+
+// followed by row_capacity row generations, then row_capacity rows of column_capacity cells each
+typedef struct{
+     uint32_t magic;
+     uint32_t version;
+     uint32_t row_capacity;
+     uint32_t column_capacity;
+     uint32_t sequence;
+     uint32_t rows;         // this and everything after it only changes while sequence is odd
+     uint32_t columns;
+     int32_t  cursor_x;
+     int32_t  cursor_y;
+     uint32_t reserved;
+     uint64_t frame;        // how many times the screen was published, a row's generation is the frame it last changed
+}ScreenExport_t;
+
+static inline size_t screen_export_size(uint32_t row_capacity, uint32_t column_capacity)
+{
+     return sizeof(ScreenExport_t) + row_capacity * sizeof(uint64_t) +
+            (size_t)(row_capacity) * column_capacity * sizeof(ScreenExportCell_t);
+}
+
+static inline uint64_t* screen_export_generations(const ScreenExport_t* shared)
+{
+     return (uint64_t*)(shared + 1);
+}
+
+static inline ScreenExportCell_t* screen_export_cells(const ScreenExport_t* shared)
+{
+     return (ScreenExportCell_t*)(screen_export_generations(shared) + shared->row_capacity);
+}
+
+typedef struct{
+     const ScreenExport_t* shared;
+     size_t                size;
+     uint64_t*             seen; // generations of the rows copied by the attempt in progress
+}ScreenExportReader_t;
+
+typedef struct{
+     uint32_t rows;
+     uint32_t columns;
+     int32_t  cursor_x;
+     int32_t  cursor_y;
+     uint64_t frame;
+     uint32_t retries; // attempts that raced the emulator and were thrown away
+}ScreenExportState_t;
+
+static inline bool screen_export_attach(ScreenExportReader_t* reader, const char* name)
+{
+     int file_descriptor = shm_open(name, O_RDONLY, 0);
+     if(file_descriptor < 0) return false;
+
+     struct stat file_stat;
+     void* shared = MAP_FAILED;
+     if(fstat(file_descriptor, &file_stat) == 0 && file_stat.st_size >= (off_t)(sizeof(ScreenExport_t))){
+          shared = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, file_descriptor, 0);
+     }
+     close(file_descriptor);
+     if(shared == MAP_FAILED) return false;
+
+     reader->shared = (const ScreenExport_t*)(shared);
+     reader->size = file_stat.st_size;
+     reader->seen = NULL;
+
+     const ScreenExport_t* header = reader->shared;
+     if(header->magic != SCREEN_EXPORT_MAGIC || header->version != SCREEN_EXPORT_VERSION ||
+        reader->size < screen_export_size(header->row_capacity, header->column_capacity) ||
+        !(reader->seen = (uint64_t*)(calloc(header->row_capacity, sizeof(uint64_t))))){
+          munmap(shared, reader->size);
+          return false;
+     }
+     return true;
+}
+
+static inline void screen_export_detach(ScreenExportReader_t* reader)
+{
+     munmap((void*)(reader->shared), reader->size);
+     free(reader->seen);
+}
+
+// how many cells the buffer handed to screen_export_read() needs
+static inline size_t screen_export_cell_count(const ScreenExportReader_t* reader)
+{
+     return (size_t)(reader->shared->row_capacity) * reader->shared->column_capacity;
+}
+
+// copies a consistent screen into cells, a row every column_capacity cells. generations holds row_capacity entries
+// of what the caller already has, zeroed at first, and only rows whose generation moved on since are copied
+static inline void screen_export_read(ScreenExportReader_t* reader, ScreenExportState_t* state,
+                                      ScreenExportCell_t* cells, uint64_t* generations)
+{
+     const ScreenExport_t* shared = reader->shared;
+     const uint64_t* shared_generations = screen_export_generations(shared);
+     const ScreenExportCell_t* shared_cells = screen_export_cells(shared);
+     uint32_t column_capacity = shared->column_capacity;
+     state->retries = 0;
+
+     while(true){
+          uint32_t sequence = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+          if(sequence & 1){
+               // the emulator is part way through, and on a busy machine may have been preempted there
+               state->retries++;
+               sched_yield();
+               continue;
+          }
+
+          state->rows = __atomic_load_n(&shared->rows, __ATOMIC_RELAXED);
+          state->columns = __atomic_load_n(&shared->columns, __ATOMIC_RELAXED);
+          state->cursor_x = __atomic_load_n(&shared->cursor_x, __ATOMIC_RELAXED);
+          state->cursor_y = __atomic_load_n(&shared->cursor_y, __ATOMIC_RELAXED);
+          state->frame = __atomic_load_n(&shared->frame, __ATOMIC_RELAXED);
+
+          // a torn read of the sizes is thrown away below, but must not take the copy out of bounds first
+          uint32_t rows = (state->rows < shared->row_capacity) ? state->rows : shared->row_capacity;
+          uint32_t columns = (state->columns < column_capacity) ? state->columns : column_capacity;
+
+          for(uint32_t r = 0; r < rows; ++r){
+               reader->seen[r] = __atomic_load_n(shared_generations + r, __ATOMIC_RELAXED);
+               if(reader->seen[r] == generations[r]) continue;
+               memcpy(cells + r * column_capacity, shared_cells + r * column_capacity, columns * sizeof(*cells));
+          }
+
+          __atomic_thread_fence(__ATOMIC_ACQUIRE);
+          if(__atomic_load_n(&shared->sequence, __ATOMIC_RELAXED) == sequence){
+               memcpy(generations, reader->seen, rows * sizeof(*generations));
+               return;
+          }
+          state->retries++;
+     }
+}
+
+#endif